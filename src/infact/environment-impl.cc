@@ -33,25 +33,71 @@
 /// Implementation of the Environment class.
 /// \author dbikel@google.com (Dan Bikel)
 
+#include <fstream>
+
 #include "environment-impl.h"
 #include "factory.h"
 
 namespace infact {
 
-EnvironmentImpl::EnvironmentImpl(int debug) {
-  debug_ = debug;
+namespace {
+
+/// Returns whether a numeric literal of the specified inferred type (or
+/// vector of them) may initialize a variable of the specified explicit
+/// type, which is the case for <tt>int</tt> literals of <tt>int64</tt>
+/// variables and <tt>double</tt> literals of <tt>float</tt> variables,
+/// since literals are only ever inferred to be <tt>int</tt>s or
+/// <tt>double</tt>s.
+bool NumberConverts(const string &inferred_type, const string &type) {
+  return (inferred_type == "int" && type == "int64") ||
+      (inferred_type == "int[]" && type == "int64[]") ||
+      (inferred_type == "double" && type == "float") ||
+      (inferred_type == "double[]" && type == "float[]");
+}
 
+}  // namespace
+
+shared_ptr<const TypeTable>
+TypeTable::Current(int debug) {
+  static std::mutex mutex;
+  static shared_ptr<const TypeTable> current;
+  // The tables are rebuilt only when they are out of date, so that
+  // constructing an environment usually takes constant time.
+  uint64_t generation = FactoryContainer::Generation();
+  shared_ptr<const TypeTable> types = std::atomic_load(&current);
+  if (types != nullptr && types->generation_ == generation) {
+    return types;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  types = std::atomic_load(&current);
+  if (types == nullptr || types->generation_ != generation) {
+    types.reset(new TypeTable(generation, debug));
+    std::atomic_store(&current, types);
+  }
+  return types;
+}
+
+TypeTable::TypeTable(uint64_t generation, int debug) :
+    generation_(generation) {
   // Set up VarMap instances for each of the primitive types and their vectors.
-  var_map_["bool"] = new VarMap<bool>("bool", this);
-  var_map_["int"] = new VarMap<int>("int", this);
-  var_map_["double"] = new VarMap<double>("double", this);
-  var_map_["string"] = new VarMap<string>("string", this);
-  var_map_["bool[]"] = new VarMap<vector<bool> >("bool[]", "bool", this);
-  var_map_["int[]"] = new VarMap<vector<int> >("int[]", "int", this);
-  var_map_["double[]"] =
-      new VarMap<vector<double> >("double[]", "double", this);
-  var_map_["string[]"] =
-      new VarMap<vector<string> >("string[]", "string", this);
+  prototypes_["bool"].reset(new VarMap<bool>("bool", nullptr));
+  prototypes_["int"].reset(new VarMap<int>("int", nullptr));
+  prototypes_["int64"].reset(new VarMap<int64_t>("int64", nullptr));
+  prototypes_["float"].reset(new VarMap<float>("float", nullptr));
+  prototypes_["double"].reset(new VarMap<double>("double", nullptr));
+  prototypes_["string"].reset(new VarMap<string>("string", nullptr));
+  prototypes_["bool[]"].reset(
+      new VarMap<vector<bool> >("bool[]", "bool", nullptr));
+  prototypes_["int[]"].reset(
+      new VarMap<vector<int> >("int[]", "int", nullptr));
+  prototypes_["int64[]"].reset(
+      new VarMap<vector<int64_t> >("int64[]", "int64", nullptr));
+  prototypes_["float[]"].reset(
+      new VarMap<vector<float> >("float[]", "float", nullptr));
+  prototypes_["double[]"].reset(
+      new VarMap<vector<double> >("double[]", "double", nullptr));
+  prototypes_["string[]"].reset(
+      new VarMap<vector<string> >("string[]", "string", nullptr));
 
   // Set up VarMap instances for each of the Factory-constructible types
   // and their vectors.
@@ -61,20 +107,22 @@ EnvironmentImpl::EnvironmentImpl(int debug) {
     (*factory_it)->CollectRegistered(registered);
     string base_name = (*factory_it)->BaseName();
 
-    // Create type-specific VarMap from the Factory and add to var_map_.
-    VarMapBase *obj_var_map = (*factory_it)->CreateVarMap(this);
-    var_map_[obj_var_map->Name()] = obj_var_map;
+    // Create type-specific VarMap from the Factory and add to prototypes_.
+    VarMapBase *obj_var_map = (*factory_it)->CreateVarMap(nullptr);
+    prototypes_[obj_var_map->Name()].reset(obj_var_map);
 
-    if (debug_ >= 3) {
+    if (debug >= 3) {
       cerr << "Environment: created VarMap for " << obj_var_map->Name()
            << endl;
     }
 
-    // Create VarMap for vectors of shared_object of T and add to var_map_.
-    VarMapBase *obj_vector_var_map = (*factory_it)->CreateVectorVarMap(this);
-    var_map_[obj_vector_var_map->Name()] = obj_vector_var_map;
+    // Create VarMap for vectors of shared_object of T and add to
+    // prototypes_.
+    VarMapBase *obj_vector_var_map =
+        (*factory_it)->CreateVectorVarMap(nullptr);
+    prototypes_[obj_vector_var_map->Name()].reset(obj_vector_var_map);
 
-    if (debug_ >= 3) {
+    if (debug >= 3) {
       cerr << "Environment: created VarMap for " << obj_vector_var_map->Name()
            << endl;
     }
@@ -96,7 +144,7 @@ EnvironmentImpl::EnvironmentImpl(int debug) {
       }
       concrete_to_factory_type_[concrete_type_name] = base_name;
 
-      if (debug_ >= 3) {
+      if (debug >= 3) {
         cerr << "Environment: associating concrete typename "
              << concrete_type_name
              << " with factory for " << base_name << endl;
@@ -105,9 +153,225 @@ EnvironmentImpl::EnvironmentImpl(int debug) {
   }
 }
 
+EnvironmentImpl::EnvironmentImpl(int debug) :
+    types_(TypeTable::Current(debug)) {
+  debug_ = debug;
+}
+
+EnvironmentImpl::EnvironmentImpl(EnvironmentImpl *parent) :
+    parent_(parent),
+    types_(parent->types_),
+    debug_(parent->debug_) {
+}
+
+EnvironmentImpl *
+EnvironmentImpl::Fork() {
+  // Forks only read this scope, which must therefore never need to
+  // materialize deferred bindings again.
+  MaterializeAll();
+  EnvironmentImpl *fork = new EnvironmentImpl(this);
+  fork->forked_ = true;
+  return fork;
+}
+
 void
 EnvironmentImpl::ReadAndSet(const string &varname, StreamTokenizer &st,
                             const string type) {
+  string varmap_type;
+  VarMapBase *var_map = CheckValue(varname, st, type, &varmap_type);
+  ConstructReaders(varname);
+  DropDeferred(varname);
+  var_map->ReadAndSet(varname, st);
+  Bind(varname, varmap_type);
+  lazy_.erase(varname);
+}
+
+void
+EnvironmentImpl::DecodeAndSet(const string &varname, const string &type,
+                              const char *data, size_t size,
+                              const shared_ptr<const FileBuffer> &buffer) {
+  VarMapBase *var_map = GetVarMapForType(type);
+  if (var_map == nullptr || !var_map->IsPrimitive()) {
+    ostringstream err_ss;
+    err_ss << "Environment: error: cannot decode variable " << varname
+           << " of type \"" << type << "\"";
+    Error(err_ss.str());
+  }
+  ConstructReaders(varname);
+  DropDeferred(varname);
+  var_map->DecodeValue(varname, data, size, buffer);
+  Bind(varname, var_map->Name());
+  lazy_.erase(varname);
+}
+
+void
+EnvironmentImpl::ReadAndSetLazily(const string &varname, StreamTokenizer &st,
+                                  const string type, const string &filename) {
+  string varmap_type;
+  VarMapBase *var_map = CheckValue(varname, st, type, &varmap_type);
+  if (var_map->IsPrimitive()) {
+    ReadAndSet(varname, st, type);
+    return;
+  }
+
+  // Collect the tokens of the value, which ends at the semicolon ending
+  // the statement.
+  shared_ptr<LazyBinding> lazy = std::make_shared<LazyBinding>();
+  int depth = 0;
+  while (st.HasNext()) {
+    const StreamTokenizer::Token &token = st.PeekToken();
+    if (token.type == StreamTokenizer::RESERVED_CHAR) {
+      if (depth == 0 && token.tok == ";") {
+        break;
+      }
+      if (token.tok == "(" || token.tok == "{") {
+        ++depth;
+      } else if (token.tok == ")" || token.tok == "}") {
+        --depth;
+      }
+    }
+    lazy->tokens.push_back(token);
+    st.Next();
+  }
+
+  // The value may refer to every identifier that is not the name of a
+  // constructor or member, and to every string naming a variable.  A
+  // value referring to the variable it is bound to refers to its current
+  // value, and so is constructed now.
+  unordered_set<string> references;
+  for (size_t i = 0; i < lazy->tokens.size(); ++i) {
+    const StreamTokenizer::Token &token = lazy->tokens[i];
+    bool is_name = i + 1 < lazy->tokens.size() &&
+                   lazy->tokens[i + 1].type == StreamTokenizer::RESERVED_CHAR &&
+                   lazy->tokens[i + 1].tok == "(";
+    if ((token.type == StreamTokenizer::IDENTIFIER && !is_name) ||
+        token.type == StreamTokenizer::STRING) {
+      references.insert(token.tok);
+    }
+  }
+  if (lazy->tokens.empty() || references.count(varname) > 0) {
+    st.Rewind(lazy->tokens.size());
+    ReadAndSet(varname, st, type);
+    return;
+  }
+  for (const string &reference : references) {
+    lazy_readers_[reference].push_back(lazy);
+  }
+
+  // The value is replayed from a copy of its own characters.
+  size_t offset = lazy->tokens.front().start;
+  lazy->text = st.Substr(offset, lazy->tokens.back().curr_pos - offset);
+  for (StreamTokenizer::Token &token : lazy->tokens) {
+    token.start -= offset;
+    token.curr_pos -= offset;
+    token.line_start_pos =
+        token.line_start_pos >= offset ? token.line_start_pos - offset : 0;
+  }
+  lazy->varname = varname;
+  lazy->type = type;
+  lazy->filename = filename;
+  lazy->scope.reset(new EnvironmentImpl(this));
+  lazy->scope->forked_ = true;
+
+  ConstructReaders(varname);
+  DropDeferred(varname);
+  // Any earlier value of the variable in this scope is discarded.
+  unordered_map<string, Binding>::const_iterator binding_it =
+      bindings_.find(varname);
+  if (binding_it != bindings_.end() && lazy_.find(varname) == lazy_.end()) {
+    VarMapBase *earlier_var_map = GetVarMapForType(binding_it->second.type);
+    if (earlier_var_map != nullptr) {
+      earlier_var_map->Erase(varname);
+    }
+  }
+  Bind(varname, varmap_type);
+  lazy_[varname] = lazy;
+}
+
+void
+EnvironmentImpl::Construct(LazyBinding &lazy) const {
+  if (lazy.constructed.load(std::memory_order_acquire)) {
+    if (!lazy.error.empty()) {
+      Error(lazy.error);
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> lock(lazy.mutex);
+  if (lazy.constructed.load(std::memory_order_relaxed)) {
+    if (!lazy.error.empty()) {
+      Error(lazy.error);
+    }
+    return;
+  }
+  if (debug_ >= 1) {
+    cerr << "Environment: constructing lazily bound variable "
+         << lazy.varname << endl;
+  }
+  StreamTokenizer st(lazy.text.data(), lazy.text.size(),
+                     lazy.tokens.data(), lazy.tokens.size());
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    lazy.scope->ReadAndSet(lazy.varname, st, lazy.type);
+    if (st.HasNext()) {
+      ostringstream err_ss;
+      err_ss << "expected token \";\" but found \"" << st.Peek() << "\"";
+      Error(err_ss.str());
+    }
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::runtime_error &e) {
+    ostringstream err_ss;
+    err_ss << "Environment: error: cannot construct variable " << lazy.varname
+           << " bound in file \"" << lazy.filename << "\" (line: "
+           << lazy.tokens.front().line_number + 1 << "):\n" << e.what();
+    // The value is never constructed from what its variables are set to
+    // later, so every later lookup raises the same error.
+    lazy.error = err_ss.str();
+    lazy.constructed.store(true, std::memory_order_release);
+    Error(lazy.error);
+  }
+#endif
+  lazy.constructed.store(true, std::memory_order_release);
+}
+
+bool
+EnvironmentImpl::TryConstruct(LazyBinding &lazy) const {
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    Construct(lazy);
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::runtime_error &) {
+    return false;
+  }
+#endif
+  return true;
+}
+
+void
+EnvironmentImpl::ConstructReadersOf(const string &varname) const {
+  unordered_map<string, vector<std::weak_ptr<LazyBinding> > >::iterator it =
+      lazy_readers_.find(varname);
+  if (it == lazy_readers_.end()) {
+    return;
+  }
+  // Bindings since replaced are never constructed.  Those that fail to
+  // be keep their errors, which are raised when they are looked up,
+  // rather than by setting the variable.  The readers are forgotten only
+  // once all of them have been constructed.
+  vector<std::weak_ptr<LazyBinding> > readers = it->second;
+  for (const std::weak_ptr<LazyBinding> &reader : readers) {
+    shared_ptr<LazyBinding> lazy = reader.lock();
+    if (lazy != nullptr) {
+      TryConstruct(*lazy);
+    }
+  }
+  lazy_readers_.erase(varname);
+}
+
+VarMapBase *
+EnvironmentImpl::CheckValue(const string &varname, StreamTokenizer &st,
+                            const string &type, string *varmap_type) {
   bool is_vector =
       st.PeekTokenType() == StreamTokenizer::RESERVED_CHAR &&
       st.Peek() == "{";
@@ -129,6 +393,7 @@ EnvironmentImpl::ReadAndSet(const string &varname, StreamTokenizer &st,
   string next_tok = st.Peek();
   bool is_object_type = false;
 
+  bool is_number = st.PeekTokenType() == StreamTokenizer::NUMBER;
   string inferred_type = InferType(varname, st, is_vector, &is_object_type);
 
   if (is_vector) {
@@ -148,7 +413,8 @@ EnvironmentImpl::ReadAndSet(const string &varname, StreamTokenizer &st,
            << "infer type for variable " << varname;
     Error(err_ss.str());
   }
-  if (type != "" && inferred_type != "" && type != inferred_type) {
+  if (type != "" && inferred_type != "" && type != inferred_type &&
+      !(is_number && NumberConverts(inferred_type, type))) {
     ostringstream err_ss;
     err_ss << "Environment: error: explicit type " << type
            << " and inferred type " << inferred_type
@@ -157,11 +423,196 @@ EnvironmentImpl::ReadAndSet(const string &varname, StreamTokenizer &st,
   }
 
   // If no explicit type specifier, then the inferred_type is the type.
-  string varmap_type = type == "" ? inferred_type : type;
+  *varmap_type = type == "" ? inferred_type : type;
 
-  // Check that varmap_type is a key in var_map_.
-  var_map_[varmap_type]->ReadAndSet(varname, st);
-  types_[varname] = varmap_type;
+  if (AtLoadLiteral(st) && *varmap_type != "int[]" &&
+      *varmap_type != "int64[]" && *varmap_type != "float[]" &&
+      *varmap_type != "double[]") {
+    ostringstream err_ss;
+    err_ss << "Environment: error: load(...) cannot initialize variable "
+           << varname;
+    if (*varmap_type != "") {
+      err_ss << " of type " << *varmap_type;
+    }
+    err_ss << "; only int[], int64[], float[] and double[] variables, whose "
+           << "type must be explicit, can be loaded";
+    Error(err_ss.str());
+  }
+
+  // Check that varmap_type names a known type.
+  VarMapBase *var_map = GetVarMapForType(*varmap_type);
+  if (var_map == nullptr) {
+    ostringstream err_ss;
+    err_ss << "Environment: error: unknown type " << *varmap_type
+           << " for variable " << varname;
+    Error(err_ss.str());
+  }
+  return var_map;
+}
+
+void
+EnvironmentImpl::BindDeferred(const string &varname, VarMapBase *var_map,
+                              const void *value) {
+  if (bindings_.find(varname) != bindings_.end()) {
+    // The variable already has a value in this scope, so simply replace it.
+    var_map->SetToValueAt(varname, value);
+    Bind(varname, var_map->Name());
+    return;
+  }
+  for (vector<DeferredBinding>::iterator it = deferred_.begin();
+       it != deferred_.end(); ++it) {
+    if (it->varname == varname) {
+      it->var_map = var_map;
+      it->value = value;
+      return;
+    }
+  }
+  DeferredBinding binding;
+  binding.varname = varname;
+  binding.var_map = var_map;
+  binding.value = value;
+  deferred_.push_back(binding);
+}
+
+shared_ptr<const FileBuffer>
+EnvironmentImpl::LoadFile(const string &filename) {
+  if (file_loader_ == nullptr && parent_ != nullptr) {
+    return parent_->LoadFile(filename);
+  }
+  if (file_loader_ != nullptr) {
+    return file_loader_(filename);
+  }
+  std::ifstream file(filename, std::ios_base::in | std::ios_base::binary);
+  if (!file.good()) {
+    ostringstream err_ss;
+    err_ss << "Environment: error: cannot read file \"" << filename
+           << "\" (or file does not exist)";
+    Error(err_ss.str());
+  }
+  return StringFileBuffer::Read(file);
+}
+
+bool
+EnvironmentImpl::MaterializeDeferred(const string &varname) const {
+  for (vector<DeferredBinding>::iterator it = deferred_.begin();
+       it != deferred_.end(); ++it) {
+    if (it->varname == varname) {
+      it->var_map->SetToValueAt(varname, it->value);
+      Bind(varname, it->var_map->Name());
+      deferred_.erase(it);
+      return true;
+    }
+  }
+  return false;
+}
+
+void
+EnvironmentImpl::MaterializeAll() const {
+  while (!deferred_.empty()) {
+    string varname = deferred_.back().varname;
+    MaterializeDeferred(varname);
+  }
+}
+
+void
+EnvironmentImpl::DropDeferred(const string &varname) {
+  for (vector<DeferredBinding>::iterator it = deferred_.begin();
+       it != deferred_.end(); ++it) {
+    if (it->varname == varname) {
+      deferred_.erase(it);
+      return;
+    }
+  }
+}
+
+bool
+EnvironmentImpl::ShareVariable(const string &varname,
+                               const EnvironmentImpl &source) {
+  unordered_map<string, Binding>::const_iterator binding_it =
+      source.bindings_.find(varname);
+  if (binding_it == source.bindings_.end()) {
+    return false;
+  }
+  const Binding &binding = binding_it->second;
+  const VarMapBase *source_var_map = source.BoundVarMap(varname, binding);
+  VarMapBase *var_map = GetVarMapForType(binding.type);
+  if (source_var_map == nullptr || var_map == nullptr) {
+    return false;
+  }
+  ConstructReaders(varname);
+  DropDeferred(varname);
+  var_map->ShareValue(varname, *source_var_map);
+  Bind(varname, binding.type);
+  lazy_.erase(varname);
+  return true;
+}
+
+bool
+EnvironmentImpl::ShareVariable(const string &varname,
+                               const VarMapBase &source) {
+  VarMapBase *var_map = GetVarMapForType(source.Name());
+  if (var_map == nullptr || !var_map->SameTypeAs(source) ||
+      !source.Defined(varname)) {
+    return false;
+  }
+  ConstructReaders(varname);
+  DropDeferred(varname);
+  var_map->ShareValue(varname, source);
+  Bind(varname, var_map->Name());
+  lazy_.erase(varname);
+  return true;
+}
+
+FrozenEnvironment
+EnvironmentImpl::Freeze() const {
+  shared_ptr<vector<FrozenEnvironment::Entry> > entries =
+      std::make_shared<vector<FrozenEnvironment::Entry> >();
+  unordered_set<string> frozen;
+  // Variables of inner scopes hide those of enclosing scopes.
+  for (const EnvironmentImpl *env = this; env != nullptr; env = env->parent_) {
+    env->MaterializeAll();
+    env->ConstructAll();
+    // The values of lazily bound variables are held by scopes of their
+    // own.
+    vector<std::pair<string, const VarMapBase *> > var_maps;
+    for (unordered_map<string, shared_ptr<LazyBinding> >::const_iterator it =
+             env->lazy_.begin();
+         it != env->lazy_.end(); ++it) {
+      const EnvironmentImpl *scope = it->second->scope.get();
+      var_maps.insert(var_maps.end(), scope->var_map_.begin(),
+                      scope->var_map_.end());
+    }
+    var_maps.insert(var_maps.end(), env->var_map_.begin(),
+                    env->var_map_.end());
+    vector<ExportedValue> values;
+    for (vector<std::pair<string, const VarMapBase *> >::const_iterator
+             var_map_it = var_maps.begin();
+         var_map_it != var_maps.end(); ++var_map_it) {
+      values.clear();
+      var_map_it->second->Export(&values);
+      for (ExportedValue &value : values) {
+        // A VarMap may still hold a variable since set to a value of
+        // another type.
+        unordered_map<string, Binding>::const_iterator binding_it =
+            env->bindings_.find(value.name);
+        if (binding_it == env->bindings_.end() ||
+            AbstractType(binding_it->second.type) != var_map_it->first ||
+            !frozen.insert(value.name).second) {
+          continue;
+        }
+        FrozenEnvironment::Entry entry;
+        entry.type = binding_it->second.type;
+        entry.value = std::move(value);
+        entries->push_back(std::move(entry));
+      }
+    }
+  }
+  std::sort(entries->begin(), entries->end(),
+            [](const FrozenEnvironment::Entry &a,
+               const FrozenEnvironment::Entry &b) {
+              return a.value.name < b.value.name;
+            });
+  return FrozenEnvironment(entries);
 }
 
 string
@@ -197,19 +648,22 @@ EnvironmentImpl::InferType(const string &varname,
       {
         string type = "";
 
+        // The type of an array loaded from a file must be explicit.
+        if (AtLoadLiteral(st)) {
+          return type;
+        }
+
         // Find out if next_tok is a concrete typename or a variable.
-        unordered_map<string, string>::const_iterator factory_type_it =
-            concrete_to_factory_type_.find(next_tok);
-        unordered_map<string, string>::const_iterator var_type_it =
-            types_.find(next_tok);
-        if (factory_type_it != concrete_to_factory_type_.end()) {
+        const string *factory_type = types_->FactoryType(next_tok);
+        const string *var_type = FindType(next_tok);
+        if (factory_type != nullptr) {
           // Set type to be abstract factory type.
           if (debug_ >= 2) {
             cerr << "Environment::InferType: concrete type is " << next_tok
                  << "; mapping to abstract Factory type "
-                 << factory_type_it->second << endl;
+                 << *factory_type << endl;
           }
-          type = factory_type_it->second;
+          type = *factory_type;
           *is_object_type = true;
           type = is_vector ? type + "[]" : type;
 
@@ -218,15 +672,15 @@ EnvironmentImpl::InferType(const string &varname,
                  << (is_vector ? "is" : "isn't")
                  << " a vector, so final inferred type is " << type << endl;
           }
-        } else if (var_type_it != types_.end()) {
+        } else if (var_type != nullptr) {
           // Could be a variable, in which case we need not only to return
           // the variable's type, but also set is_object_type and is_vector
           // based on the variable's type string.
           string append = is_vector ? "[]" : "";
-          type = var_type_it->second + append;
+          type = *var_type + append;
           if (debug_ >= 2) {
             cerr << "Environment::InferType: found variable "
-                 << var_type_it->first << " of type " << var_type_it->second
+                 << next_tok << " of type " << *var_type
                  << "; type is " << type << endl;
           }
         } else {
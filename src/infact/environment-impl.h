@@ -37,11 +37,17 @@
 #ifndef INFACT_ENVIRONMENT_IMPL_H_
 #define INFACT_ENVIRONMENT_IMPL_H_
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
 #include <typeinfo>
+#include <vector>
 
 #include "environment.h"
 #include "error.h"
@@ -49,9 +55,189 @@
 namespace infact {
 
 using std::ostringstream;
+using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using std::unordered_map;
 using std::unordered_set;
+using std::vector;
+
+/// A reference to the value of a variable of a \link FrozenEnvironment
+/// \endlink, resolved once so that it may be dereferenced any number of
+/// times at the cost of dereferencing a pointer.  A handle is valid for
+/// as long as some copy of the frozen environment from which it was
+/// resolved exists.
+///
+/// \tparam T the type of the value
+template <typename T>
+class Handle {
+ public:
+  /// Constructs a handle to nothing.
+  Handle() : value_(nullptr) { }
+
+  /// Constructs a handle to the specified value.
+  explicit Handle(const T *value) : value_(value) { }
+
+  /// Returns whether this handle refers to a value.
+  explicit operator bool() const { return value_ != nullptr; }
+
+  const T *get() const { return value_; }
+  const T &operator*() const { return *value_; }
+  const T *operator->() const { return value_; }
+
+ private:
+  const T *value_;
+};
+
+/// An immutable snapshot of the variables of an environment, as returned
+/// by \link EnvironmentImpl::Freeze\endlink, which many threads may read
+/// concurrently without synchronization.  A snapshot shares the storage
+/// of the values of the environment, and so taking one copies no
+/// values, and copying one costs a reference count increment.  Its
+/// variables are held in a flat array sorted by name; since lookups by
+/// name are still more expensive than dereferencing a pointer, a hot
+/// path should \link Resolve\endlink each variable it uses once and keep
+/// the returned Handle.
+///
+/// Variables holding vectors may also be looked up as \link ArrayView
+/// \endlink instances; arrays initialized by <tt>load(...)</tt> literals
+/// may <i>only</i> be looked up as such.
+class FrozenEnvironment {
+ public:
+  /// Constructs an empty snapshot.
+  FrozenEnvironment() : entries_(std::make_shared<const vector<Entry> >()) { }
+
+  /// Returns a handle to the value of the specified variable, which
+  /// refers to nothing if there is no such variable of type <tt>T</tt>.
+  template<typename T>
+  Handle<T> Resolve(const string &varname) const {
+    return Handle<T>(Find<T>(varname));
+  }
+
+  /// Returns a pointer to the value of the specified variable, or
+  /// nullptr if there is no such variable of type <tt>T</tt>.
+  template<typename T>
+  const T *Find(const string &varname) const {
+    const Entry *entry = FindEntry(varname);
+    if (entry == nullptr) {
+      return nullptr;
+    }
+    if (entry->value.type != nullptr && *entry->value.type == typeid(T)) {
+      return static_cast<const T *>(entry->value.value.get());
+    }
+    if (entry->value.view_type != nullptr &&
+        *entry->value.view_type == typeid(T)) {
+      return static_cast<const T *>(entry->value.view.get());
+    }
+    return nullptr;
+  }
+
+  /// Assigns the value of the specified variable to the object pointed
+  /// to by the <tt>value</tt> parameter.
+  ///
+  /// \return whether there is such a variable of type <tt>T</tt>
+  template<typename T>
+  bool Get(const string &varname, T *value) const {
+    const T *found = Find<T>(varname);
+    if (found == nullptr) {
+      return false;
+    }
+    *value = *found;
+    return true;
+  }
+
+  /// Returns whether the specified variable is defined in this snapshot.
+  bool Defined(const string &varname) const {
+    return FindEntry(varname) != nullptr;
+  }
+
+  /// Returns the type name of the specified variable, or the empty
+  /// string if there is no such variable.
+  const string &GetType(const string &varname) const {
+    static const string empty;
+    const Entry *entry = FindEntry(varname);
+    return entry == nullptr ? empty : entry->type;
+  }
+
+  /// Returns the number of variables in this snapshot.
+  size_t size() const { return entries_->size(); }
+
+ private:
+  friend class EnvironmentImpl;
+
+  struct Entry {
+    string type;
+    ExportedValue value;
+  };
+
+  struct EntryLess {
+    bool operator()(const Entry &entry, const string &varname) const {
+      return entry.value.name < varname;
+    }
+  };
+
+  explicit FrozenEnvironment(shared_ptr<const vector<Entry> > entries) :
+      entries_(std::move(entries)) { }
+
+  const Entry *FindEntry(const string &varname) const {
+    vector<Entry>::const_iterator it =
+        std::lower_bound(entries_->begin(), entries_->end(), varname,
+                         EntryLess());
+    return it != entries_->end() && it->value.name == varname ? &*it : nullptr;
+  }
+
+  // The variables, sorted by name.
+  shared_ptr<const vector<Entry> > entries_;
+};
+
+/// The immutable tables of the types known to environments: a prototype
+/// VarMap for each primitive type, each Factory-constructible type and
+/// the vectors of each, and the abstract Factory type of each concrete
+/// type.  Since building them takes time proportional to the number of
+/// registered types, they are built once and shared by all top-level
+/// environments (and their child scopes) until more types are registered.
+class TypeTable {
+ public:
+  /// Returns the tables of the types registered so far, building them
+  /// only if types have been registered since they were last built.
+  ///
+  /// \param debug the debug level with which to build the tables, if
+  ///              they must be built
+  static shared_ptr<const TypeTable> Current(int debug = 0);
+
+  /// Returns the prototype VarMap for the specified abstract type, or
+  /// nullptr if there is none.  A prototype belongs to no environment,
+  /// and serves only to create the VarMap instances of environments via
+  /// \link VarMapBase::CreateEmpty\endlink.
+  const VarMapBase *Prototype(const string &type) const {
+    unordered_map<string, unique_ptr<VarMapBase> >::const_iterator it =
+        prototypes_.find(type);
+    return it != prototypes_.end() ? it->second.get() : nullptr;
+  }
+
+  /// Returns the abstract Factory type of the specified concrete type, or
+  /// nullptr if it is not a concrete Factory-constructible type.
+  const string *FactoryType(const string &type) const {
+    unordered_map<string, string>::const_iterator it =
+        concrete_to_factory_type_.find(type);
+    return it != concrete_to_factory_type_.end() ? &it->second : nullptr;
+  }
+
+ private:
+  TypeTable(uint64_t generation, int debug);
+
+  /// The \link FactoryContainer::Generation generation\endlink of the
+  /// registered types from which these tables were built.
+  uint64_t generation_;
+
+  /// A map from type name strings (as returned by the \link TypeName
+  /// \endlink method) to prototype VarMap instances for those types.
+  unordered_map<string, unique_ptr<VarMapBase> > prototypes_;
+
+  /// A map from concrete Factory-constructible type names to their
+  /// abstract Factory type names.
+  unordered_map<string, string> concrete_to_factory_type_;
+};
 
 /// Provides a set of named variables and their types, as well as the values
 /// for those variables.
@@ -59,6 +245,11 @@ using std::unordered_set;
 /// \see Interpreter
 class EnvironmentImpl : public Environment {
  public:
+  /// A function returning the contents of the named file, as needed by
+  /// \link LoadFile\endlink.
+  typedef std::function<shared_ptr<const FileBuffer>(const string &)>
+      FileLoader;
+
   /// Constructs a new, empty environment.
   ///
   /// \param debug the debug level; if greater than 0, various debugging
@@ -76,8 +267,7 @@ class EnvironmentImpl : public Environment {
   /// Returns whether the specified variable has been defined in this
   /// environment.
   virtual bool Defined(const string &varname) const {
-    unordered_map<string, string>::const_iterator it = types_.find(varname);
-    return it != types_.end();
+    return FindBinding(varname, nullptr) != nullptr;
   }
 
   /// Sets the specified variable to the value obtained from the following
@@ -85,45 +275,148 @@ class EnvironmentImpl : public Environment {
   virtual void ReadAndSet(const string &varname, StreamTokenizer &st,
                           const string type);
 
+  /// Binds the specified variable to the value given by the following
+  /// tokens of the specified token stream, as \link ReadAndSet\endlink
+  /// does, except that a value of Factory-constructible type (or vector
+  /// thereof) is only constructed when it is first looked up.  The
+  /// tokens of such a value are consumed and kept, and so are all the
+  /// tokens up to (but not including) the semicolon ending the
+  /// statement.  The value is constructed from the variables its tokens
+  /// name as they were when it was bound: should any of them be set
+  /// again in this scope, the value is constructed first.  (Variables a
+  /// <tt>PostInit</tt> method looks up without their being named have
+  /// the values they have when the value is constructed.)  Since
+  /// construction happens exactly once, even when the value is first
+  /// looked up by several threads at the same time, lazily bound
+  /// variables may be read concurrently.  An error constructing the
+  /// value, even when it is constructed because a variable it names is
+  /// being set, is kept and raised whenever the value is looked up.
+  ///
+  /// \param varname  the name of the variable to bind
+  /// \param st       the token stream, which must not be in streaming mode
+  /// \param type     the explicit type of the variable, if any
+  /// \param filename the name of the file being evaluated, for error
+  ///                 messages
+  void ReadAndSetLazily(const string &varname, StreamTokenizer &st,
+                        const string type, const string &filename);
+
+  /// Sets the specified variable, of the specified type, to the value
+  /// encoded by \link VarMapBase::EncodeValue\endlink in the specified
+  /// characters, as when restoring the environment from a snapshot.
+  ///
+  /// \param varname the name of the variable to set
+  /// \param type    the name of the type of the variable, which must be
+  ///                that of a VarMap able to decode its value
+  /// \param data    the first character of the encoding
+  /// \param size    the number of characters of the encoding
+  /// \param buffer  the buffer holding the encoding, which the value may
+  ///                share
+  void DecodeAndSet(const string &varname, const string &type,
+                    const char *data, size_t size,
+                    const shared_ptr<const FileBuffer> &buffer);
+
+  /// \copydoc infact::Environment::GetVarMapForValue
+  virtual VarMapBase *GetVarMapForValue(const string &varname,
+                                        StreamTokenizer &st,
+                                        const string type) {
+    string varmap_type;
+    return CheckValue(varname, st, type, &varmap_type);
+  }
+
+  /// \copydoc infact::Environment::BindDeferred
+  virtual void BindDeferred(const string &varname, VarMapBase *var_map,
+                            const void *value);
+
+  /// \copydoc infact::Environment::LoadFile
+  virtual shared_ptr<const FileBuffer> LoadFile(const string &filename);
+
+  /// Sets the function used by this environment, and the child scopes
+  /// created from it, to read the files named by <tt>load(...)</tt>
+  /// literals.  Without one, such files are read from the named path; the
+  /// \link Interpreter\endlink sets a loader that resolves names as it
+  /// resolves imports.  A copy of this environment (see \link Copy\endlink)
+  /// does not keep the loader, since it may outlive whatever the loader
+  /// refers to.
+  void SetFileLoader(FileLoader file_loader) {
+    file_loader_ = std::move(file_loader);
+  }
+
+  /// \copydoc infact::Environment::arena
+  virtual shared_ptr<Arena> arena() const {
+    if (arena_ == nullptr && parent_ != nullptr) {
+      return parent_->arena();
+    }
+    return arena_;
+  }
+
+  /// Sets the arena from which this environment, and the child scopes
+  /// created from it, allocate the objects they construct and the values
+  /// of their variables, or, if the specified arena is <tt>nullptr</tt>,
+  /// has them use that of their enclosing scope, if any.
+  void SetArena(shared_ptr<Arena> arena) { arena_ = std::move(arena); }
+
   virtual const string &GetType(const string &varname) const {
-    unordered_map<string, string>::const_iterator type_it =
-        types_.find(varname);
-    if (type_it == types_.end()) {
+    const string *type = FindType(varname);
+    if (type == nullptr) {
       // Error or warning.
     }
-    return type_it->second;
+    return *type;
   }
 
+  /// \copydoc infact::Environment::GetVarMap
   virtual VarMapBase *GetVarMap(const string &varname) {
-    return GetVarMapForType(GetType(varname));
+    // A variable not defined in this scope lives in the VarMap of whichever
+    // enclosing scope defines it.
+    const EnvironmentImpl *scope = nullptr;
+    const Binding *binding = FindBinding(varname, &scope);
+    return binding == nullptr ? nullptr : scope->BoundVarMap(varname, *binding);
   }
 
   /// Retrieves the VarMap instance for the specified type.
   virtual VarMapBase *GetVarMapForType(const string &type) {
-    string lookup_type = type;
-    // First, check if this is a concrete Factory-constructible type.
-    // If so, map to its abstract type name.
-    unordered_map<string, string>::const_iterator factory_type_it =
-        concrete_to_factory_type_.find(type);
-    if (factory_type_it != concrete_to_factory_type_.end()) {
-      lookup_type = factory_type_it->second;
-    }
-
+    const string &lookup_type = AbstractType(type);
     unordered_map<string, VarMapBase *>::const_iterator var_map_it =
         var_map_.find(lookup_type);
-    if (var_map_it == var_map_.end()) {
+    if (var_map_it != var_map_.end()) {
+      return var_map_it->second;
+    }
+    // Each scope only creates the VarMap instances it actually uses.
+    const VarMapBase *prototype = types_->Prototype(lookup_type);
+    if (prototype == nullptr) {
       return nullptr;
     }
-    return var_map_it->second;
+    VarMapBase *var_map = prototype->CreateEmpty(this);
+    var_map_[lookup_type] = var_map;
+    return var_map;
   }
 
   /// \copydoc infact::Environment::Print
   virtual void Print(ostream &os) const {
+    if (parent_ != nullptr) {
+      parent_->Print(os);
+    }
+    MaterializeAll();
     for (unordered_map<string, VarMapBase *>::const_iterator var_map_it =
              var_map_.begin();
          var_map_it != var_map_.end(); ++var_map_it) {
       var_map_it->second->Print(os);
     }
+    for (unordered_map<string, shared_ptr<LazyBinding> >::const_iterator it =
+             lazy_.begin();
+         it != lazy_.end(); ++it) {
+      // A variable whose value cannot be constructed is printed as a
+      // comment, so that the rest of the environment still is.
+      if (!TryConstruct(*it->second)) {
+        os << "// " << it->first << " cannot be constructed;" << endl;
+        continue;
+      }
+      const EnvironmentImpl *scope = it->second->scope.get();
+      for (unordered_map<string, VarMapBase *>::const_iterator var_map_it =
+               scope->var_map_.begin();
+           var_map_it != scope->var_map_.end(); ++var_map_it) {
+        var_map_it->second->Print(os);
+      }
+    }
   }
 
   /// \copydoc infact::Environment::PrintFactories
@@ -131,16 +424,76 @@ class EnvironmentImpl : public Environment {
 
   /// \copydoc infact::Environment::Copy
   virtual Environment *Copy() const {
+    Profiler *profiler = Profiler::Current();
+    if (profiler != nullptr) {
+      profiler->RecordCopy(bindings_.size());
+    }
+    MaterializeAll();
+    ConstructAll();
     EnvironmentImpl *new_env = new EnvironmentImpl(*this);
+    new_env->lazy_.clear();
+    new_env->lazy_readers_.clear();
+    // A copy may outlive the interpreter whose loader this environment
+    // uses, so it reads files from the named paths.
+    new_env->file_loader_ = nullptr;
+    // A copy of a child scope must not depend on the lifetime of its
+    // parent, so it gets (and owns) a copy of its parent.
+    if (parent_ != nullptr && owned_parent_ == nullptr) {
+      new_env->owned_parent_.reset(
+          static_cast<EnvironmentImpl *>(parent_->Copy()));
+      new_env->parent_ = new_env->owned_parent_.get();
+    }
     // Now go through and create copies of each VarMap.
     for (unordered_map<string, VarMapBase *>::iterator new_env_var_map_it =
              new_env->var_map_.begin();
          new_env_var_map_it != new_env->var_map_.end(); ++new_env_var_map_it) {
       new_env_var_map_it->second = new_env_var_map_it->second->Copy(new_env);
     }
+    // The copy holds the values of lazily bound variables itself.
+    for (unordered_map<string, shared_ptr<LazyBinding> >::const_iterator it =
+             lazy_.begin();
+         it != lazy_.end(); ++it) {
+      new_env->ShareVariable(it->first, *it->second->scope);
+    }
     return new_env;
   }
 
+  /// \copydoc infact::Environment::CreateChild
+  virtual Environment *CreateChild() {
+    return new EnvironmentImpl(this);
+  }
+
+  /// Returns a new child scope of this environment that treats this
+  /// environment as read-only: variables set in the fork hide, rather
+  /// than replace, those of this environment, and so the fork holds only
+  /// its overrides.  Any number of forks of this environment may be
+  /// created and used concurrently, provided this environment is not
+  /// modified, and each fork must be destroyed before this environment
+  /// is.
+  EnvironmentImpl *Fork();
+
+  /// Binds the specified variable in this scope to the value of the
+  /// variable of the same name defined in the specified scope, sharing
+  /// its storage.  The specified scope is only read, and so may be read
+  /// concurrently by other threads.
+  ///
+  /// \return whether the specified scope defines the variable
+  bool ShareVariable(const string &varname, const EnvironmentImpl &source);
+
+  /// Binds the specified variable in this scope to the value of the
+  /// variable of the same name held by the specified VarMap, which need
+  /// not belong to any environment, sharing its storage.
+  ///
+  /// \return whether the specified VarMap holds the variable and this
+  ///         environment has a VarMap for its type
+  bool ShareVariable(const string &varname, const VarMapBase &source);
+
+  /// Returns an immutable, thread-safe snapshot of the variables of this
+  /// environment (including those of enclosing scopes), which shares
+  /// their values rather than copying them.  Changes made to this
+  /// environment afterwards are not reflected in the snapshot.
+  FrozenEnvironment Freeze() const;
+
   /// Retrieves the value of the variable with the specified name and puts
   /// into into the object pointed to by the <tt>value</tt> parameter.
   ///
@@ -152,63 +505,403 @@ class EnvironmentImpl : public Environment {
   template<typename T>
   bool Get(const string &varname, T *value) const;
 
+  /// Sets the specified view to the value of the <tt>int[]</tt>,
+  /// <tt>double[]</tt> or other vector variable with the specified name,
+  /// without copying it.  Arrays initialized with <tt>load(...)</tt>
+  /// literals remain in the memory of the file from which they were
+  /// loaded.
+  ///
+  /// \param      varname the name of the variable whose value is to be
+  ///             retrieved
+  /// \param[out] view    the view to be set
+  /// \return whether the specified variable exists and the view was set
+  template<typename T>
+  bool Get(const string &varname, ArrayView<T> *view) const {
+    const VarMap<vector<T> > *typed_var_map =
+        FindTypedVarMap<vector<T> >(varname, nullptr);
+    return typed_var_map != nullptr && typed_var_map->GetView(varname, view);
+  }
+
+  /// Returns a pointer to the value of the variable with the specified
+  /// name, without copying it, or nullptr if there is no such variable
+  /// of type <tt>T</tt>.  The returned pointer remains valid until the
+  /// variable is set again or removed, or this environment is destroyed.
+  ///
+  /// \param varname the name of the variable whose value is to be
+  ///                retrieved
+  template<typename T>
+  const T *Find(const string &varname) const {
+    const VarMap<T> *typed_var_map = FindTypedVarMap<T>(varname, nullptr);
+    return typed_var_map == nullptr ? nullptr : typed_var_map->Find(varname);
+  }
+
+  /// Returns a reference to the value of the variable with the specified
+  /// name, without copying it.  It is an error if there is no such
+  /// variable of type <tt>T</tt>.  The returned reference remains valid
+  /// for as long as the pointer returned by \link Find \endlink would.
+  ///
+  /// \param varname the name of the variable whose value is to be
+  ///                retrieved
+  template<typename T>
+  const T &GetRef(const string &varname) const {
+    const T *value = Find<T>(varname);
+    if (value == nullptr) {
+      ostringstream err_ss;
+      err_ss << "Environment::GetRef: error: no value for variable "
+             << varname << " of type " << typeid(T).name();
+      Error(err_ss.str());
+    }
+    return *value;
+  }
+
+  /// Moves the value of the variable with the specified name into the
+  /// object pointed to by the <tt>value</tt> parameter, and removes the
+  /// variable from this environment.  If the value is shared with other
+  /// variables (because of an assignment such as <tt>b = a;</tt>), it is
+  /// copied instead.
+  ///
+  /// \param      varname the name of the variable whose value is to be
+  ///             retrieved
+  /// \param[out] value a pointer to the object whose value is to be set
+  /// \return whether the specified variable existed and its value was
+  ///         successfully set by this method
+  ///
+  /// Since a child scope (including a fork) never modifies its enclosing
+  /// scopes, the variables it sees in them are never removed; their
+  /// values are copied instead.
+  template<typename T>
+  bool Take(const string &varname, T *value) {
+    const EnvironmentImpl *scope = nullptr;
+    VarMap<T> *typed_var_map = FindTypedVarMap<T>(varname, &scope);
+    if (typed_var_map != nullptr && scope != this) {
+      return typed_var_map->Get(varname, value);
+    }
+    if (typed_var_map == nullptr) {
+      return false;
+    }
+    ConstructReaders(varname);
+    if (!typed_var_map->Take(varname, value)) {
+      return false;
+    }
+    bindings_.erase(varname);
+    lazy_.erase(varname);
+    return true;
+  }
+
  private:
+  /// A variable bound by \link ReadAndSetLazily\endlink, whose value is
+  /// constructed on first use by replaying its tokens in a scope of its
+  /// own.
+  struct LazyBinding {
+    string varname;
+    /// The explicit type of the variable, if any.
+    string type;
+    /// The name of the file in which the variable was bound.
+    string filename;
+    /// The characters of the value.
+    string text;
+    /// The tokens of the value, with stream positions within \c text.
+    vector<StreamTokenizer::Token> tokens;
+    /// The child scope in which the value is constructed and held.
+    unique_ptr<EnvironmentImpl> scope;
+    /// Guards construction of the value.
+    std::mutex mutex;
+    /// Whether the value has been constructed, or has failed to be.
+    std::atomic<bool> constructed{false};
+    /// The error raised constructing the value, if it failed to be.
+    string error;
+  };
+
+  /// Constructs a new, empty child scope of the specified environment.
+  explicit EnvironmentImpl(EnvironmentImpl *parent);
+
+  /// Returns the scope holding the value of the specified variable,
+  /// which is defined by this scope: either this scope or, if the
+  /// variable is bound lazily, the scope in which its value is
+  /// constructed, constructing it first if need be.
+  const EnvironmentImpl *ValueScope(const string &varname) const {
+    if (!lazy_.empty()) {
+      unordered_map<string, shared_ptr<LazyBinding> >::const_iterator it =
+          lazy_.find(varname);
+      if (it != lazy_.end()) {
+        Construct(*it->second);
+        return it->second->scope.get();
+      }
+    }
+    return this;
+  }
+
+  /// Constructs the value of the specified lazy binding, unless it has
+  /// been constructed already, raising the error of constructing it if
+  /// that failed, whether now or earlier.
+  void Construct(LazyBinding &lazy) const;
+
+  /// Constructs the value of the specified lazy binding as \link
+  /// Construct\endlink does, except that an error constructing it is
+  /// kept rather than raised.
+  ///
+  /// \return whether the value was constructed
+  bool TryConstruct(LazyBinding &lazy) const;
+
+  /// Constructs the values of all lazily bound variables of this scope.
+  void ConstructAll() const {
+    for (unordered_map<string, shared_ptr<LazyBinding> >::const_iterator it =
+             lazy_.begin();
+         it != lazy_.end(); ++it) {
+      Construct(*it->second);
+    }
+  }
+
+  /// Constructs the values of the lazily bound variables of this scope
+  /// referring to the specified variable, which is about to be set or
+  /// removed.
+  void ConstructReaders(const string &varname) const {
+    if (!lazy_readers_.empty()) {
+      ConstructReadersOf(varname);
+    }
+  }
+
+  /// Does the work of \link ConstructReaders\endlink.
+  void ConstructReadersOf(const string &varname) const;
+
+  /// The binding of a variable in a scope: its type and, once the
+  /// variable has been looked up, the VarMap holding its value, so that
+  /// every later lookup of the variable costs a single hash of its name
+  /// (and another by the VarMap holding it).
+  struct Binding {
+    Binding() : var_map(nullptr) { }
+    explicit Binding(const string &type) : type(type), var_map(nullptr) { }
+
+    // The VarMap of a binding belongs to its scope, and so is not copied.
+    Binding(const Binding &other) : type(other.type), var_map(nullptr) { }
+    Binding &operator=(const Binding &other) {
+      type = other.type;
+      var_map.store(nullptr, std::memory_order_relaxed);
+      return *this;
+    }
+
+    /// The type of the variable.
+    string type;
+    /// The VarMap holding the value of the variable, or nullptr if it has
+    /// not yet been looked up.  It may be set by concurrent readers,
+    /// which all find the same VarMap.
+    mutable std::atomic<VarMapBase *> var_map;
+  };
+
+  /// Sets the type of the specified variable in this scope, forgetting
+  /// the VarMap of any earlier binding.
+  void Bind(const string &varname, const string &type) const {
+    bindings_[varname] = Binding(type);
+  }
+
+  /// Returns the binding of the specified variable in this scope or the
+  /// nearest enclosing scope that defines it, or nullptr if no scope
+  /// defines it.
+  ///
+  /// \param      varname the name of the variable
+  /// \param[out] scope   if not nullptr, set to the scope defining the
+  ///                     variable
+  const Binding *FindBinding(const string &varname,
+                             const EnvironmentImpl **scope) const {
+    for (const EnvironmentImpl *env = this; env != nullptr;
+         env = env->parent_) {
+      env->Materialize(varname);
+      unordered_map<string, Binding>::const_iterator it =
+          env->bindings_.find(varname);
+      if (it != env->bindings_.end()) {
+        if (scope != nullptr) {
+          *scope = env;
+        }
+        return &it->second;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Returns the VarMap holding the value of the specified variable,
+  /// which has the specified binding in this scope, constructing the
+  /// value first if it is bound lazily, or nullptr if there is no such
+  /// VarMap.
+  VarMapBase *BoundVarMap(const string &varname,
+                          const Binding &binding) const {
+    VarMapBase *var_map = binding.var_map.load(std::memory_order_acquire);
+    if (var_map != nullptr) {
+      return var_map;
+    }
+    const EnvironmentImpl *value_env = ValueScope(varname);
+    unordered_map<string, VarMapBase *>::const_iterator it =
+        value_env->var_map_.find(AbstractType(binding.type));
+    if (it == value_env->var_map_.end()) {
+      return nullptr;
+    }
+    binding.var_map.store(it->second, std::memory_order_release);
+    return it->second;
+  }
+
+  /// Returns the type of the specified variable in this scope or the
+  /// nearest enclosing scope that defines it, or nullptr if no scope
+  /// defines it.
+  const string *FindType(const string &varname) const {
+    const Binding *binding = FindBinding(varname, nullptr);
+    return binding == nullptr ? nullptr : &binding->type;
+  }
+
+  /// Maps the specified type to its abstract Factory type name if it is a
+  /// concrete Factory-constructible type, or else returns it unchanged.
+  const string &AbstractType(const string &type) const {
+    const string *factory_type = types_->FactoryType(type);
+    return factory_type != nullptr ? *factory_type : type;
+  }
+
+  /// Checks that the value given by the following tokens may be
+  /// assigned to the specified variable, returning the VarMap for its
+  /// type and setting <tt>varmap_type</tt> to the type of the variable.
+  VarMapBase *CheckValue(const string &varname, StreamTokenizer &st,
+                         const string &type, string *varmap_type);
+
+  /// Copies the value of the specified variable into this scope if it
+  /// has been bound via \link BindDeferred \endlink but not yet looked
+  /// up.  Since doing so does not change the observable state of this
+  /// environment, it may be done by const methods.
+  void Materialize(const string &varname) const {
+    if (!deferred_.empty()) {
+      MaterializeDeferred(varname);
+    }
+  }
+
+  /// Does the work of \link Materialize\endlink, returning whether the
+  /// specified variable had a deferred binding.
+  bool MaterializeDeferred(const string &varname) const;
+
+  /// Copies the values of all variables with deferred bindings into
+  /// this scope.
+  void MaterializeAll() const;
+
+  /// Discards any deferred binding of the specified variable.
+  void DropDeferred(const string &varname);
+
+  /// Returns the VarMap holding the specified variable, from this scope
+  /// or the nearest enclosing scope that defines it, or nullptr if there
+  /// is no such variable of type <tt>T</tt>.
+  ///
+  /// \param      varname the name of the variable
+  /// \param[out] scope   if not nullptr, set to the scope defining the
+  ///                     variable
+  template<typename T>
+  VarMap<T> *FindTypedVarMap(const string &varname,
+                             const EnvironmentImpl **scope) const;
+
   /// Infer the type based on the next token and its token type.
   string InferType(const string &varname,
                    const StreamTokenizer &st, bool is_vector,
                    bool *is_object_type);
 
-  /// A map from all variable names to their types.
-  unordered_map<string, string> types_;
+  /// The enclosing scope of this environment, or nullptr if this is a
+  /// top-level environment.
+  EnvironmentImpl *parent_ = nullptr;
+
+  /// The enclosing scope of this environment when this environment owns
+  /// it, which is only the case for copies of child scopes.
+  shared_ptr<EnvironmentImpl> owned_parent_;
+
+  /// A map from all variable names in this scope to their bindings.  This
+  /// is mutable only so that deferred bindings may be materialized on
+  /// lookup.
+  mutable unordered_map<string, Binding> bindings_;
+
+  /// A variable bound to the value of an object outside this environment
+  /// that has not yet been looked up.
+  struct DeferredBinding {
+    string varname;
+    VarMapBase *var_map;
+    const void *value;
+  };
+
+  /// The deferred bindings of this scope, which are few enough that a
+  /// linear scan is faster than hashing.
+  mutable vector<DeferredBinding> deferred_;
 
   /// A map from type name strings (as returned by the \link TypeName \endlink
   /// method) to VarMap instances for those types.
   unordered_map<string, VarMapBase *> var_map_;
 
-  /// A map from concrete Factory-constructible type names to their abstract
-  /// Factory type names.
-  unordered_map<string, string> concrete_to_factory_type_;
+  /// The tables of the types known to this environment, shared by an
+  /// environment and all its child scopes.
+  shared_ptr<const TypeTable> types_;
+
+  /// The function to read files named by <tt>load(...)</tt> literals, if
+  /// any.  Child scopes use that of their parent.
+  FileLoader file_loader_;
+
+  /// The arena from which objects and values are allocated, if any.
+  /// Child scopes use that of their parent.
+  shared_ptr<Arena> arena_;
+
+  /// Whether this scope was created by \link Fork\endlink, and so must
+  /// not modify its enclosing scopes.
+  bool forked_ = false;
+
+  /// The lazily bound variables of this scope.  This map is only
+  /// modified while statements are evaluated (or by \link Take\endlink),
+  /// and so may be read concurrently thereafter.
+  unordered_map<string, shared_ptr<LazyBinding> > lazy_;
+
+  /// For each variable referred to by a lazily bound value not yet
+  /// constructed, the bindings of those values.
+  mutable unordered_map<string, vector<std::weak_ptr<LazyBinding> > >
+      lazy_readers_;
 
   int debug_;
 };
 
 template<typename T>
-bool
-EnvironmentImpl::Get(const string &varname, T *value) const {
-  unordered_map<string, string>::const_iterator type_it =
-      types_.find(varname);
-  if (type_it == types_.end()) {
+VarMap<T> *
+EnvironmentImpl::FindTypedVarMap(const string &varname,
+                                 const EnvironmentImpl **scope) const {
+  const EnvironmentImpl *env = nullptr;
+  const Binding *binding = FindBinding(varname, &env);
+  if (binding == nullptr) {
     if (debug_ >= 2) {
       ostringstream err_ss;
       err_ss << "Environment::Get: error: no value for variable "
              << varname;
       cerr << err_ss.str() << endl;
     }
-    return false;
+    return nullptr;
   }
 
-  // Now that we have the type, look up the VarMap.
-  const string &type = type_it->second;
-  unordered_map<string, VarMapBase*>::const_iterator var_map_it =
-      var_map_.find(type);
-
-  if (var_map_it == var_map_.end()) {
+  // Now that we have the binding, look up the VarMap.
+  const string &type = binding->type;
+  VarMapBase *var_map = env->BoundVarMap(varname, *binding);
+  if (var_map == nullptr) {
     ostringstream err_ss;
-    err_ss << "Environment::Get: error: types_ and var_map_ data members "
+    err_ss << "Environment::Get: error: bindings_ and var_map_ data members "
            << "are out of sync";
     Error(err_ss.str());
   }
 
-  // Do a dynamic_cast down to the type-specific VarMap.
-  VarMapBase *var_map = var_map_it->second;
-  VarMap<T> *typed_var_map = dynamic_cast<VarMap<T> *>(var_map);
+  // Cast down to the type-specific VarMap.
+  VarMap<T> *typed_var_map = VarMapCast<VarMap<T> >(var_map);
 
   if (typed_var_map == nullptr) {
     ostringstream err_ss;
     err_ss << "Environment::Get: error: no value for variable "
-           << varname << " of type " << typeid(*value).name()
+           << varname << " of type " << typeid(T).name()
            << "; perhaps you meant " << type << "?";
     cerr << err_ss.str() << endl;
+    return nullptr;
+  }
+  if (scope != nullptr) {
+    *scope = env;
+  }
+  return typed_var_map;
+}
+
+template<typename T>
+bool
+EnvironmentImpl::Get(const string &varname, T *value) const {
+  const VarMap<T> *typed_var_map = FindTypedVarMap<T>(varname, nullptr);
+  if (typed_var_map == nullptr) {
     return false;
   }
   bool success = typed_var_map->Get(varname, value);
@@ -216,11 +909,11 @@ EnvironmentImpl::Get(const string &varname, T *value) const {
     ostringstream err_ss;
     err_ss << "Environment::Get: error: no value for variable "
            << varname << " of type " << typeid(*value).name()
-           << "; types_ and var_map_ data members are out of sync";
+           << "; bindings_ and var_map_ data members are out of sync";
     Error(err_ss.str());
   }
   return success;
-  }
+}
 
 }  // namespace infact
 
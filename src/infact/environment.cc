@@ -31,14 +31,199 @@
 //
 /// \file
 /// Contains the implementation of the static method to construct an empty
-/// Environment instance.
+/// Environment instance, as well as those of the Arena and Profiler
+/// classes.
 /// \author dbikel@google.com (Dan Bikel)
 
+#include <cstdio>
+#include <iomanip>
+#include <new>
+
 #include "environment.h"
 #include "environment-impl.h"
 
 namespace infact {
 
+const size_t Arena::kDefaultBlockSize;
+
+Arena::~Arena() {
+  while (blocks_ != nullptr) {
+    Block *next = blocks_->next;
+    blocks_->~Block();
+    ::operator delete(blocks_);
+    blocks_ = next;
+  }
+}
+
+void *
+Arena::Allocate(size_t size, size_t alignment) {
+  // An allocation too large to take from a shared block gets a block of
+  // its own, leaving the current block to other allocations.
+  if (size > block_size_ / 4) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return AllocateFrom(NewBlock(size + alignment, false), size, alignment);
+  }
+  for (;;) {
+    Block *block = current_.load(std::memory_order_acquire);
+    if (block != nullptr) {
+      void *memory = AllocateFrom(block, size, alignment);
+      if (memory != nullptr) {
+        return memory;
+      }
+    }
+    // Unless another thread got here first, replace the full block.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_.load(std::memory_order_relaxed) == block) {
+      NewBlock(block_size_, true);
+    }
+  }
+}
+
+Arena::Block *
+Arena::NewBlock(size_t size, bool make_current) {
+  Block *block = new (::operator new(sizeof(Block) + size)) Block();
+  block->next = blocks_;
+  block->size = size;
+  block->used.store(0, std::memory_order_relaxed);
+  blocks_ = block;
+  bytes_reserved_.fetch_add(size, std::memory_order_relaxed);
+  if (make_current) {
+    current_.store(block, std::memory_order_release);
+  }
+  return block;
+}
+
+void *
+Arena::AllocateFrom(Block *block, size_t size, size_t alignment) {
+  uintptr_t data = reinterpret_cast<uintptr_t>(block->data());
+  size_t used = block->used.load(std::memory_order_relaxed);
+  for (;;) {
+    uintptr_t start = (data + used + alignment - 1) & ~(alignment - 1);
+    size_t new_used = start + size - data;
+    if (new_used > block->size) {
+      return nullptr;
+    }
+    if (block->used.compare_exchange_weak(used, new_used,
+                                          std::memory_order_relaxed)) {
+      return reinterpret_cast<void *>(start);
+    }
+  }
+}
+
+thread_local Profiler::Scope *Profiler::current_ = nullptr;
+std::atomic<int> Profiler::num_scopes_(0);
+
+void
+Profiler::RecordFile(const string &filename, int64_t start, int64_t end) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  FileStats &file = stats_.files[filename];
+  ++file.evaluations;
+  file.eval_ns += end - start;
+  AddEvent("file", filename, "", start, end);
+}
+
+void
+Profiler::RecordTokenize(const string &filename, int64_t start, int64_t end) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.files[filename].tokenize_ns += end - start;
+  AddEvent("tokenize", filename, "", start, end);
+}
+
+void
+Profiler::RecordStatement(const string &filename, const string &varname,
+                          uint64_t constructed, int64_t start, int64_t end) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  StatementStats statement;
+  statement.filename = filename;
+  statement.varname = varname;
+  statement.constructed = constructed;
+  statement.eval_ns = end - start;
+  stats_.statements.push_back(std::move(statement));
+  AddEvent("statement", varname, filename, start, end);
+}
+
+void
+Profiler::RecordConstruction(const string &type, int64_t start, int64_t init,
+                             int64_t post_init, int64_t end) {
+  if (current_ != nullptr) {
+    ++current_->constructed_;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  TypeStats &type_stats = stats_.types[type];
+  ++type_stats.constructed;
+  type_stats.construct_ns += init - start;
+  type_stats.init_ns += post_init - init;
+  type_stats.post_init_ns += end - post_init;
+  AddEvent("construct", type, "", start, end);
+  if (end > post_init) {
+    AddEvent("post_init", type, "", post_init, end);
+  }
+}
+
+void
+Profiler::RecordMemoized(const string &type) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.types[type].memoized;
+}
+
+void
+Profiler::AddEvent(const char *category, const string &name,
+                   const string &detail, int64_t start, int64_t end) {
+  std::map<std::thread::id, size_t>::const_iterator thread_it =
+      threads_.insert(std::make_pair(std::this_thread::get_id(),
+                                     threads_.size())).first;
+  Event event = { category, name, detail, start, end, thread_it->second };
+  events_.push_back(std::move(event));
+}
+
+namespace {
+
+// Writes the specified string as a JSON string literal.
+void WriteJsonString(const string &s, ostream &os) {
+  os << '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      os << escape;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+}  // namespace
+
+void
+Profiler::WriteTrace(ostream &os) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ios_base::fmtflags flags = os.flags();
+  std::streamsize precision = os.precision();
+  // Times are in microseconds.
+  os << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+  for (size_t i = 0; i < events_.size(); ++i) {
+    const Event &event = events_[i];
+    os << (i > 0 ? ",\n" : "\n") << "{\"name\":";
+    WriteJsonString(event.name, os);
+    os << ",\"cat\":\"" << event.category << "\",\"ph\":\"X\",\"ts\":"
+       << event.start / 1000.0 << ",\"dur\":"
+       << (event.end - event.start) / 1000.0 << ",\"pid\":0,\"tid\":"
+       << event.thread;
+    if (!event.detail.empty()) {
+      os << ",\"args\":{\"file\":";
+      WriteJsonString(event.detail, os);
+      os << "}";
+    }
+    os << "}";
+  }
+  os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  os.flags(flags);
+  os.precision(precision);
+}
+
 Environment *
 Environment::CreateEmpty() {
   return new EnvironmentImpl();
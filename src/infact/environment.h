@@ -41,7 +41,21 @@
 
 #define VAR_MAP_DEBUG 0
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
 #include <vector>
 
 #include "error.h"
@@ -61,6 +75,572 @@ using std::vector;
 
 class Environment;
 
+/// An interface for a contiguous, read-only buffer holding the entire
+/// contents of a file.
+class FileBuffer {
+ public:
+  virtual ~FileBuffer() = default;
+
+  /// Returns the first character of this buffer.  This method never
+  /// returns nullptr, even for an empty buffer.
+  virtual const char *data() const = 0;
+
+  /// Returns the number of characters in this buffer.
+  virtual size_t size() const = 0;
+};
+
+/// A FileBuffer holding a copy of the contents of a file in memory.
+class StringFileBuffer : public FileBuffer {
+ public:
+  explicit StringFileBuffer(string contents) : contents_(std::move(contents)) {
+  }
+
+  ~StringFileBuffer() override = default;
+
+  /// Returns a buffer holding the remaining contents of the specified
+  /// stream.
+  static shared_ptr<const FileBuffer> Read(std::istream &is) {
+    string contents((std::istreambuf_iterator<char>(is)),
+                    std::istreambuf_iterator<char>());
+    return std::make_shared<StringFileBuffer>(std::move(contents));
+  }
+
+  const char *data() const override { return contents_.data(); }
+  size_t size() const override { return contents_.size(); }
+
+ private:
+  string contents_;
+};
+
+/// A monotonic allocator, from which memory is carved out of large
+/// blocks and is only ever freed all at once, when the arena is
+/// destroyed.  An arena allows the many small objects of a large
+/// configuration, and their reference counts, to be allocated without
+/// contending for the general-purpose allocator and to be laid out
+/// close together.  An arena may be used by many threads concurrently:
+/// allocating from the current block never takes a lock.
+class Arena {
+ public:
+  /// The default size of the blocks of an arena.
+  static const size_t kDefaultBlockSize = 64 * 1024;
+
+  /// Constructs an arena allocating from blocks of the specified size.
+  explicit Arena(size_t block_size = kDefaultBlockSize) :
+      block_size_(block_size), current_(nullptr), bytes_reserved_(0) { }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /// Frees all memory allocated from this arena.
+  ~Arena();
+
+  /// Returns the specified number of bytes with the specified alignment,
+  /// which must be a power of two.
+  void *Allocate(size_t size, size_t alignment);
+
+  /// Returns the total size of the blocks allocated by this arena.
+  size_t bytes_reserved() const {
+    return bytes_reserved_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Block {
+    // The block allocated before this one.
+    Block *next;
+    size_t size;
+    // The number of bytes of this block allocated so far.
+    std::atomic<size_t> used;
+
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+  };
+
+  // Allocates a new block with room for the specified number of bytes,
+  // which becomes the current block if so specified.  The caller must
+  // hold the lock.
+  Block *NewBlock(size_t size, bool make_current);
+
+  // Returns the specified number of bytes from the specified block, or
+  // nullptr if they do not fit.
+  static void *AllocateFrom(Block *block, size_t size, size_t alignment);
+
+  const size_t block_size_;
+  std::atomic<Block *> current_;
+  std::atomic<size_t> bytes_reserved_;
+  // Guards the allocation of blocks and the list of all of them.
+  std::mutex mutex_;
+  Block *blocks_ = nullptr;
+};
+
+/// A standard allocator allocating from an \link Arena\endlink, whose
+/// lifetime it shares, so that anything allocated with it (notably,
+/// an object created by <tt>std::allocate_shared</tt>, along with its
+/// reference count) keeps the arena alive.  Deallocation is a no-op.
+///
+/// \tparam T the type of values allocated
+template <typename T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  explicit ArenaAllocator(shared_ptr<Arena> arena) : arena_(std::move(arena)) {
+  }
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena()) { }
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena_->Allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *, size_t) { }
+
+  /// Returns the arena from which this instance allocates.
+  const shared_ptr<Arena> &arena() const { return arena_; }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U> &other) const {
+    return arena_ == other.arena();
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U> &other) const {
+    return arena_ != other.arena();
+  }
+
+ private:
+  shared_ptr<Arena> arena_;
+};
+
+/// Collects statistics about, and a trace of, the evaluation of files
+/// and statements and the construction of objects, for finding out where
+/// the time of a slow evaluation goes.  Profiling is enabled for the
+/// current thread by a \link Scope\endlink; when no scope is live,
+/// every instrumented event costs a single branch.  A profiler may be
+/// used by many threads concurrently.
+///
+/// Times are inclusive: the time spent constructing an object includes
+/// that spent constructing the objects its members are initialized
+/// with, and the time spent evaluating a file includes that spent
+/// evaluating the files it imports.
+class Profiler {
+ public:
+  /// Statistics about the objects of one concrete type.
+  struct TypeStats {
+    /// The number of objects constructed.
+    uint64_t constructed = 0;
+    /// The number of objects shared from earlier, identical specs rather
+    /// than constructed, for types whose construction is memoized.
+    uint64_t memoized = 0;
+    /// The total time spent in constructors, not including that spent
+    /// initializing members or in <tt>PostInit</tt> methods.
+    int64_t construct_ns = 0;
+    /// The total time spent initializing members.
+    int64_t init_ns = 0;
+    /// The total time spent in <tt>PostInit</tt> methods.
+    int64_t post_init_ns = 0;
+  };
+
+  /// Statistics about the evaluations of one file.
+  struct FileStats {
+    /// The number of times the file was evaluated.
+    uint64_t evaluations = 0;
+    /// The total time spent tokenizing the file separately from
+    /// evaluating it, which is only done for imports with a cache.
+    int64_t tokenize_ns = 0;
+    /// The total time spent evaluating the file.
+    int64_t eval_ns = 0;
+  };
+
+  /// Statistics about the evaluation of one statement.
+  struct StatementStats {
+    string filename;
+    string varname;
+    /// The number of objects constructed by the statement.
+    uint64_t constructed = 0;
+    int64_t eval_ns = 0;
+  };
+
+  /// All statistics collected by a profiler.
+  struct Stats {
+    std::map<string, FileStats> files;
+    /// The statistics of each concrete type, keyed by its name.
+    std::map<string, TypeStats> types;
+    /// The statements evaluated, in the order in which they finished.
+    vector<StatementStats> statements;
+    /// The number of scopes created for constructing objects.
+    uint64_t scopes = 0;
+    /// The number of environments copied.
+    uint64_t environment_copies = 0;
+    /// The number of variables held by the environments copied.
+    uint64_t variables_copied = 0;
+    /// The total size of the blocks reserved by the arena, if any, from
+    /// which objects and values were allocated.
+    uint64_t arena_bytes_reserved = 0;
+  };
+
+  /// Enables profiling by the specified profiler on the current thread
+  /// while this instance exists, hiding any enclosing scope.  A scope of
+  /// <tt>nullptr</tt> has no effect.
+  class Scope {
+   public:
+    explicit Scope(Profiler *profiler) : profiler_(profiler) {
+      if (profiler != nullptr) {
+        enclosing_ = current_;
+        current_ = this;
+        num_scopes_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope() {
+      if (profiler_ != nullptr) {
+        current_ = enclosing_;
+        num_scopes_.fetch_sub(1, std::memory_order_relaxed);
+      }
+    }
+
+    /// Returns the number of objects constructed by the current thread
+    /// while this scope was the innermost.
+    uint64_t constructed() const { return constructed_; }
+
+   private:
+    friend class Profiler;
+
+    Profiler *profiler_;
+    Scope *enclosing_ = nullptr;
+    uint64_t constructed_ = 0;
+  };
+
+  Profiler() : start_(std::chrono::steady_clock::now()) { }
+
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  /// Returns the profiler enabled on the current thread, or
+  /// <tt>nullptr</tt> if there is none.
+  static Profiler *Current() {
+    if (num_scopes_.load(std::memory_order_relaxed) == 0 ||
+        current_ == nullptr) {
+      return nullptr;
+    }
+    return current_->profiler_;
+  }
+
+  /// Returns the number of nanoseconds since this profiler was created.
+  int64_t Now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_).count();
+  }
+
+  /// Records the evaluation of the specified file between the specified
+  /// times.
+  void RecordFile(const string &filename, int64_t start, int64_t end);
+
+  /// Records the tokenization of the specified file, separately from its
+  /// evaluation, between the specified times.
+  void RecordTokenize(const string &filename, int64_t start, int64_t end);
+
+  /// Records the evaluation of a statement setting the specified
+  /// variable between the specified times.
+  ///
+  /// \param filename    the file in which the statement was evaluated
+  /// \param varname     the variable set by the statement
+  /// \param constructed the number of objects the statement constructed
+  /// \param start       the time at which evaluation started
+  /// \param end         the time at which evaluation ended
+  void RecordStatement(const string &filename, const string &varname,
+                       uint64_t constructed, int64_t start, int64_t end);
+
+  /// Records the construction of an object of the specified concrete
+  /// type, as timed at the start of its construction, the start of the
+  /// initialization of its members, the start of its <tt>PostInit</tt>
+  /// method and the end of its construction.
+  void RecordConstruction(const string &type, int64_t start, int64_t init,
+                          int64_t post_init, int64_t end);
+
+  /// Records an object of the specified concrete type being shared from
+  /// an identical, memoized spec rather than constructed.
+  void RecordMemoized(const string &type);
+
+  /// Records the creation of a scope for constructing an object.
+  void RecordScope() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.scopes;
+  }
+
+  /// Records an environment holding the specified number of variables
+  /// being copied.
+  void RecordCopy(size_t num_variables) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.environment_copies;
+    stats_.variables_copied += num_variables;
+  }
+
+  /// Returns the statistics collected so far.
+  Stats stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+  }
+
+  /// Writes the events recorded so far in the Chrome trace-event JSON
+  /// format, which <tt>chrome://tracing</tt> and Perfetto can display.
+  void WriteTrace(ostream &os) const;
+
+  /// Discards all statistics and events collected so far.
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_ = Stats();
+    events_.clear();
+  }
+
+ private:
+  /// A complete event of a trace.
+  struct Event {
+    const char *category;
+    string name;
+    /// The file in which a statement was evaluated, if any.
+    string detail;
+    int64_t start;
+    int64_t end;
+    size_t thread;
+  };
+
+  /// Records an event on the current thread.  The caller must hold the
+  /// lock.
+  void AddEvent(const char *category, const string &name,
+                const string &detail, int64_t start, int64_t end);
+
+  static thread_local Scope *current_;
+  static std::atomic<int> num_scopes_;
+
+  const std::chrono::steady_clock::time_point start_;
+  mutable std::mutex mutex_;
+  Stats stats_;
+  vector<Event> events_;
+  /// The index of each thread that has recorded an event.
+  std::map<std::thread::id, size_t> threads_;
+};
+
+/// A read-only view of a contiguous array of values, which shares
+/// ownership of the storage holding them.  Views are cheap to copy, and
+/// are the means of accessing arrays initialized with
+/// <tt>load(...)</tt> literals, such as
+/// \code
+/// double[] weights = load("weights.f64");
+/// \endcode
+/// without copying them, although a view may be had of any
+/// <tt>int[]</tt>, <tt>int64[]</tt>, <tt>float[]</tt> or
+/// <tt>double[]</tt> variable (or, indeed, of a variable of any vector
+/// type).
+///
+/// \tparam T the type of the values in the array
+template <typename T>
+class ArrayView {
+ public:
+  typedef const T *const_iterator;
+
+  /// Constructs an empty view.
+  ArrayView() : size_(0) { }
+
+  /// Constructs a view of the specified number of values, starting at
+  /// the value pointed to by the specified shared pointer.
+  ArrayView(shared_ptr<const T> data, size_t size) :
+      data_(std::move(data)), size_(size) { }
+
+  const T *data() const { return data_.get(); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  const_iterator begin() const { return data_.get(); }
+  const_iterator end() const { return data_.get() + size_; }
+  const T &operator[](size_t i) const { return data_.get()[i]; }
+
+  /// Returns a copy of the values of this view.
+  vector<T> ToVector() const { return vector<T>(begin(), end()); }
+
+ private:
+  shared_ptr<const T> data_;
+  size_t size_;
+};
+
+/// The value of a variable as exported by \link VarMapBase::Export\endlink,
+/// sharing the storage of the variable, which is never modified in
+/// place.
+struct ExportedValue {
+  /// The name of the variable.
+  string name;
+  /// The type of the value, or nullptr if the value is only available
+  /// as a view.
+  const std::type_info *type = nullptr;
+  /// The value, of the type given by \link type\endlink.
+  shared_ptr<const void> value;
+  /// For vector variables, the type of the \link ArrayView\endlink of
+  /// the value, else nullptr.
+  const std::type_info *view_type = nullptr;
+  /// For vector variables, an \link ArrayView\endlink of the value.
+  shared_ptr<const void> view;
+};
+
+/// The alignment, in bytes, of the arrays that an environment lays out
+/// itself: those loaded by <tt>load(...)</tt> literals (which, when
+/// mapped from a file, are aligned to a page) or used from snapshots.
+/// It suffices for the widest SIMD loads, so that their \link ArrayView
+/// views\endlink may be used directly by vectorized code.
+const size_t kArrayAlignment = 64;
+
+/// Returns zero-initialized storage for the specified number of bytes,
+/// aligned to \link kArrayAlignment\endlink.
+inline shared_ptr<char> NewAlignedArray(size_t size) {
+  shared_ptr<vector<char> > storage =
+      std::make_shared<vector<char> >(size + kArrayAlignment - 1);
+  uintptr_t address = reinterpret_cast<uintptr_t>(storage->data());
+  size_t offset = (kArrayAlignment - address % kArrayAlignment) %
+      kArrayAlignment;
+  return shared_ptr<char>(storage, storage->data() + offset);
+}
+
+/// Indicates whether values of a particular type may be loaded from a
+/// raw, little-endian binary file via a <tt>load(...)</tt> literal.  Only
+/// <tt>int</tt> and <tt>int64</tt> (as 32- and 64-bit integers) and
+/// <tt>float</tt> and <tt>double</tt> (as IEEE 754 single- and
+/// double-precision numbers) can.
+///
+/// \tparam T the type of values to be loaded
+template <typename T>
+struct LoadableElement {
+  static const bool kSupported = false;
+};
+
+template <>
+struct LoadableElement<int> {
+  static_assert(sizeof(int) == 4, "load(...) requires a 32-bit int");
+  static const bool kSupported = true;
+};
+
+template <>
+struct LoadableElement<int64_t> {
+  static const bool kSupported = true;
+};
+
+template <>
+struct LoadableElement<float> {
+  static_assert(sizeof(float) == 4, "load(...) requires a 32-bit float");
+  static const bool kSupported = true;
+};
+
+template <>
+struct LoadableElement<double> {
+  static_assert(sizeof(double) == 8, "load(...) requires a 64-bit double");
+  static const bool kSupported = true;
+};
+
+/// The encoding of values of the specified type in a snapshot of an
+/// environment, as written by \link
+/// infact::Interpreter::EvalAndSaveSnapshot
+/// Interpreter::EvalAndSaveSnapshot\endlink.  Only the primitive types
+/// (and so vectors of them) can be encoded, in host byte order.
+///
+/// \tparam T the type of values to be encoded
+template <typename T>
+struct SnapshotCodec {
+  static const bool kSupported = false;
+  static void Append(const T &value, string *bytes) { }
+  static bool Read(const char **data, const char *end, T *value) {
+    return false;
+  }
+};
+
+/// The snapshot encoding of a type whose values are their bytes.
+template <typename T>
+struct BytesSnapshotCodec {
+  static const bool kSupported = true;
+
+  /// Appends the encoding of the specified value to the specified string.
+  static void Append(const T &value, string *bytes) {
+    bytes->append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  /// Reads an encoded value beginning at <tt>*data</tt>, and advances
+  /// <tt>*data</tt> past it, returning whether a value could be read
+  /// before \c end.
+  static bool Read(const char **data, const char *end, T *value) {
+    if (static_cast<size_t>(end - *data) < sizeof(T)) {
+      return false;
+    }
+    memcpy(value, *data, sizeof(T));
+    *data += sizeof(T);
+    return true;
+  }
+};
+
+template <>
+struct SnapshotCodec<int> : BytesSnapshotCodec<int> { };
+
+template <>
+struct SnapshotCodec<int64_t> : BytesSnapshotCodec<int64_t> { };
+
+template <>
+struct SnapshotCodec<float> : BytesSnapshotCodec<float> { };
+
+template <>
+struct SnapshotCodec<double> : BytesSnapshotCodec<double> { };
+
+template <>
+struct SnapshotCodec<bool> {
+  static const bool kSupported = true;
+  static void Append(const bool &value, string *bytes) {
+    bytes->push_back(value ? 1 : 0);
+  }
+  static bool Read(const char **data, const char *end, bool *value) {
+    if (*data == end) {
+      return false;
+    }
+    *value = *(*data)++ != 0;
+    return true;
+  }
+};
+
+/// Strings are encoded as their 64-bit size followed by their characters.
+template <>
+struct SnapshotCodec<string> {
+  static const bool kSupported = true;
+  static void Append(const string &value, string *bytes) {
+    BytesSnapshotCodec<uint64_t>::Append(value.size(), bytes);
+    bytes->append(value);
+  }
+  static bool Read(const char **data, const char *end, string *value) {
+    uint64_t size;
+    if (!BytesSnapshotCodec<uint64_t>::Read(data, end, &size) ||
+        static_cast<uint64_t>(end - *data) < size) {
+      return false;
+    }
+    value->assign(*data, size);
+    *data += size;
+    return true;
+  }
+};
+
+/// Identifies a type without RTTI: the address of the tag of each type
+/// is distinct from that of every other.  A type may have more than one
+/// tag, however, when it is used by several shared objects that do not
+/// export their symbols (as with <tt>-fvisibility=hidden</tt>, or a
+/// plugin loaded with <tt>RTLD_LOCAL</tt>), so distinct identifiers do
+/// not prove that types are distinct.
+///
+/// \tparam T the type identified
+template <typename T>
+struct TypeTag {
+  /// Returns the identifier of the type \a T.
+  static const void *Id() { return &tag_; }
+
+ private:
+  static const char tag_;
+};
+
+template <typename T>
+const char TypeTag<T>::tag_ = 0;
+
 /// A base class for a mapping from variables of a specific type to their
 /// values.
 class VarMapBase {
@@ -73,8 +653,12 @@ class VarMapBase {
   ///                     that wraps this VarMapBase instance
   /// \param is_primitive whether this instance contains primitive or primitive
   ///                     vector variables
-  VarMapBase(const string &name, Environment *env, bool is_primitive) :
-      name_(name), env_(env), is_primitive_(is_primitive) { }
+  /// \param type_id      the \link TypeTag\endlink identifier of the
+  ///                     concrete type of this instance
+  VarMapBase(const string &name, Environment *env, bool is_primitive,
+             const void *type_id) :
+      name_(name), env_(env), is_primitive_(is_primitive),
+      type_id_(type_id) { }
 
   virtual ~VarMapBase() { }
 
@@ -85,6 +669,17 @@ class VarMapBase {
   /// Returns the type name of the variables of this instance.
   virtual const string &Name() const { return name_; }
 
+  /// Returns the \link TypeTag\endlink identifier of the concrete type
+  /// of this instance, by which \link VarMapCast\endlink recovers it.
+  const void *type_id() const { return type_id_; }
+
+  /// Returns whether the specified instance is of the same concrete type
+  /// as this one, checking with RTTI only if their \link TypeTag\endlink
+  /// identifiers differ.
+  bool SameTypeAs(const VarMapBase &other) const {
+    return type_id_ == other.type_id_ || typeid(*this) == typeid(other);
+  }
+
   /// Returns whether the specified variable has a definition in this
   /// environment.
   virtual bool Defined(const string &varname) const = 0;
@@ -95,14 +690,76 @@ class VarMapBase {
   /// that value.
   virtual void ReadAndSet(const string &varname, StreamTokenizer &st) = 0;
 
+  /// Sets the specified variable to a copy of the value at the specified
+  /// address, which must be an object of the type of variables in this
+  /// instance.
+  virtual void SetToValueAt(const string &varname, const void *value) = 0;
+
+  /// Sets the specified variable to the value of the variable of the
+  /// same name in the specified VarMap, which must be of the same type as
+  /// this instance, sharing its storage rather than copying it.  Since
+  /// values are never modified in place, the source may be read
+  /// concurrently by other threads.
+  virtual void ShareValue(const string &varname, const VarMapBase &source) = 0;
+
+  /// Removes the specified variable, if it exists.
+  virtual void Erase(const string &varname) = 0;
+
+  /// Appends to the specified string a fingerprint of the value of the
+  /// specified variable, which two values share only if they are equal:
+  /// a primitive value is its own fingerprint, while any other value is
+  /// identified by the address of its storage, which is never modified
+  /// in place.
+  ///
+  /// \param      varname     the name of the variable
+  /// \param[out] fingerprint the string to which to append the fingerprint
+  /// \param[out] storage     set to the storage whose address is the
+  ///                         fingerprint, if any, which must be kept alive
+  ///                         for as long as the fingerprint is in use
+  /// \return whether the specified variable exists
+  virtual bool Fingerprint(const string &varname, string *fingerprint,
+                           shared_ptr<const void> *storage) const = 0;
+
+  /// Appends to the specified string the encoding of the value of the
+  /// specified variable in a snapshot of its environment, unless its
+  /// value cannot be encoded: only primitive values, and vectors of them,
+  /// can be.  A vector of <tt>int</tt>s or <tt>double</tt>s is encoded
+  /// as its elements, so that it may be used in place when decoded.
+  ///
+  /// \return whether the specified variable exists and its value was
+  ///         encoded
+  virtual bool EncodeValue(const string &varname, string *bytes) const = 0;
+
+  /// Sets the specified variable to the value encoded by \link
+  /// EncodeValue\endlink in the specified characters.  It is an error if
+  /// they are not such an encoding.
+  ///
+  /// \param varname the name of the variable to set
+  /// \param data    the first character of the encoding
+  /// \param size    the number of characters of the encoding
+  /// \param buffer  the buffer holding the encoding, which the value of a
+  ///                vector of <tt>int</tt>s or <tt>double</tt>s shares
+  ///                rather than copying its elements, if they are aligned
+  virtual void DecodeValue(const string &varname, const char *data,
+                           size_t size,
+                           const shared_ptr<const FileBuffer> &buffer) = 0;
+
   /// Prints out a human-readable string to the specified output
   /// stream containing the variables, their type and, if primitive,
   /// their values.
   virtual void Print(ostream &os) const = 0;
 
+  /// Appends the values of all variables in this instance to the
+  /// specified vector, without copying them.
+  virtual void Export(vector<ExportedValue> *values) const = 0;
+
   /// Returns a newly constructed copy of this VarMap.
   virtual VarMapBase *Copy(Environment *env) const = 0;
 
+  /// Returns a newly constructed, empty VarMap for variables of the same
+  /// type as the variables of this VarMap.
+  virtual VarMapBase *CreateEmpty(Environment *env) const = 0;
+
  protected:
   /// To allow proper implementation of Copy in VarMapBase implementation,
   /// since we don't get copying of base class' members for free.
@@ -119,10 +776,51 @@ class VarMapBase {
   /// Whether this VarMap instance holds variables of primitive type
   /// or vector of primitives.
   bool is_primitive_;
+  /// The identifier of the concrete type of this instance.
+  const void *type_id_;
 };
 
+/// Returns the specified VarMap as an instance of the specified concrete
+/// VarMap type, or <tt>nullptr</tt> if it is not one (or is
+/// <tt>nullptr</tt>).  This is equivalent to a <tt>dynamic_cast</tt>,
+/// but usually costs a single comparison, however deep the class
+/// hierarchy of the variables held; only if the \link TypeTag\endlink
+/// identifiers differ, as they may for a VarMap created by another
+/// shared object, is a <tt>dynamic_cast</tt> performed.
+///
+/// \tparam V the concrete VarMap type, such as <tt>VarMap<int></tt>
+template <typename V>
+V *VarMapCast(VarMapBase *var_map) {
+  if (var_map == nullptr) {
+    return nullptr;
+  }
+  return var_map->type_id() == TypeTag<V>::Id() ?
+      static_cast<V *>(var_map) : dynamic_cast<V *>(var_map);
+}
+
+/// Returns the specified VarMap as an instance of the specified concrete
+/// VarMap type, or <tt>nullptr</tt> if it is not one (or is
+/// <tt>nullptr</tt>).
+///
+/// \tparam V the concrete VarMap type, such as <tt>VarMap<int></tt>
+template <typename V>
+const V *VarMapCast(const VarMapBase *var_map) {
+  if (var_map == nullptr) {
+    return nullptr;
+  }
+  return var_map->type_id() == TypeTag<V>::Id() ?
+      static_cast<const V *>(var_map) : dynamic_cast<const V *>(var_map);
+}
+
 /// An interface for an environment in which variables of various
 /// types are mapped to their values.
+///
+/// The variables named after the members of an object under construction
+/// (see \link Factory::CreateOrDie\endlink) are bound to the members
+/// themselves, and their values are only copied when first looked up
+/// (see \link BindDeferred\endlink).  So if a member is modified, as by
+/// <tt>PostInit</tt>, before its variable is first looked up, the lookup
+/// yields the modified value.
 class Environment {
  public:
   virtual ~Environment() { }
@@ -136,10 +834,52 @@ class Environment {
   virtual void ReadAndSet(const string &varname, StreamTokenizer &st,
                           const string type = "") = 0;
 
+  /// Checks that the value given by the following tokens available from
+  /// the specified token stream may be assigned to the specified
+  /// variable, exactly as \link ReadAndSet \endlink would, and returns
+  /// the VarMap in this environment for the value&rsquo;s type, without
+  /// consuming any tokens.  This allows a value to be read directly into
+  /// an object of its type via the returned VarMap.
+  virtual VarMapBase *GetVarMapForValue(const string &varname,
+                                        StreamTokenizer &st,
+                                        const string type = "") = 0;
+
+  /// Binds the specified variable to the value of the object at the
+  /// specified address, which must be of the type of the variables of
+  /// the specified VarMap of this environment, and must remain valid for
+  /// the lifetime of this environment.  The value is only copied into
+  /// the environment if and when the variable is looked up, so binding a
+  /// variable that is never referred to costs almost nothing.  A lookup
+  /// therefore yields the value the object holds at the time of the
+  /// (first) lookup, rather than at the time of binding: a change made to
+  /// the object in between is seen by that lookup.
+  virtual void BindDeferred(const string &varname, VarMapBase *var_map,
+                            const void *value) = 0;
+
+  /// Returns the contents of the file named by a <tt>load(...)</tt>
+  /// literal, resolving its name as an import would be resolved.  It is
+  /// an error if the file cannot be read.
+  virtual shared_ptr<const FileBuffer> LoadFile(const string &filename) = 0;
+
+  /// Returns the arena from which the objects constructed, and the values
+  /// of the variables set, in this environment are allocated, or
+  /// <tt>nullptr</tt> if they are allocated normally.
+  virtual shared_ptr<Arena> arena() const = 0;
+
+  /// Returns whether the next token of the specified stream tokenizer
+  /// begins a <tt>load(...)</tt> literal, as opposed to naming a
+  /// variable.
+  bool AtLoadLiteral(const StreamTokenizer &st) const {
+    return st.PeekTokenType() == StreamTokenizer::IDENTIFIER &&
+        st.Peek() == "load" && !Defined("load");
+  }
+
   /// Retrieves the type name of the specified variable.
   virtual const string &GetType(const string &varname) const = 0;
 
-  /// Retrieves the VarMap instance for the specified variable.
+  /// Retrieves the VarMap instance holding the value of the specified
+  /// variable, or nullptr if the variable is not defined, so that a
+  /// variable may be both tested for and looked up at once.
   virtual VarMapBase *GetVarMap(const string &varname) = 0;
 
   /// Retrieves the VarMap instance for the specified type, or nullptr if
@@ -166,9 +906,24 @@ class Environment {
   /// their types and, if primitive, their values.
   virtual void Print(ostream &os) const = 0;
 
-  /// Returns a copy of this environment.
+  /// Returns a copy of this environment.  The copy is independent of the
+  /// \link Interpreter\endlink that created this environment, and so
+  /// reads the files named by <tt>load(...)</tt> literals it evaluates
+  /// from the named paths, rather than resolving them as that
+  /// interpreter resolves imports.
   virtual Environment *Copy() const = 0;
 
+  /// Returns a new, empty scope nested inside this environment.
+  /// Variables set in the returned environment are local to it, while
+  /// lookups of variables it does not define fall through to this
+  /// environment, so creating a child scope takes constant time,
+  /// regardless of the number of variables in this environment.
+  ///
+  /// The returned environment must not outlive this environment, and
+  /// this environment should not be modified while the returned
+  /// environment is in use.
+  virtual Environment *CreateChild() = 0;
+
   /// Prints out a human-readable string with the names of all abstract base
   /// types and their concrete implementations that may be constructed.
   /// \see infact::FactoryContainer::Print
@@ -266,7 +1021,7 @@ template <typename T, typename Derived>
 class VarMapImpl : public VarMapBase {
  public:
   VarMapImpl(const string &name, Environment *env, bool is_primitive = true) :
-      VarMapBase(name, env, is_primitive) { }
+      VarMapBase(name, env, is_primitive, TypeTag<Derived>::Id()) { }
 
   virtual ~VarMapImpl() { }
 
@@ -278,31 +1033,126 @@ class VarMapImpl : public VarMapBase {
   /// \return whether the specified variable exists and the assignment
   ///         was successful
   bool Get(const string &varname, T *value) const {
-    typename unordered_map<string, T>::const_iterator it = vars_.find(varname);
+    typename unordered_map<string, shared_ptr<T> >::const_iterator it =
+        vars_.find(varname);
     if (it == vars_.end()) {
       return false;
     } else {
-      *value = it->second;
+      *value = *it->second;
       return true;
     }
   }
 
+  /// Returns a pointer to the value of the specified variable, or
+  /// nullptr if there is no such variable, without copying it.  The
+  /// returned pointer remains valid until the variable is set again or
+  /// removed, or this instance is destroyed.
+  const T *Find(const string &varname) const {
+    typename unordered_map<string, shared_ptr<T> >::const_iterator it =
+        vars_.find(varname);
+    return it == vars_.end() ? nullptr : it->second.get();
+  }
+
+  /// Moves the value of the specified variable into the object pointed
+  /// to by the <tt>value</tt> parameter and removes the variable.  If the
+  /// value is shared with other variables (aliases), it is copied instead.
+  ///
+  /// \return whether the specified variable existed
+  bool Take(const string &varname, T *value) {
+    typename unordered_map<string, shared_ptr<T> >::iterator it =
+        vars_.find(varname);
+    if (it == vars_.end()) {
+      return false;
+    }
+    if (it->second.use_count() == 1) {
+      *value = std::move(*it->second);
+    } else {
+      *value = *it->second;
+    }
+    vars_.erase(it);
+    return true;
+  }
+
   /// \copydoc VarMapBase::Defined
   virtual bool Defined(const string &varname) const {
     return vars_.find(varname) != vars_.end();
   }
 
-  /// Sets the specified variable to the specified value.
+  /// Sets the specified variable to the specified value.  Values are
+  /// never modified in place once set, which is what allows variables
+  /// (and copies of this instance) to share them.
   void Set(const string &varname, T value) {
-    vars_[varname] = value;
+    shared_ptr<Arena> arena = env() == nullptr ? nullptr : env()->arena();
+    if (arena != nullptr) {
+      vars_[varname] = std::allocate_shared<T>(ArenaAllocator<T>(arena),
+                                               std::move(value));
+    } else {
+      vars_[varname] = std::make_shared<T>(std::move(value));
+    }
+  }
+
+  /// \copydoc VarMapBase::SetToValueAt
+  virtual void SetToValueAt(const string &varname, const void *value) {
+    Set(varname, *static_cast<const T *>(value));
+  }
+
+  /// \copydoc VarMapBase::Erase
+  virtual void Erase(const string &varname) { vars_.erase(varname); }
+
+  /// \copydoc VarMapBase::Fingerprint
+  virtual bool Fingerprint(const string &varname, string *fingerprint,
+                           shared_ptr<const void> *storage) const {
+    typename unordered_map<string, shared_ptr<T> >::const_iterator it =
+        vars_.find(varname);
+    if (it == vars_.end()) {
+      return false;
+    }
+    ostringstream oss;
+    oss << it->second.get();
+    fingerprint->append(oss.str());
+    *storage = it->second;
+    return true;
+  }
+
+  /// \copydoc VarMapBase::ShareValue
+  virtual void ShareValue(const string &varname, const VarMapBase &source) {
+    const Derived *typed_source = VarMapCast<Derived>(&source);
+    if (typed_source == nullptr) {
+      Error("bad VarMap cast");
+    }
+    typename unordered_map<string, shared_ptr<T> >::const_iterator it =
+        typed_source->vars_.find(varname);
+    if (it != typed_source->vars_.end()) {
+      vars_[varname] = it->second;
+    }
+  }
+
+  /// Reads the next value (a variable name, or else a value as read by
+  /// \link VarMapBase::ReadAndSet ReadAndSet\endlink) from the specified
+  /// stream tokenizer directly into the specified object, rather than
+  /// into a variable.
+  ///
+  /// \param varname the name of the variable being initialized, used only
+  ///                for error messages
+  /// \param st      the stream tokenizer from which to read the value
+  /// \param value   the object to be set to the value
+  /// \return whether the object was set
+  bool ReadInto(const string &varname, StreamTokenizer &st, T *value) {
+    bool success = false;
+    if (ReadFromExistingVariable(varname, st, value, &success)) {
+      return success;
+    }
+    static_cast<Derived *>(this)->ReadValue(varname, st, value);
+    return true;
   }
 
   /// \copydoc VarMapBase::Print
   virtual void Print(ostream &os) const {
     ValueString<T> value_string;
-    for (typename unordered_map<string, T>::const_iterator it = vars_.begin();
+    for (typename unordered_map<string, shared_ptr<T> >::const_iterator it =
+             vars_.begin();
          it != vars_.end(); ++it) {
-      const T& value = it->second;
+      const T& value = *it->second;
       os << Name() << " "
          << it->first
          << " = "
@@ -312,60 +1162,119 @@ class VarMapImpl : public VarMapBase {
     os.flush();
   }
 
+  /// \copydoc VarMapBase::Export
+  virtual void Export(vector<ExportedValue> *values) const {
+    for (typename unordered_map<string, shared_ptr<T> >::const_iterator it =
+             vars_.begin();
+         it != vars_.end(); ++it) {
+      ExportedValue exported;
+      exported.name = it->first;
+      exported.type = &typeid(T);
+      exported.value = it->second;
+      values->push_back(std::move(exported));
+    }
+  }
+
   /// \copydoc VarMapBase::Copy
   virtual VarMapBase *Copy(Environment *env) const {
     // Invoke Derived class' copy constructor.
-    const Derived *derived = dynamic_cast<const Derived *>(this);
-    if (derived == nullptr) {
-      Error("bad dynamic cast");
-    }
+    const Derived *derived = static_cast<const Derived *>(this);
     Derived *var_map_copy = new Derived(*derived);
     var_map_copy->SetMembers(name_, env, is_primitive_);
     return var_map_copy;
   }
  protected:
   /// Checks if the next token is an identifier and is a variable in
-  /// the environment, and, if so, sets varname to the variable&rsquo;s value.
+  /// the environment, and, if so, sets varname to the variable&rsquo;s
+  /// value, sharing its storage rather than copying it.
   bool ReadAndSetFromExistingVariable(const string &varname,
                                       StreamTokenizer &st) {
-    if (env()->Defined(st.Peek())) {
-      VarMapBase *var_map = env()->GetVarMap(st.Peek());
-      Derived *typed_var_map = dynamic_cast<Derived *>(var_map);
-      if (typed_var_map != nullptr) {
-        // Finally consume variable.
-        string rhs_variable = st.Next();
-        T value = T();
-        // Retrieve rhs variable's value.
-        bool success = typed_var_map->Get(rhs_variable, &value);
-        // Set varname to the same value.
-        if (VAR_MAP_DEBUG >= 1) {
-          cerr << "VarMap<" << Name() << ">::ReadAndSet: "
-               << "setting variable "
-               << varname << " to same value as rhs variable " << rhs_variable
-               << endl;
-        }
-        if (success) {
-          Set(varname, value);
-        } else {
-          // Error: we couldn't find the varname in this VarMap.
-          if (VAR_MAP_DEBUG >= 1) {
-            cerr << "VarMap<" << Name() << ">::ReadAndSet: no variable "
-                 << rhs_variable << " found " << endl;
-          }
-        }
+    bool is_variable = false;
+    Derived *typed_var_map = FindExistingVariable(st, &is_variable);
+    if (typed_var_map != nullptr) {
+      // Finally consume variable.
+      string rhs_variable = st.Next();
+      typename unordered_map<string, shared_ptr<T> >::const_iterator rhs_it =
+          typed_var_map->vars_.find(rhs_variable);
+      if (VAR_MAP_DEBUG >= 1) {
+        cerr << "VarMap<" << Name() << ">::ReadAndSet: "
+             << "setting variable "
+             << varname << " to same value as rhs variable " << rhs_variable
+             << endl;
+      }
+      if (rhs_it != typed_var_map->vars_.end()) {
+        vars_[varname] = rhs_it->second;
       } else {
-        // Error: inferred or declared type of varname is different
-        // from the type of the rhs variable.
+        // Error: we couldn't find the varname in this VarMap.
         if (VAR_MAP_DEBUG >= 1) {
-          cerr << "VarMap<" << Name() << ">::ReadAndSet: variable "
-               << st.Peek() << " is of type " << var_map->Name()
-               << " but expecting " << typeid(T).name() << endl;
+          cerr << "VarMap<" << Name() << ">::ReadAndSet: no variable "
+               << rhs_variable << " found " << endl;
         }
       }
-      return true;
-    } else {
-      return false;
     }
+    return is_variable;
+  }
+
+  /// Checks if the next token is an identifier and is a variable in
+  /// the environment, and, if so, sets the specified object to the
+  /// variable&rsquo;s value.
+  ///
+  /// \param      varname the name of the variable being initialized
+  /// \param      st      the stream tokenizer
+  /// \param[out] value   the object to be set to the variable&rsquo;s value
+  /// \param[out] success whether the object was set
+  /// \return whether the next token was a variable (and was consumed)
+  bool ReadFromExistingVariable(const string &varname, StreamTokenizer &st,
+                                T *value, bool *success) {
+    *success = false;
+    bool is_variable = false;
+    Derived *typed_var_map = FindExistingVariable(st, &is_variable);
+    if (typed_var_map != nullptr) {
+      // Finally consume variable.
+      string rhs_variable = st.Next();
+      // Retrieve rhs variable's value.
+      *success = typed_var_map->Get(rhs_variable, value);
+      if (VAR_MAP_DEBUG >= 1) {
+        cerr << "VarMap<" << Name() << ">::ReadAndSet: "
+             << "setting variable "
+             << varname << " to same value as rhs variable " << rhs_variable
+             << endl;
+      }
+    }
+    return is_variable;
+  }
+
+  /// Checks if the next token is an identifier and is a variable in the
+  /// environment, returning the VarMap holding it if it is of the type
+  /// of the variables in this VarMap, or else nullptr.
+  ///
+  /// \param      st          the stream tokenizer
+  /// \param[out] is_variable whether the next token is a variable
+  Derived *FindExistingVariable(StreamTokenizer &st, bool *is_variable) {
+    VarMapBase *var_map = env()->GetVarMap(st.Peek());
+    *is_variable = var_map != nullptr;
+    if (!*is_variable) {
+      return nullptr;
+    }
+    Derived *typed_var_map = VarMapCast<Derived>(var_map);
+    if (typed_var_map == nullptr) {
+      // Error: inferred or declared type of varname is different
+      // from the type of the rhs variable.
+      if (VAR_MAP_DEBUG >= 1) {
+        cerr << "VarMap<" << Name() << ">::ReadAndSet: variable "
+             << st.Peek() << " is of type " << var_map->Name()
+             << " but expecting " << typeid(T).name() << endl;
+      }
+    }
+    return typed_var_map;
+  }
+
+  /// Returns the shared storage of the value of the specified variable,
+  /// or nullptr if there is no such variable.
+  shared_ptr<const T> FindShared(const string &varname) const {
+    typename unordered_map<string, shared_ptr<T> >::const_iterator it =
+        vars_.find(varname);
+    return it == vars_.end() ? shared_ptr<const T>() : it->second;
   }
 
   /// A protected method to access the environment contained by this
@@ -373,7 +1282,8 @@ class VarMapImpl : public VarMapBase {
   Environment *env() { return VarMapBase::env_; }
 
  private:
-  unordered_map<string, T> vars_;
+  // The values of variables, which are shared by aliases.
+  unordered_map<string, shared_ptr<T> > vars_;
 };
 
 /// A container to hold the mapping between named variables of a specific
@@ -397,6 +1307,58 @@ class VarMap : public VarMapImpl<T, VarMap<T> > {
 
   virtual ~VarMap() { }
 
+  /// \copydoc VarMapBase::CreateEmpty
+  virtual VarMapBase *CreateEmpty(Environment *env) const {
+    return new VarMap<T>(Base::Name(), env, Base::IsPrimitive());
+  }
+
+  /// \copydoc VarMapBase::Fingerprint
+  ///
+  /// A primitive is identified by its value, rather than its storage.
+  virtual bool Fingerprint(const string &varname, string *fingerprint,
+                           shared_ptr<const void> *storage) const {
+    if (!Base::IsPrimitive()) {
+      return Base::Fingerprint(varname, fingerprint, storage);
+    }
+    shared_ptr<const T> value = Base::FindShared(varname);
+    if (value == nullptr) {
+      return false;
+    }
+    ostringstream oss;
+    oss.precision(std::numeric_limits<double>::max_digits10);
+    oss << *value;
+    fingerprint->append(oss.str());
+    return true;
+  }
+
+  /// \copydoc VarMapBase::EncodeValue
+  virtual bool EncodeValue(const string &varname, string *bytes) const {
+    if (!SnapshotCodec<T>::kSupported) {
+      return false;
+    }
+    const T *value = Base::Find(varname);
+    if (value == nullptr) {
+      return false;
+    }
+    SnapshotCodec<T>::Append(*value, bytes);
+    return true;
+  }
+
+  /// \copydoc VarMapBase::DecodeValue
+  virtual void DecodeValue(const string &varname, const char *data,
+                           size_t size,
+                           const shared_ptr<const FileBuffer> &buffer) {
+    const char *end = data + size;
+    T value = T();
+    if (!SnapshotCodec<T>::Read(&data, end, &value) || data != end) {
+      ostringstream err_ss;
+      err_ss << "VarMap<" << Base::Name() << ">: error: malformed snapshot "
+             << "value for variable " << varname;
+      Error(err_ss.str());
+    }
+    this->Set(varname, std::move(value));
+  }
+
   /// \copydoc VarMapBase::ReadAndSet
   virtual void ReadAndSet(const string &varname, StreamTokenizer &st) {
     if (VAR_MAP_DEBUG >= 1) {
@@ -409,17 +1371,125 @@ class VarMap : public VarMapImpl<T, VarMap<T> > {
 
     if (!Base::ReadAndSetFromExistingVariable(varname, st)) {
       T value;
-      Initializer<T> initializer(&value);
-      initializer.Init(st, Base::env());
-      this->Set(varname, value);
+      ReadValue(varname, st, &value);
 
       if (VAR_MAP_DEBUG >= 1) {
         ValueString<T> value_string;
         cerr << "VarMap<" << Base::Name() << ">::ReadAndSet: set varname "
              << varname << " to value " << value_string.ToString(value)<< endl;
       }
+      this->Set(varname, std::move(value));
+    }
+  }
+
+  /// Reads a value (but not a variable name) from the specified stream
+  /// tokenizer into the specified object.
+  void ReadValue(const string &varname, StreamTokenizer &st, T *value) {
+    Initializer<T> initializer(value);
+    initializer.Init(st, Base::env());
+  }
+};
+
+/// Appends numeric literals of a particular type to a vector, for use with
+/// \link StreamTokenizer::ScanNumberList\endlink.  This generic version
+/// supports no type, so that the elements of vectors of other types are
+/// always read one at a time.
+///
+/// \tparam T the element type of the vector
+template <typename T>
+struct NumberListAppender {
+  static const bool kSupported = false;
+
+  explicit NumberListAppender(vector<T> *vec) { }
+
+  bool operator()(const char *s, size_t n) { return false; }
+};
+
+/// Appends <tt>int</tt> literals to a vector.  Literals that are not plain
+/// decimal integers are rejected, and so left for the
+/// \link infact::Initializer Initializer\endlink, which reports a literal
+/// bearing a decimal point as a type error.
+template <>
+struct NumberListAppender<int> {
+  static const bool kSupported = true;
+
+  explicit NumberListAppender(vector<int> *vec) : vec_(vec) { }
+
+  bool operator()(const char *s, size_t n) {
+    int value;
+    if (!FastParseInt(s, n, &value)) {
+      return false;
+    }
+    vec_->push_back(value);
+    return true;
+  }
+
+  vector<int> *vec_;
+};
+
+/// Appends <tt>int64</tt> literals to a vector, just as <tt>int</tt>
+/// literals are appended.  Literals out of the range of the fast path
+/// are left for the \link infact::Initializer Initializer\endlink,
+/// which checks their range.
+template <>
+struct NumberListAppender<int64_t> {
+  static const bool kSupported = true;
+
+  explicit NumberListAppender(vector<int64_t> *vec) : vec_(vec) { }
+
+  bool operator()(const char *s, size_t n) {
+    int64_t value;
+    if (!FastParseInt64(s, n, &value)) {
+      return false;
+    }
+    vec_->push_back(value);
+    return true;
+  }
+
+  vector<int64_t> *vec_;
+};
+
+/// Appends <tt>float</tt> literals to a vector, just as <tt>double</tt>
+/// literals are appended.
+template <>
+struct NumberListAppender<float> {
+  static const bool kSupported = true;
+
+  explicit NumberListAppender(vector<float> *vec) : vec_(vec) { }
+
+  bool operator()(const char *s, size_t n) {
+    float value;
+    if (memchr(s, '.', n) == nullptr || !FastParseFloat(s, n, &value)) {
+      return false;
     }
+    vec_->push_back(value);
+    return true;
   }
+
+  vector<float> *vec_;
+};
+
+/// Appends <tt>double</tt> literals to a vector.  Only literals with a
+/// decimal point, and so inferred to be <tt>double</tt>s, whose value is
+/// exactly computable by \link infact::FastParseDouble FastParseDouble
+/// \endlink are accepted; all others are left for the
+/// \link infact::Initializer Initializer\endlink.
+template <>
+struct NumberListAppender<double> {
+  static const bool kSupported = true;
+
+  explicit NumberListAppender(vector<double> *vec) : vec_(vec) { }
+
+  bool operator()(const char *s, size_t n) {
+    double value;
+    if (memchr(s, '.', n) == nullptr || !FastParseDouble(s, n, &value)) {
+      return false;
+    }
+    vec_->push_back(value);
+    return true;
+  }
+
+  vector<double> *vec_;
 };
 
 /// A partial specialization to allow initialization of a vector of
@@ -456,76 +1526,540 @@ class VarMap<vector<T> > : public VarMapImpl<vector<T>, VarMap<vector<T> > > {
 
   virtual ~VarMap() { }
 
+  /// \copydoc VarMapBase::CreateEmpty
+  virtual VarMapBase *CreateEmpty(Environment *env) const {
+    return new VarMap<vector<T> >(Base::Name(), element_typename_, env,
+                                  Base::IsPrimitive());
+  }
+
+  /// \copydoc VarMapBase::Defined
+  virtual bool Defined(const string &varname) const {
+    return Base::Defined(varname) || loaded_.find(varname) != loaded_.end();
+  }
+
+  /// Assigns a copy of the value of the specified variable to the object
+  /// pointed to by the <tt>value</tt> parameter.
+  ///
+  /// \return whether the specified variable exists
+  bool Get(const string &varname, vector<T> *value) const {
+    typename unordered_map<string, LoadedArray>::const_iterator it =
+        loaded_.find(varname);
+    if (it == loaded_.end()) {
+      return Base::Get(varname, value);
+    }
+    value->assign(it->second.view.begin(), it->second.view.end());
+    return true;
+  }
+
+  /// Returns a pointer to the value of the specified variable, or
+  /// nullptr if there is no such variable.  The value of a variable
+  /// initialized by a <tt>load(...)</tt> literal is copied into a vector
+  /// the first time it is found; use \link GetView\endlink to avoid
+  /// the copy.
+  const vector<T> *Find(const string &varname) const {
+    typename unordered_map<string, LoadedArray>::const_iterator it =
+        loaded_.find(varname);
+    return it == loaded_.end() ? Base::Find(varname) : it->second.values();
+  }
+
+  /// Moves the value of the specified variable into the object pointed
+  /// to by the <tt>value</tt> parameter and removes the variable.
+  ///
+  /// \return whether the specified variable existed
+  bool Take(const string &varname, vector<T> *value) {
+    typename unordered_map<string, LoadedArray>::iterator it =
+        loaded_.find(varname);
+    if (it == loaded_.end()) {
+      return Base::Take(varname, value);
+    }
+    *value = *it->second.values();
+    loaded_.erase(it);
+    return true;
+  }
+
+  /// Sets the object pointed to by the <tt>view</tt> parameter to a view
+  /// of the value of the specified variable, without copying it.
+  ///
+  /// \return whether the specified variable exists
+  bool GetView(const string &varname, ArrayView<T> *view) const {
+    typename unordered_map<string, LoadedArray>::const_iterator it =
+        loaded_.find(varname);
+    if (it != loaded_.end()) {
+      *view = it->second.view;
+      return true;
+    }
+    shared_ptr<const vector<T> > values = Base::FindShared(varname);
+    if (values == nullptr) {
+      return false;
+    }
+    // Values are never modified in place, so the view may share them.
+    *view = ArrayView<T>(shared_ptr<const T>(values, values->data()),
+                         values->size());
+    return true;
+  }
+
+  /// \copydoc VarMapBase::SetToValueAt
+  virtual void SetToValueAt(const string &varname, const void *value) {
+    loaded_.erase(varname);
+    Base::SetToValueAt(varname, value);
+  }
+
+  /// \copydoc VarMapBase::Erase
+  virtual void Erase(const string &varname) {
+    loaded_.erase(varname);
+    Base::Erase(varname);
+  }
+
+  /// \copydoc VarMapBase::Fingerprint
+  ///
+  /// Vectors, even of primitives, are always identified by their storage.
+  virtual bool Fingerprint(const string &varname, string *fingerprint,
+                           shared_ptr<const void> *storage) const {
+    ostringstream oss;
+    typename unordered_map<string, LoadedArray>::const_iterator it =
+        loaded_.find(varname);
+    if (it != loaded_.end()) {
+      const ArrayView<T> &view = it->second.view;
+      oss << view.data() << "+" << view.size();
+      *storage = std::make_shared<const ArrayView<T> >(view);
+    } else {
+      shared_ptr<const vector<T> > values = Base::FindShared(varname);
+      if (values == nullptr) {
+        return false;
+      }
+      oss << values.get();
+      *storage = values;
+    }
+    fingerprint->append(oss.str());
+    return true;
+  }
+
+  /// \copydoc VarMapBase::ShareValue
+  virtual void ShareValue(const string &varname, const VarMapBase &source) {
+    const VarMap<vector<T> > *typed_source =
+        VarMapCast<VarMap<vector<T> > >(&source);
+    if (typed_source != nullptr) {
+      typename unordered_map<string, LoadedArray>::const_iterator it =
+          typed_source->loaded_.find(varname);
+      if (it != typed_source->loaded_.end()) {
+        Base::Erase(varname);
+        loaded_[varname] = it->second;
+        return;
+      }
+    }
+    loaded_.erase(varname);
+    Base::ShareValue(varname, source);
+  }
+
+  /// \copydoc VarMapBase::EncodeValue
+  virtual bool EncodeValue(const string &varname, string *bytes) const {
+    if (!SnapshotCodec<T>::kSupported) {
+      return false;
+    }
+    typename unordered_map<string, LoadedArray>::const_iterator it =
+        loaded_.find(varname);
+    if (it != loaded_.end()) {
+      const ArrayView<T> &view = it->second.view;
+      bytes->append(reinterpret_cast<const char *>(view.data()),
+                    view.size() * sizeof(T));
+      return true;
+    }
+    const vector<T> *values = Base::Find(varname);
+    if (values == nullptr) {
+      return false;
+    }
+    AppendEncoding(*values, bytes, InPlace());
+    return true;
+  }
+
+  /// \copydoc VarMapBase::DecodeValue
+  virtual void DecodeValue(const string &varname, const char *data,
+                           size_t size,
+                           const shared_ptr<const FileBuffer> &buffer) {
+    if (!Decode(varname, data, size, buffer, InPlace())) {
+      ostringstream err_ss;
+      err_ss << "VarMap<" << Base::Name() << ">: error: malformed snapshot "
+             << "value for variable " << varname;
+      Error(err_ss.str());
+    }
+  }
+
+  /// \copydoc VarMapBase::Print
+  ///
+  /// An array used in place from a snapshot, rather than loaded from a
+  /// file, is printed as a list of its values.
+  virtual void Print(ostream &os) const {
+    Base::Print(os);
+    ValueString<vector<T> > value_string;
+    for (typename unordered_map<string, LoadedArray>::const_iterator it =
+             loaded_.begin();
+         it != loaded_.end(); ++it) {
+      os << Base::Name() << " " << it->first << " = ";
+      if (it->second.filename.empty()) {
+        os << value_string.ToString(*it->second.values());
+      } else {
+        os << "load(\"" << it->second.filename << "\")";
+      }
+      os << ";\n";
+    }
+    os.flush();
+  }
+
+  /// \copydoc VarMapBase::Export
+  ///
+  /// Every vector (except a <tt>vector<bool></tt>, which has no
+  /// contiguous storage) is also exported as an \link ArrayView\endlink,
+  /// while arrays initialized by <tt>load(...)</tt> literals are exported
+  /// <i>only</i> as views, so that they are never copied.
+  virtual void Export(vector<ExportedValue> *values) const {
+    size_t first = values->size();
+    Base::Export(values);
+    ExportViews(values, first, std::is_same<T, bool>());
+    for (typename unordered_map<string, LoadedArray>::const_iterator it =
+             loaded_.begin();
+         it != loaded_.end(); ++it) {
+      ExportedValue exported;
+      exported.name = it->first;
+      exported.view_type = &typeid(ArrayView<T>);
+      exported.view = std::make_shared<const ArrayView<T> >(it->second.view);
+      values->push_back(std::move(exported));
+    }
+  }
+
   virtual void ReadAndSet(const string &varname, StreamTokenizer &st) {
+    // An array loaded from a file is kept where it was loaded, as is an
+    // alias of one.
+    if (Base::env()->AtLoadLiteral(st)) {
+      LoadedArray loaded;
+      loaded.view = ReadLoad(varname, st, &loaded.filename);
+      Base::Erase(varname);
+      loaded_[varname] = std::move(loaded);
+      return;
+    }
+    if (ReadAndSetFromLoadedVariable(varname, st)) {
+      return;
+    }
+    loaded_.erase(varname);
+
     // First check if next token is an identifier and is a variable in
     // the environment, set varname to its value.
     if (!Base::ReadAndSetFromExistingVariable(varname, st)) {
-      // This entire block reads the array of values.
+      vector<T> value;
+      ReadValue(varname, st, &value);
 
-      // Either the next token is an open brace (if reading tokens from
-      // within a Factory-constructible object's member init list), or
-      // else we just read an open brace (if Interpreter is reading tokens).
-      if (st.Peek() == "{") {
-        // Consume open brace.
-        st.Next();
-      } else {
-        ostringstream err_ss;
-        err_ss << "VarMap<vector<T>>: "
-               << "error: expected '{' at stream position "
-               << st.PeekPrevTokenStart() << " but found \""
-               << st.PeekPrev() << "\"";
-        Error(err_ss.str());
-      }
+      // Finally, set the newly-constructed value.
+      this->Set(varname, std::move(value));
+    }
+  }
 
-      vector<T> value;
-      int element_idx = 0;
-      while (st.Peek() != "}") {
-        // Copy the environment, since we create fake names for each element.
-        shared_ptr<Environment> env_ptr(Base::env()->Copy());
-        ostringstream element_name_oss;
-        element_name_oss << "____" << varname << "_" << (element_idx++)
-                         << "____";
-        string element_name = element_name_oss.str();
-
-        env_ptr->ReadAndSet(element_name, st, element_typename_);
+  /// Reads an array of values (but not a variable name) from the
+  /// specified stream tokenizer into the specified vector.
+  void ReadValue(const string &varname, StreamTokenizer &st, vector<T> *value) {
+    if (Base::env()->AtLoadLiteral(st)) {
+      string filename;
+      ArrayView<T> view = ReadLoad(varname, st, &filename);
+      value->assign(view.begin(), view.end());
+      return;
+    }
+    // Either the next token is an open brace (if reading tokens from
+    // within a Factory-constructible object's member init list), or
+    // else we just read an open brace (if Interpreter is reading tokens).
+    if (st.Peek() == "{") {
+      // Consume open brace.
+      st.Next();
+    } else {
+      ostringstream err_ss;
+      err_ss << "VarMap<vector<T>>: "
+             << "error: expected '{' at stream position "
+             << st.PeekPrevTokenStart() << " but found \""
+             << st.PeekPrev() << "\"";
+      Error(err_ss.str());
+    }
+
+    value->clear();
+    int element_idx = 0;
+    if (NumberListAppender<T>::kSupported &&
+        st.PeekTokenType() == StreamTokenizer::NUMBER) {
+      value->reserve(st.CountBefore(',', '}') + 1);
+    }
+    while (st.Peek() != "}") {
+      // Runs of numeric literals are parsed straight from the
+      // tokenizer's buffer, without a token or lookup per element.
+      size_t num_scanned = 0;
+      if (NumberListAppender<T>::kSupported &&
+          st.PeekTokenType() == StreamTokenizer::NUMBER) {
+        NumberListAppender<T> appender(value);
+        num_scanned = st.ScanNumberList(appender);
+        element_idx += num_scanned;
+      }
+      if (num_scanned == 0) {
+        // Each element is read directly into the vector, so no names for
+        // elements, or scopes to hold them, are needed.
         VarMapBase *element_var_map =
-            env_ptr->GetVarMapForType(element_typename_);
+            Base::env()->GetVarMapForValue(varname, st, element_typename_);
         VarMap<T> *typed_element_var_map =
-            dynamic_cast<VarMap<T> *>(element_var_map);
+            VarMapCast<VarMap<T> >(element_var_map);
         T element;
-        if (typed_element_var_map->Get(element_name, &element)) {
-          value.push_back(element);
+        if (typed_element_var_map != nullptr &&
+            typed_element_var_map->ReadInto(varname, st, &element)) {
+          value->push_back(std::move(element));
+          ++element_idx;
         } else {
           ostringstream err_ss;
           err_ss << "VarMap<" << Base::Name() << ">::ReadAndSet: trouble "
-                 << "initializing element " << (element_idx - 1)
+                 << "initializing element " << element_idx
                  << " of variable " << varname;
           Error(err_ss.str());
         }
-        // Each vector element initializer must be followed by a comma
-        // or the final closing parenthesis.
-        if (st.Peek() != ","  && st.Peek() != "}") {
-          ostringstream err_ss;
-          err_ss << "Initializer<vector<T>>: "
-                 << "error: expected ',' or '}' at stream position "
-                 << st.PeekTokenStart() << " but found \"" << st.Peek() << "\"";
-          Error(err_ss.str());
-        }
-        // Read comma, if present.
-        if (st.Peek() == ",") {
-          st.Next();
+      }
+      // Each vector element initializer must be followed by a comma
+      // or the final closing parenthesis.
+      if (st.Peek() != ","  && st.Peek() != "}") {
+        ostringstream err_ss;
+        err_ss << "Initializer<vector<T>>: "
+               << "error: expected ',' or '}' at stream position "
+               << st.PeekTokenStart() << " but found \"" << st.Peek() << "\"";
+        Error(err_ss.str());
+      }
+      // Read comma, if present.
+      if (st.Peek() == ",") {
+        st.Next();
+      }
+    }
+    // Consume close brace.
+    st.Next();
+  }
+
+ private:
+  // Adds views to the values exported at and after index first.
+  void ExportViews(vector<ExportedValue> *values, size_t first,
+                   std::false_type) const {
+    for (size_t i = first; i < values->size(); ++i) {
+      ExportedValue &exported = (*values)[i];
+      ArrayView<T> view;
+      GetView(exported.name, &view);
+      exported.view_type = &typeid(ArrayView<T>);
+      exported.view = std::make_shared<const ArrayView<T> >(std::move(view));
+    }
+  }
+
+  void ExportViews(vector<ExportedValue> *, size_t, std::true_type) const { }
+
+  // Whether the snapshot encoding of a vector is its elements, as it
+  // is for vectors of the types that can be loaded.
+  typedef std::integral_constant<bool, LoadableElement<T>::kSupported>
+      InPlace;
+
+  // Appends the snapshot encoding of the specified vector.
+  void AppendEncoding(const vector<T> &values, string *bytes,
+                      std::true_type) const {
+    bytes->append(reinterpret_cast<const char *>(values.data()),
+                  values.size() * sizeof(T));
+  }
+
+  void AppendEncoding(const vector<T> &values, string *bytes,
+                      std::false_type) const {
+    BytesSnapshotCodec<uint64_t>::Append(values.size(), bytes);
+    for (typename vector<T>::const_iterator it = values.begin();
+         it != values.end(); ++it) {
+      SnapshotCodec<T>::Append(*it, bytes);
+    }
+  }
+
+  // Sets the specified variable to the vector with the specified
+  // snapshot encoding, returning whether it is well formed.
+  bool Decode(const string &varname, const char *data, size_t size,
+              const shared_ptr<const FileBuffer> &buffer, std::true_type) {
+    if (size % sizeof(T) != 0) {
+      return false;
+    }
+    // The elements are used in place, as those of a loaded array are,
+    // if they are aligned (as they are in a mapped snapshot), and
+    // otherwise copied to aligned storage.
+    LoadedArray loaded;
+    if (reinterpret_cast<uintptr_t>(data) % kArrayAlignment == 0) {
+      loaded.view = ArrayView<T>(
+          shared_ptr<const T>(buffer, reinterpret_cast<const T *>(data)),
+          size / sizeof(T));
+    } else {
+      shared_ptr<char> bytes = NewAlignedArray(size);
+      memcpy(bytes.get(), data, size);
+      loaded.view = ArrayView<T>(
+          shared_ptr<const T>(bytes, reinterpret_cast<const T *>(bytes.get())),
+          size / sizeof(T));
+    }
+    Base::Erase(varname);
+    loaded_[varname] = std::move(loaded);
+    return true;
+  }
+
+  bool Decode(const string &varname, const char *data, size_t size,
+              const shared_ptr<const FileBuffer> &, std::false_type) {
+    const char *end = data + size;
+    uint64_t num_values = 0;
+    if (!BytesSnapshotCodec<uint64_t>::Read(&data, end, &num_values)) {
+      return false;
+    }
+    vector<T> value;
+    for (uint64_t i = 0; i < num_values; ++i) {
+      T element;
+      if (!SnapshotCodec<T>::Read(&data, end, &element)) {
+        return false;
+      }
+      value.push_back(std::move(element));
+    }
+    if (data != end) {
+      return false;
+    }
+    loaded_.erase(varname);
+    this->Set(varname, std::move(value));
+    return true;
+  }
+
+  /// The value of a variable initialized by a <tt>load(...)</tt> literal.
+  struct LoadedArray {
+    LoadedArray() = default;
+
+    /// Copies the specified array, whose vector copy may be concurrently
+    /// published by a reader of it.
+    LoadedArray(const LoadedArray &other) :
+        view(other.view), filename(other.filename),
+        copy(std::atomic_load(&other.copy)) { }
+
+    LoadedArray &operator=(const LoadedArray &other) {
+      view = other.view;
+      filename = other.filename;
+      copy = std::atomic_load(&other.copy);
+      return *this;
+    }
+
+    /// Returns the values of the array as a vector, copying them on first
+    /// use.  This may be invoked concurrently, as it is by the forks of an
+    /// \link Interpreter\endlink sharing this array.
+    const vector<T> *values() const {
+      shared_ptr<const vector<T> > values = std::atomic_load(&copy);
+      if (values == nullptr) {
+        values = std::make_shared<const vector<T> >(view.ToVector());
+        shared_ptr<const vector<T> > expected;
+        if (!std::atomic_compare_exchange_strong(&copy, &expected, values)) {
+          values = expected;
         }
       }
-      // Consume close brace.
-      st.Next();
+      return values.get();
+    }
 
+    ArrayView<T> view;
+    string filename;
+    mutable shared_ptr<const vector<T> > copy;
+  };
 
-      // Finally, set the newly-constructed value.
-      this->Set(varname, value);
+  /// Reads a <tt>load(...)</tt> literal, returning a view of the array
+  /// held by the named file.
+  ///
+  /// \param      varname  the name of the variable being initialized, used
+  ///                      only for error messages
+  /// \param      st       the stream tokenizer
+  /// \param[out] filename the name of the file, as given by the literal
+  ArrayView<T> ReadLoad(const string &varname, StreamTokenizer &st,
+                        string *filename) {
+    // Consume "load".
+    st.Next();
+    if (st.Peek() != "(") {
+      ostringstream err_ss;
+      err_ss << "VarMap<" << Base::Name() << ">: error: expected '(' "
+             << "after load at stream position " << st.PeekTokenStart()
+             << " but found \"" << st.Peek() << "\"";
+      Error(err_ss.str());
+    }
+    st.Next();
+    if (st.PeekTokenType() != StreamTokenizer::STRING) {
+      ostringstream err_ss;
+      err_ss << "VarMap<" << Base::Name() << ">: error: expected string "
+             << "literal naming a file at stream position "
+             << st.PeekTokenStart() << " but found \"" << st.Peek() << "\"";
+      Error(err_ss.str());
+    }
+    *filename = st.Next();
+    if (st.Peek() != ")") {
+      ostringstream err_ss;
+      err_ss << "VarMap<" << Base::Name() << ">: error: expected ')' "
+             << "at stream position " << st.PeekTokenStart()
+             << " but found \"" << st.Peek() << "\"";
+      Error(err_ss.str());
+    }
+    st.Next();
+    if (!LoadableElement<T>::kSupported) {
+      ostringstream err_ss;
+      err_ss << "VarMap<" << Base::Name() << ">: error: cannot load "
+             << "variable " << varname << " of type " << Base::Name()
+             << " from a file; only int[], int64[], float[] and double[] "
+             << "can be loaded";
+      Error(err_ss.str());
+    }
+    shared_ptr<const FileBuffer> buffer = Base::env()->LoadFile(*filename);
+    if (buffer->size() % sizeof(T) != 0) {
+      ostringstream err_ss;
+      err_ss << "VarMap<" << Base::Name() << ">: error: size of file \""
+             << *filename << "\" (" << buffer->size() << " bytes) for "
+             << "variable " << varname << " is not a multiple of "
+             << sizeof(T);
+      Error(err_ss.str());
     }
+    size_t size = buffer->size() / sizeof(T);
+    const char *data = buffer->data();
+    const uint16_t probe = 1;
+    bool little_endian = *reinterpret_cast<const char *>(&probe) == 1;
+    if (little_endian &&
+        reinterpret_cast<uintptr_t>(data) % alignof(T) == 0) {
+      // The values are used in place, sharing ownership of the buffer.
+      return ArrayView<T>(
+          shared_ptr<const T>(buffer, reinterpret_cast<const T *>(data)),
+          size);
+    }
+    // Otherwise, the values must be copied to aligned storage, and put
+    // into host byte order.
+    shared_ptr<char> bytes = NewAlignedArray(buffer->size());
+    memcpy(bytes.get(), data, buffer->size());
+    if (!little_endian) {
+      for (size_t i = 0; i < buffer->size(); i += sizeof(T)) {
+        std::reverse(bytes.get() + i, bytes.get() + i + sizeof(T));
+      }
+    }
+    return ArrayView<T>(
+        shared_ptr<const T>(bytes, reinterpret_cast<const T *>(bytes.get())),
+        size);
   }
- private:
+
+  /// Checks if the next token is a variable initialized by a
+  /// <tt>load(...)</tt> literal of the type of the variables in this
+  /// VarMap, and, if so, consumes it and sets the specified variable to
+  /// share its value.
+  bool ReadAndSetFromLoadedVariable(const string &varname,
+                                    StreamTokenizer &st) {
+    if (st.PeekTokenType() != StreamTokenizer::IDENTIFIER) {
+      return false;
+    }
+    VarMap<vector<T> > *typed_var_map =
+        VarMapCast<VarMap<vector<T> > >(Base::env()->GetVarMap(st.Peek()));
+    if (typed_var_map == nullptr) {
+      return false;
+    }
+    typename unordered_map<string, LoadedArray>::const_iterator it =
+        typed_var_map->loaded_.find(st.Peek());
+    if (it == typed_var_map->loaded_.end()) {
+      return false;
+    }
+    LoadedArray loaded = it->second;
+    st.Next();
+    Base::Erase(varname);
+    loaded_[varname] = std::move(loaded);
+    return true;
+  }
+
   string element_typename_;
+
+  // The variables initialized by load(...) literals, or aliases of them.
+  unordered_map<string, LoadedArray> loaded_;
 };
 
 }  // namespace infact
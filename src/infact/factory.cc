@@ -33,14 +33,538 @@
 /// Implementation of a generic dynamic object factory.
 /// \author dbikel@google.com (Dan Bikel)
 
+#include <mutex>
+
 #include "factory.h"
 
 namespace infact {
 
-int
-FactoryContainer::initialized_ = 0;
+namespace {
+
+/// Returns the mutex serializing all changes to all registries and to
+/// the FactoryContainer.  It is constructed on first use, since it may be
+/// needed by static initializers.
+std::mutex &RegistryMutex() {
+  static std::mutex *mutex = new std::mutex();
+  return *mutex;
+}
+
+/// The generation of the registered types, incremented by every change
+/// to any registry or to the FactoryContainer, while holding the mutex
+/// returned by RegistryMutex.
+std::atomic<uint64_t> registry_generation(0);
+
+/// Appends the specified field to the specified key, prefixed by its
+/// size so that no two sequences of fields yield the same key.
+void AppendField(const string &field, string *key) {
+  key->append(std::to_string(field.size()));
+  key->push_back(':');
+  key->append(field);
+}
+
+}  // namespace
+
+const void *
+Registry::Find(const string &name) const {
+  const Table *table = table_.load(std::memory_order_acquire);
+  if (table == nullptr) {
+    return nullptr;
+  }
+  size_t hash = std::hash<string>()(name);
+  for (size_t i = hash & table->mask; ; i = (i + 1) & table->mask) {
+    const Entry *entry = table->slots[i].load(std::memory_order_acquire);
+    if (entry == nullptr) {
+      return nullptr;
+    }
+    if (entry->hash == hash && entry->name == name) {
+      return entry->value;
+    }
+  }
+}
+
+const void *
+Registry::Insert(const string &name, const void *value, bool *first) {
+  std::lock_guard<std::mutex> lock(RegistryMutex());
+  if (first != nullptr) {
+    *first = size_.load(std::memory_order_relaxed) == 0;
+  }
+  const void *existing = Find(name);
+  if (existing != nullptr) {
+    return existing;
+  }
+  Entry *entry = new Entry();
+  entry->name = name;
+  entry->hash = std::hash<string>()(name);
+  entry->value = value;
+  entry->next = entries_;
+  entries_ = entry;
+
+  size_t size = size_.load(std::memory_order_relaxed) + 1;
+  const Table *table = table_.load(std::memory_order_relaxed);
+  if (table == nullptr || 2 * size > table->mask + 1) {
+    // Publish a larger copy of the table; readers still using the old
+    // one simply do not see the new entry.
+    size_t num_slots = table == nullptr ? 16 : 2 * (table->mask + 1);
+    Table *larger = new Table();
+    larger->mask = num_slots - 1;
+    larger->slots = new std::atomic<const Entry *>[num_slots];
+    for (size_t i = 0; i < num_slots; ++i) {
+      larger->slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+    larger->previous = table;
+    for (const Entry *e = entry; e != nullptr; e = e->next) {
+      Add(larger, e);
+    }
+    table_.store(larger, std::memory_order_release);
+  } else {
+    Add(table, entry);
+  }
+  size_.store(size, std::memory_order_release);
+  registry_generation.fetch_add(1, std::memory_order_release);
+  return value;
+}
+
+void
+Registry::Add(const Table *table, const Entry *entry) {
+  size_t i = entry->hash & table->mask;
+  while (table->slots[i].load(std::memory_order_relaxed) != nullptr) {
+    i = (i + 1) & table->mask;
+  }
+  table->slots[i].store(entry, std::memory_order_release);
+}
+
+void
+Registry::Clear() {
+  std::lock_guard<std::mutex> lock(RegistryMutex());
+  const Table *table = table_.load(std::memory_order_relaxed);
+  while (table != nullptr) {
+    const Table *previous = table->previous;
+    delete[] table->slots;
+    delete table;
+    table = previous;
+  }
+  while (entries_ != nullptr) {
+    const Entry *next = entries_->next;
+    delete entries_;
+    entries_ = next;
+  }
+  table_.store(nullptr, std::memory_order_release);
+  size_.store(0, std::memory_order_release);
+  registry_generation.fetch_add(1, std::memory_order_release);
+}
+
+std::atomic<const FactoryContainer::Node *>
+FactoryContainer::head_(nullptr);
+
+FactoryContainer::Node *
+FactoryContainer::tail_ = nullptr;
+
+void
+FactoryContainer::Add(FactoryBase *factory) {
+  Node *node = new Node();
+  node->factory = factory;
+  node->next.store(nullptr, std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(RegistryMutex());
+  if (tail_ == nullptr) {
+    head_.store(node, std::memory_order_release);
+  } else {
+    tail_->next.store(node, std::memory_order_release);
+  }
+  tail_ = node;
+  registry_generation.fetch_add(1, std::memory_order_release);
+}
+
+void
+FactoryContainer::Clear() {
+  const Node *node = head_.load(std::memory_order_acquire);
+  {
+    std::lock_guard<std::mutex> lock(RegistryMutex());
+    head_.store(nullptr, std::memory_order_release);
+    tail_ = nullptr;
+    registry_generation.fetch_add(1, std::memory_order_release);
+  }
+  while (node != nullptr) {
+    const Node *next = node->next.load(std::memory_order_acquire);
+    // Each factory clears its registry, which takes the lock itself.
+    node->factory->Clear();
+    delete node->factory;
+    delete node;
+    node = next;
+  }
+}
+
+uint64_t
+FactoryContainer::Generation() {
+  return registry_generation.load(std::memory_order_acquire);
+}
+
+const size_t MemoTable::kMinPurgeSize;
+
+size_t
+MemoTable::ReadKey(StreamTokenizer &st, Environment *env, string *key,
+                   vector<shared_ptr<const void> > *references) {
+  if (st.streaming()) {
+    // The tokens of the spec might not all be put back.
+    return 0;
+  }
+  string fingerprints;
+  size_t num_tokens = 0;
+  int depth = 1;
+  while (depth > 0 && st.HasNext()) {
+    StreamTokenizer::TokenType type = st.PeekTokenType();
+    string tok = st.Next();
+    ++num_tokens;
+    if (type == StreamTokenizer::RESERVED_CHAR) {
+      if (tok == "(") {
+        ++depth;
+      } else if (tok == ")") {
+        --depth;
+      }
+    }
+    key->push_back(static_cast<char>('0' + type));
+    AppendField(tok, key);
+
+    bool is_name = st.PeekTokenType() == StreamTokenizer::RESERVED_CHAR &&
+                   (st.Peek() == "(" || st.Peek() == "=");
+    bool is_reference = (type == StreamTokenizer::IDENTIFIER && !is_name) ||
+                        type == StreamTokenizer::STRING;
+    VarMapBase *var_map = is_reference && env != nullptr ?
+        env->GetVarMap(tok) : nullptr;
+    if (var_map == nullptr) {
+      continue;
+    }
+    string fingerprint;
+    shared_ptr<const void> storage;
+    if (!var_map->Fingerprint(tok, &fingerprint, &storage)) {
+      st.Rewind(num_tokens);
+      return 0;
+    }
+    AppendField(std::to_string(num_tokens), &fingerprints);
+    AppendField(var_map->Name(), &fingerprints);
+    AppendField(fingerprint, &fingerprints);
+    if (storage != nullptr) {
+      references->push_back(std::move(storage));
+    }
+  }
+  if (depth > 0) {
+    // Leave the error in the spec to be reported as it is parsed.
+    st.Rewind(num_tokens);
+    return 0;
+  }
+  key->push_back(';');
+  key->append(fingerprints);
+  return num_tokens;
+}
+
+shared_ptr<void>
+MemoTable::Find(const string &key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  unordered_map<string, Entry>::const_iterator it = entries_.find(key);
+  return it == entries_.end() ? shared_ptr<void>() : it->second.object.lock();
+}
+
+shared_ptr<void>
+MemoTable::Insert(const string &key, shared_ptr<void> object,
+                  vector<shared_ptr<const void> > references) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry &entry = entries_[key];
+  shared_ptr<void> memoized = entry.object.lock();
+  if (memoized != nullptr) {
+    return memoized;
+  }
+  entry.object = object;
+  entry.references = std::move(references);
+  if (entries_.size() >= purge_size_) {
+    for (unordered_map<string, Entry>::iterator it = entries_.begin();
+         it != entries_.end(); ) {
+      if (it->second.object.expired()) {
+        it = entries_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    purge_size_ = std::max(kMinPurgeSize, 2 * entries_.size());
+  }
+  return object;
+}
+
+void
+MemoTable::Clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  purge_size_ = kMinPurgeSize;
+}
+
+size_t
+MemoTable::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+void
+InitializerSchema::Build(const void *prototype, const Initializers &other,
+                         const void *other_prototype, size_t instance_size) {
+  const char *start = static_cast<const char *>(prototype);
+  const char *other_start = static_cast<const char *>(other_prototype);
+  usable_ = instance_size > 0;
+  size_t num_other = 0;
+  for (Initializers::const_iterator it = other.begin(); it != other.end();
+       ++it) {
+    ++num_other;
+  }
+  for (Initializers::const_iterator it = initializers_.begin();
+       it != initializers_.end();
+       ++it) {
+    Member member;
+    member.name = it->first;
+    member.initializer = it->second;
+    member.offset = -1;
+    const char *address =
+        static_cast<const char *>(it->second->MemberAddress());
+    Initializers::const_iterator other_it = other.find(it->first);
+    if (other_it == other.end() || !it->second->SupportsInitAt() ||
+        !other_it->second->SupportsInitAt()) {
+      usable_ = false;
+    } else if (address != nullptr) {
+      // The member must lie within the object, at the same offset in both
+      // prototypes.
+      const char *other_address =
+          static_cast<const char *>(other_it->second->MemberAddress());
+      member.offset = address - start;
+      if (address < start || address >= start + instance_size ||
+          other_address != other_start + member.offset) {
+        usable_ = false;
+      }
+    } else if (other_it->second->MemberAddress() != nullptr) {
+      usable_ = false;
+    }
+    members_.push_back(member);
+  }
+  if (members_.size() != num_other) {
+    usable_ = false;
+  }
+  std::sort(members_.begin(), members_.end(), NameLess());
+}
+
+size_t
+InitializerSchema::Find(const string &name) const {
+  vector<Member>::const_iterator it =
+      std::lower_bound(members_.begin(), members_.end(), name, NameLess());
+  return it != members_.end() && it->name == name ?
+      it - members_.begin() : members_.size();
+}
+
+const string &
+CompiledSpecBase::Tok(size_t idx) const {
+  static const string empty;
+  return idx < tokens_.size() ? tokens_[idx].tok : empty;
+}
+
+size_t
+CompiledSpecBase::Start(size_t idx) const {
+  return idx < tokens_.size() ? tokens_[idx].start : source_.size();
+}
+
+void
+CompiledSpecBase::Parse(const string &spec, const string &base_name) {
+  base_name_ = base_name;
+  source_ = spec;
+  StreamTokenizer st(source_.data(), source_.size());
+  while (st.HasNext()) {
+    tokens_.push_back(st.PeekToken());
+    st.Next();
+  }
+
+  StreamTokenizer::TokenType token_type =
+      tokens_.empty() ? StreamTokenizer::EOF_TYPE : tokens_[0].type;
+  size_t idx = 0;
+  if (token_type == StreamTokenizer::RESERVED_WORD &&
+      (Tok(0) == "nullptr" || Tok(0) == "NULL")) {
+    null_ = true;
+    ++idx;
+  } else {
+    if (token_type != StreamTokenizer::IDENTIFIER) {
+      ostringstream err_ss;
+      err_ss << ErrorPrefix()
+             << "error: expected type specifier token but found "
+             << StreamTokenizer::TypeName(token_type);
+      Error(err_ss.str());
+    }
+    type_ = Tok(idx++);
+    if (Tok(idx) != "(") {
+      ostringstream err_ss;
+      err_ss << ErrorPrefix() << "error: expected '(' at stream position "
+             << Start(idx) << " but found \"" << Tok(idx) << "\"";
+      Error(err_ss.str());
+    }
+    ++idx;
+
+    // Parse initializer list, finding the extent of each member's
+    // initializer by matching parentheses and braces.
+    while (idx < tokens_.size() && Tok(idx) != ")") {
+      if (tokens_[idx].type != StreamTokenizer::IDENTIFIER) {
+        ostringstream err_ss;
+        err_ss << ErrorPrefix() << "error: expected token of type IDENTIFIER "
+               << "at stream position " << Start(idx) << " but found "
+               << StreamTokenizer::TypeName(tokens_[idx].type) << ": \""
+               << Tok(idx) << "\"";
+        Error(err_ss.str());
+      }
+      Member member;
+      member.slot = 0;
+      member.name = Tok(idx);
+      member.name_start = Start(idx);
+      ++idx;
+      bool saw_open_paren = Tok(idx) == "(";
+      if (!saw_open_paren && Tok(idx) != "=") {
+        ostringstream err_ss;
+        err_ss << ErrorPrefix()
+               << "error initializing member " << member.name << ": "
+               << "expected '(' or '=' at stream position "
+               << Start(idx) << " but found \"" << Tok(idx) << "\"";
+        Error(err_ss.str());
+      }
+      size_t member_init_start = Start(idx);
+      ++idx;
+      member.begin = idx;
+      int depth = 0;
+      for (; idx < tokens_.size(); ++idx) {
+        if (tokens_[idx].type != StreamTokenizer::RESERVED_CHAR) {
+          continue;
+        }
+        const string &tok = Tok(idx);
+        if (tok == "(" || tok == "{") {
+          ++depth;
+        } else if (tok == ")" || tok == "}") {
+          if (depth == 0) {
+            break;
+          }
+          --depth;
+        } else if (tok == "," && depth == 0 && !saw_open_paren) {
+          break;
+        }
+      }
+      member.end = idx;
+      if (saw_open_paren) {
+        if (Tok(idx) != ")") {
+          ostringstream err_ss;
+          err_ss << ErrorPrefix()
+                 << "error initializing member " << member.name << ": "
+                 << "saw '(' at stream position " << member_init_start
+                 << "; expected ')' at stream position "
+                 << Start(idx) << " but found \"" << Tok(idx) << "\"";
+          Error(err_ss.str());
+        }
+        ++idx;
+      }
+      if (Tok(idx) != "," && Tok(idx) != ")") {
+        ostringstream err_ss;
+        err_ss << ErrorPrefix()
+               << "error initializing member " << member.name << ": "
+               << "expected ',' or ')' at stream position "
+               << Start(idx) << " but found \"" << Tok(idx) << "\"";
+        Error(err_ss.str());
+      }
+      if (Tok(idx) == ",") {
+        ++idx;
+      }
+      members_.push_back(member);
+    }
+    if (Tok(idx) != ")") {
+      ostringstream err_ss;
+      err_ss << ErrorPrefix() << "error at initializer list end: "
+             << "expected ')' at stream position "
+             << Start(idx) << " but found \"" << Tok(idx) << "\"";
+      Error(err_ss.str());
+    }
+    ++idx;
+  }
+  if (idx < tokens_.size()) {
+    ostringstream err_ss;
+    err_ss << ErrorPrefix() << "error: unexpected token \"" << Tok(idx)
+           << "\" at stream position " << Start(idx)
+           << " after end of spec";
+    Error(err_ss.str());
+  }
+  init_str_ = source_.substr(tokens_[0].start,
+                             tokens_[idx - 1].curr_pos - tokens_[0].start);
+}
+
+void
+CompiledSpecBase::Validate(const Initializers &initializers) const {
+  for (vector<Member>::const_iterator it = members_.begin();
+       it != members_.end();
+       ++it) {
+    if (initializers.find(it->name) == initializers.end()) {
+      ostringstream err_ss;
+      err_ss << ErrorPrefix()
+             << "error: unknown member name \"" << it->name
+             << "\" in initializer list for type " << type_ << " at stream "
+             << "position " << it->name_start;
+      Error(err_ss.str());
+    }
+  }
+  for (Initializers::const_iterator init_it = initializers.begin();
+       init_it != initializers.end();
+       ++init_it) {
+    if (!init_it->second->Required()) {
+      continue;
+    }
+    bool found = false;
+    for (vector<Member>::const_iterator it = members_.begin();
+         !found && it != members_.end();
+         ++it) {
+      found = it->name == init_it->first;
+    }
+    if (!found) {
+      ostringstream err_ss;
+      err_ss << ErrorPrefix()
+             << "error: initialization for member with name \""
+             << init_it->first << "\" required but not found";
+      Error(err_ss.str());
+    }
+  }
+}
+
+void
+CompiledSpecBase::InitMember(const Member &member,
+                             MemberInitializer *initializer,
+                             Environment *env) const {
+  StreamTokenizer st(source_.data(), source_.size(),
+                     tokens_.data() + member.begin, member.end - member.begin);
+  initializer->Init(st, env);
+  CheckConsumed(member, st);
+}
+
+void
+CompiledSpecBase::InitMember(const Member &member,
+                             const InitializerSchema &schema,
+                             void *instance, Environment *env) const {
+  StreamTokenizer st(source_.data(), source_.size(),
+                     tokens_.data() + member.begin, member.end - member.begin);
+  schema.Init(member.slot, st, env, instance);
+  CheckConsumed(member, st);
+}
+
+void
+CompiledSpecBase::ResolveSlots(const InitializerSchema &schema) {
+  for (vector<Member>::iterator it = members_.begin(); it != members_.end();
+       ++it) {
+    it->slot = schema.Find(it->name);
+  }
+}
 
-vector<FactoryBase *> *
-FactoryContainer::factories_ = 0;
+void
+CompiledSpecBase::CheckConsumed(const Member &member,
+                                const StreamTokenizer &st) const {
+  if (st.HasNext()) {
+    ostringstream err_ss;
+    err_ss << ErrorPrefix()
+           << "error initializing member " << member.name << ": "
+           << "expected ',' or ')' at stream position "
+           << st.PeekTokenStart() << " but found \"" << st.Peek() << "\"";
+    Error(err_ss.str());
+  }
+}
 
 }  // namespace infact
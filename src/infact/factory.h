@@ -36,9 +36,14 @@
 #ifndef INFACT_FACTORY_H_
 #define INFACT_FACTORY_H_
 
+#include <atomic>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -131,6 +136,7 @@ using std::endl;
 using std::ostream;
 using std::ostringstream;
 using std::shared_ptr;
+using std::unique_ptr;
 using std::unordered_map;
 using std::unordered_set;
 using std::vector;
@@ -178,6 +184,26 @@ class TypeName<int> {
   }
 };
 
+/// A specialization so that an object of type <tt>int64_t</tt>
+/// converts to <tt>"int64"</tt>.
+template <>
+class TypeName<int64_t> {
+ public:
+  string ToString() {
+    return "int64";
+  }
+};
+
+/// A specialization so that an object of type <tt>float</tt>
+/// converts to <tt>"float"</tt>.
+template <>
+class TypeName<float> {
+ public:
+  string ToString() {
+    return "float";
+  }
+};
+
 /// A specialization so that an object of type <tt>double</tt>
 /// converts to <tt>"double"</tt>.
 template <>
@@ -261,6 +287,39 @@ class MemberInitializer {
   ///            initialization
   virtual void Init(StreamTokenizer &st, Environment *env) = 0;
 
+  /// Initializes the specified member, which must be of the same type as
+  /// the one this instance initializes, based on the following tokens
+  /// obtained from the specified \link StreamTokenizer\endlink, without
+  /// modifying this instance.  This is how a single member initializer
+  /// can initialize the corresponding member of many objects.
+  ///
+  /// \param st     the stream tokenizer whose next tokens contain the
+  ///               information to initialize the member
+  /// \param env    the current environment, to be modified by the
+  ///               member&rsquo;s initialization
+  /// \param member the member to initialize, or nullptr if only the
+  ///               environment should be modified
+  /// \return whether the member was successfully initialized; the
+  ///         default implementation initializes nothing and returns false
+  virtual bool InitAt(StreamTokenizer &st, Environment *env,
+                      void *member) const {
+    return false;
+  }
+
+  /// Returns the address of the member initialized by this instance, or
+  /// nullptr if this instance only modifies the environment.  The default
+  /// implementation returns nullptr.
+  virtual const void *MemberAddress() const { return nullptr; }
+
+  /// Returns whether this instance implements \link InitAt\endlink and
+  /// \link MemberAddress\endlink, and so may be used by an \link
+  /// InitializerSchema\endlink.  The default implementation returns
+  /// false, so that the members of a type registering any initializer
+  /// that does not are initialized as they always were: by invoking
+  /// <tt>RegisterInitializers</tt> on each constructed instance and then
+  /// \link Init\endlink on its initializers.
+  virtual bool SupportsInitAt() const { return false; }
+
   /// Returns the number of times this member initializer&rsquo;s
   /// \link Init \endlink method has been invoked.
   virtual int Initialized() const { return initialized_; }
@@ -304,28 +363,45 @@ class TypedMemberInitializer : public MemberInitializer {
   /// \param required whether this member is required to be initialized in a
   ///                 spec string
   TypedMemberInitializer(const string &name, T *member, bool required = false) :
-      MemberInitializer(name, required), member_(member) { }
+      MemberInitializer(name, required), member_(member),
+      type_name_(TypeName<T>().ToString()) { }
   virtual ~TypedMemberInitializer() { }
   virtual void Init(StreamTokenizer &st, Environment *env) {
-    env->ReadAndSet(Name(), st, TypeName<T>().ToString());
-    if (member_ != nullptr) {
-      VarMapBase *var_map = env->GetVarMap(Name());
-      VarMap<T> *typed_var_map = dynamic_cast<VarMap<T> *>(var_map);
-      if (typed_var_map != nullptr) {
-        bool success = typed_var_map->Get(Name(), member_);
-        if (success) {
-          ++initialized_;
-        }
-      }
-    } else {
+    if (InitAt(st, env, member_)) {
+      ++initialized_;
+    }
+  }
+  virtual bool InitAt(StreamTokenizer &st, Environment *env,
+                      void *member) const {
+    if (member == nullptr) {
       // When the goal is simply to modify the environment, we say that this
       // "non-member" has been successfully initialized when we've modified
       // the environment.
-      ++initialized_;
+      env->ReadAndSet(name_, st, type_name_);
+      return true;
+    }
+    // Read the value directly into the member, binding the member name in
+    // the environment only in case it is looked up later.
+    VarMapBase *var_map = env->GetVarMapForValue(name_, st, type_name_);
+    VarMap<T> *typed_var_map = VarMapCast<VarMap<T> >(var_map);
+    if (typed_var_map == nullptr) {
+      env->ReadAndSet(name_, st, type_name_);
+      return false;
     }
+    T *typed_member = static_cast<T *>(member);
+    if (!typed_var_map->ReadInto(name_, st, typed_member)) {
+      return false;
+    }
+    env->BindDeferred(name_, var_map, typed_member);
+    return true;
   }
+  virtual const void *MemberAddress() const { return member_; }
+  virtual bool SupportsInitAt() const { return true; }
  protected:
   T *member_;
+  /// The type name of the member, as passed to
+  /// \link Environment::ReadAndSet\endlink.
+  const string type_name_;
 };
 
 /// \class Initializers
@@ -423,6 +499,112 @@ class Initializers {
   unordered_map<string, MemberInitializer *> initializers_;
 };
 
+/// \class InitializerSchema
+///
+/// The member initializers of a concrete Factory-constructible type,
+/// computed once from a prototype instance and then used to initialize
+/// the members of any number of instances of that type, at the offsets
+/// from the start of each instance at which the prototype registered
+/// them.  This avoids the cost of invoking <tt>RegisterInitializers</tt>
+/// and allocating a set of member initializers for every constructed
+/// object.  A schema is only usable if every registered member lies
+/// within the object itself at the same offset in every instance, and
+/// every member initializer supports \link MemberInitializer::InitAt
+/// \endlink, which is always the case for members registered with the
+/// <tt>INFACT_ADD_</tt> family of macros.
+class InitializerSchema {
+ public:
+  /// A member of a schema.
+  struct Member {
+    /// The name of the member.
+    string name;
+    /// The initializer of this member that was registered by the
+    /// prototype instance, used only via \link MemberInitializer::InitAt
+    /// \endlink.
+    const MemberInitializer *initializer;
+    /// The offset of the member from the start of an instance, or -1 if
+    /// the member is a temporary.
+    ptrdiff_t offset;
+  };
+
+  /// Constructs an empty schema, to be filled in via \link initializers
+  /// \endlink and then \link Build\endlink.
+  InitializerSchema() { }
+
+  /// Returns the initializers with which a prototype instance should
+  /// register its members prior to \link Build \endlink being invoked.
+  Initializers &initializers() { return initializers_; }
+
+  /// Returns the initializers registered by the prototype instance.
+  const Initializers &initializers() const { return initializers_; }
+
+  /// Computes this schema from the members registered in \link
+  /// initializers \endlink by one prototype instance, checking that a
+  /// second prototype of the same type registered the same members at
+  /// the same offsets.
+  ///
+  /// \param prototype       the instance whose members were registered in
+  ///                        \link initializers\endlink, which need not
+  ///                        outlive this method
+  /// \param other           the initializers of a second prototype instance
+  /// \param other_prototype the second prototype instance
+  /// \param instance_size   the size of instances of the concrete type, or 0
+  ///                        if unknown
+  void Build(const void *prototype, const Initializers &other,
+             const void *other_prototype, size_t instance_size);
+
+  /// Returns whether this schema may be used to initialize instances.
+  bool usable() const { return usable_; }
+
+  /// Returns the number of members of this schema.
+  size_t size() const { return members_.size(); }
+
+  /// Returns the member with the specified index.
+  const Member &member(size_t idx) const { return members_[idx]; }
+
+  /// Returns the index of the member with the specified name, or \link
+  /// size \endlink if there is no such member.
+  size_t Find(const string &name) const;
+
+  /// Returns whether the member with the specified index is required.
+  bool Required(size_t idx) const {
+    return members_[idx].initializer->Required();
+  }
+
+  /// Initializes the specified member of the specified instance based on
+  /// the following tokens obtained from the specified stream tokenizer.
+  ///
+  /// \param idx      the index of the member to initialize
+  /// \param st       the stream tokenizer whose next tokens contain the
+  ///                 information to initialize the member
+  /// \param env      the current environment
+  /// \param instance the start of the instance whose member is to be
+  ///                 initialized
+  /// \return whether the member was successfully initialized
+  bool Init(size_t idx, StreamTokenizer &st, Environment *env,
+            void *instance) const {
+    const Member &member = members_[idx];
+    void *address = member.offset < 0 ?
+        nullptr : static_cast<char *>(instance) + member.offset;
+    return member.initializer->InitAt(st, env, address);
+  }
+
+ private:
+  struct NameLess {
+    bool operator()(const Member &a, const Member &b) const {
+      return a.name < b.name;
+    }
+    bool operator()(const Member &member, const string &name) const {
+      return member.name < name;
+    }
+  };
+
+  Initializers initializers_;
+  // The members of this schema, sorted by name.
+  vector<Member> members_;
+  bool usable_ = false;
+};
+
 /// An interface for all \link Factory \endlink instances, specifying a few
 /// pure virtual methods.
 class FactoryBase {
@@ -449,62 +631,151 @@ class FactoryBase {
   virtual VarMapBase *CreateVectorVarMap(Environment *env) const = 0;
 };
 
-/// A class to hold all \link Factory \endlink instances that have been created.
-class FactoryContainer {
+/// A table from names to values that may be read by many threads
+/// without locks while names are added by others, as when plugin types
+/// are registered from shared objects loaded at run time.  Lookups take
+/// constant time and never contend: the table is open-addressed, with
+/// each slot holding an atomic pointer to an immutable entry.  Writers
+/// are serialized by a single process-wide mutex; when a table becomes
+/// half full, a writer publishes a copy twice its size, and the
+/// superseded tables are retained (since readers may still be using
+/// them) until \link Clear\endlink, which keeps the memory of all
+/// tables within twice that of the last.
+///
+/// A registry has a constant-initialized state, and so may be used by
+/// the static initializers of any translation unit.
+class Registry {
  public:
-  typedef vector<FactoryBase *>::iterator iterator;
+  constexpr Registry() : table_(nullptr), entries_(nullptr), size_(0) { }
 
-  /// Adds the specified factory to this container of factories.
+  /// Returns the value for the specified name, or nullptr if there is
+  /// none.
+  const void *Find(const string &name) const;
+
+  /// Associates the specified value with the specified name, unless the
+  /// name already has a value.
   ///
-  /// \param factory the factory to add to this container
-  static void Add(FactoryBase *factory) {
-    if (!initialized_) {
-      factories_ = new vector<FactoryBase *>();
-      initialized_ = 1;
+  /// \param      name  the name
+  /// \param      value the value for the name
+  /// \param[out] first if not nullptr, set to whether the name is the
+  ///                   first added to this registry
+  /// \return the value of the name, which is \c value if the name had none
+  const void *Insert(const string &name, const void *value,
+                     bool *first = nullptr);
+
+  /// Invokes the specified function with the name and value of every
+  /// entry in this registry.
+  template <typename Function>
+  void ForEach(Function function) const {
+    const Table *table = table_.load(std::memory_order_acquire);
+    if (table == nullptr) {
+      return;
     }
-    factories_->push_back(factory);
-  }
-  /// Clears this container of factories.
-  static void Clear() {
-    if (initialized_) {
-      for (vector<FactoryBase *>::iterator it = factories_->begin();
-           it != factories_->end();
-           ++it) {
-        (*it)->Clear();
-        delete *it;
+    for (size_t i = 0; i <= table->mask; ++i) {
+      const Entry *entry = table->slots[i].load(std::memory_order_acquire);
+      if (entry != nullptr) {
+        function(entry->name, entry->value);
       }
-      delete factories_;
     }
   }
 
+  /// Returns the number of names in this registry.
+  size_t size() const { return size_.load(std::memory_order_acquire); }
+
+  /// Removes all entries from this registry.  Unlike all other methods,
+  /// this method may not be invoked while others use this registry.
+  void Clear();
+
+ private:
+  struct Entry {
+    string name;
+    size_t hash;
+    const void *value;
+    // The entry added before this one, for deleting entries.
+    const Entry *next;
+  };
+
+  struct Table {
+    // The number of slots, minus one.
+    size_t mask;
+    std::atomic<const Entry *> *slots;
+    // The table superseded by this one, if any.
+    const Table *previous;
+  };
+
+  /// Adds the specified entry to the specified table, which must have an
+  /// empty slot.
+  static void Add(const Table *table, const Entry *entry);
+
+  std::atomic<const Table *> table_;
+  const Entry *entries_;
+  std::atomic<size_t> size_;
+};
+
+/// A class to hold all \link Factory \endlink instances that have been
+/// created.  Factories may be added and iterated over concurrently.
+class FactoryContainer {
+ private:
+  struct Node {
+    FactoryBase *factory;
+    std::atomic<const Node *> next;
+  };
+
+ public:
+  /// An iterator over the factories of this container, in the order in
+  /// which they were added.
+  class iterator {
+   public:
+    explicit iterator(const Node *node) : node_(node) { }
+    FactoryBase *operator*() const { return node_->factory; }
+    iterator &operator++() {
+      node_ = node_->next.load(std::memory_order_acquire);
+      return *this;
+    }
+    bool operator==(const iterator &other) const {
+      return node_ == other.node_;
+    }
+    bool operator!=(const iterator &other) const {
+      return node_ != other.node_;
+    }
+   private:
+    const Node *node_;
+  };
+
+  /// Adds the specified factory to this container of factories.
+  ///
+  /// \param factory the factory to add to this container
+  static void Add(FactoryBase *factory);
+
+  /// Clears this container of factories.  This method may not be invoked
+  /// while other threads use any factory.
+  static void Clear();
+
+  /// Returns a number that changes whenever a type is registered with
+  /// any factory, or factories are cleared, so that tables built from
+  /// the registered types can tell when they are out of date.
+  static uint64_t Generation();
+
   // Provide two methods to iterate over the FactoryBase instances
   // held by this FactoryContainer.
   static iterator begin() {
-    if (factories_ == nullptr) {
-      cerr << "FactoryContainer::begin: error: no FactoryBase instances!"
-           << endl;
-    }
-    return factories_->begin();
-  }
-  static iterator end() {
-    if (factories_ == nullptr) {
-      cerr << "FactoryContainer::begin: error: no FactoryBase instances!"
-           << endl;
-    }
-    return factories_->end();
+    return iterator(head_.load(std::memory_order_acquire));
   }
+  static iterator end() { return iterator(nullptr); }
 
   /// Prints the base typenames for all factories along with a list of all
   /// concrete subtypes those factories can construct, in a human-readable
   /// form, to the specified output stream.
   static void Print(ostream &os) {
-    if (!initialized_) {
+    if (begin() == end()) {
       return;
     }
-    cerr << "Number of factories: " << factories_->size() << "." << endl;
-    for (vector<FactoryBase *>::iterator factory_it = factories_->begin();
-         factory_it != factories_->end();
-         ++factory_it) {
+    size_t num_factories = 0;
+    for (iterator factory_it = begin(); factory_it != end(); ++factory_it) {
+      ++num_factories;
+    }
+    cerr << "Number of factories: " << num_factories << "." << endl;
+    for (iterator factory_it = begin(); factory_it != end(); ++factory_it) {
       unordered_set<string> registered;
       (*factory_it)->CollectRegistered(registered);
       os << "Factory<" << (*factory_it)->BaseName() << "> can construct:\n";
@@ -517,8 +788,77 @@ class FactoryContainer {
     os.flush();
   }
  private:
-  static int initialized_;
-  static vector<FactoryBase *> *factories_;
+  static std::atomic<const Node *> head_;
+  static Node *tail_;
+};
+
+/// A table of the objects constructed by a \link Constructor\endlink
+/// whose construction is memoized (see \link
+/// FactoryConstructible::kMemoized\endlink), keyed by their specs and
+/// the values of the variables their specs refer to.  Objects are held
+/// weakly, so that each lives only as long as it is otherwise used.  A
+/// table may be used by many threads concurrently.
+class MemoTable {
+ public:
+  MemoTable() { }
+
+  /// Reads the remainder of a spec, whose next token follows its open
+  /// parenthesis, up to and including its matching close parenthesis,
+  /// computing the key under which an object constructed from it is
+  /// memoized.  The key consists of the tokens of the spec and, for each
+  /// token that may refer to a variable (an identifier that is not the
+  /// name of a type or member, or a string), the type and the \link
+  /// VarMapBase::Fingerprint fingerprint\endlink of the value of the
+  /// variable, if it exists.
+  ///
+  /// \param      st         the stream tokenizer from which to read the spec
+  /// \param      env        the environment in which the spec is read, or
+  ///                        <tt>nullptr</tt> if there is none
+  /// \param[out] key        the key of the spec
+  /// \param[out] references the storage of the values whose fingerprints
+  ///                        are part of the key, to be kept with any object
+  ///                        memoized under it
+  /// \return the number of tokens read, or 0 if the spec cannot be
+  ///         memoized, in which case no tokens are consumed
+  static size_t ReadKey(StreamTokenizer &st, Environment *env, string *key,
+                        vector<shared_ptr<const void> > *references);
+
+  /// Returns the live object memoized under the specified key, or
+  /// <tt>nullptr</tt> if there is none.
+  shared_ptr<void> Find(const string &key) const;
+
+  /// Memoizes the specified object under the specified key, unless
+  /// another thread has memoized a live object under it first.
+  ///
+  /// \param key        the key of the spec of the object
+  /// \param object     the object constructed from the spec
+  /// \param references the storage of the values whose fingerprints are
+  ///                   part of the key
+  /// \return the object memoized under the key
+  shared_ptr<void> Insert(const string &key, shared_ptr<void> object,
+                          vector<shared_ptr<const void> > references);
+
+  /// Removes all objects from this table.
+  void Clear();
+
+  /// Returns the number of entries of this table, including those whose
+  /// objects have expired but have not yet been removed.
+  size_t size() const;
+
+ private:
+  struct Entry {
+    std::weak_ptr<void> object;
+    // Kept so that the fingerprints in the key remain unique.
+    vector<shared_ptr<const void> > references;
+  };
+
+  // The fewest entries at which expired entries are removed.
+  static const size_t kMinPurgeSize = 64;
+
+  mutable std::mutex mutex_;
+  unordered_map<string, Entry> entries_;
+  // The number of entries at which expired entries are next removed.
+  size_t purge_size_ = kMinPurgeSize;
 };
 
 /// \class Constructor
@@ -530,8 +870,84 @@ class FactoryContainer {
 template <typename T>
 class Constructor {
  public:
-  virtual ~Constructor() { }
+  Constructor() : schema_(nullptr) { }
+  virtual ~Constructor() { delete schema_.load(); }
   virtual T *NewInstance() const = 0;
+
+  /// Returns a new instance allocated, along with its reference count,
+  /// from the specified arena.  Constructors defined by the \link
+  /// REGISTER_NAMED \endlink macro allocate the instance itself from the
+  /// arena; by default, only its reference count is.
+  ///
+  /// \param arena the arena from which to allocate the new instance
+  virtual shared_ptr<T> NewInstanceIn(const shared_ptr<Arena> &arena) const {
+    return shared_ptr<T>(NewInstance(), std::default_delete<T>(),
+                         ArenaAllocator<T>(arena));
+  }
+
+  /// Returns a new instance allocated from the arena of the specified
+  /// environment, if it has one, or else normally.
+  ///
+  /// \param env the environment in which the instance is constructed
+  shared_ptr<T> NewShared(const Environment *env) const {
+    shared_ptr<Arena> arena = env == nullptr ? nullptr : env->arena();
+    return arena == nullptr ? shared_ptr<T>(NewInstance()) :
+        NewInstanceIn(arena);
+  }
+
+  /// Returns the size of the instances constructed by this constructor,
+  /// or 0 if it is unknown, in which case no \link InitializerSchema
+  /// \endlink is used for them.
+  virtual size_t InstanceSize() const { return 0; }
+
+  /// Returns whether the construction of instances by this constructor
+  /// is memoized.
+  ///
+  /// \see FactoryConstructible::kMemoized
+  virtual bool Memoized() const { return false; }
+
+  /// Returns whether instances constructed by this constructor may have
+  /// a <tt>PostInit</tt> method that does something.  If not, their
+  /// <tt>PostInit</tt> methods are not invoked, and so their spec strings
+  /// need never be copied.
+  ///
+  /// \see OverridesPostInit
+  virtual bool HasPostInit() const { return true; }
+
+  /// Returns the table of the instances memoized by this constructor.
+  MemoTable &memo() const { return memo_; }
+
+  /// Returns the initializer schema of the instances constructed by this
+  /// constructor, computing it on first use by registering the members
+  /// of two prototype instances.  The returned schema may not be
+  /// \link InitializerSchema::usable usable\endlink.
+  const InitializerSchema *Schema() const {
+    const InitializerSchema *schema = schema_.load();
+    if (schema != nullptr) {
+      return schema;
+    }
+    InitializerSchema *new_schema = new InitializerSchema();
+    if (InstanceSize() > 0) {
+      unique_ptr<T> prototype(NewInstance());
+      unique_ptr<T> other_prototype(NewInstance());
+      prototype->RegisterInitializers(new_schema->initializers());
+      Initializers other;
+      other_prototype->RegisterInitializers(other);
+      new_schema->Build(prototype.get(), other, other_prototype.get(),
+                        InstanceSize());
+    }
+    // If another thread computed the schema first, use that one instead.
+    InitializerSchema *expected = nullptr;
+    if (!schema_.compare_exchange_strong(expected, new_schema)) {
+      delete new_schema;
+      return expected;
+    }
+    return new_schema;
+  }
+
+ private:
+  mutable std::atomic<InitializerSchema *> schema_;
+  mutable MemoTable memo_;
 };
 
 /// An interface simply to make it easier to implement \link
@@ -575,12 +991,241 @@ class FactoryConstructible {
   /// modified during construction by the \link
   /// infact::Factory::CreateOrDie Factory::CreateOrDie \endlink method.
   ///
+  /// The variables of the environment named after the members of this
+  /// object are bound to the members themselves, and their values are
+  /// only copied when first looked up; a member this method modifies
+  /// before looking up its variable is therefore seen with its modified
+  /// value.
+  ///
   /// \param env      the environment in use during construction by the
   ///                 \link infact::Factory::CreateOrDie
   ///                 Factory::CreateOrDie \endlink method
   /// \param init_str the entire string used to initialize this object
   ///                 (for example, <tt>PersonImpl(name("Fred"))</tt>)
   virtual void PostInit(const Environment *env, const string &init_str) { }
+
+  /// Whether the construction of instances of this class by the \link
+  /// infact::Factory::CreateOrDie Factory::CreateOrDie \endlink method
+  /// is memoized: if so, a spec identical to that of a live instance,
+  /// token for token and in the values of the variables it refers to,
+  /// yields that same instance instead of a new one, as when a config
+  /// repeats a spec in many places.  A class opts in by declaring
+  /// \code
+  /// static const bool kMemoized = true;
+  /// \endcode
+  /// and the abstract base type of a factory may do the same on behalf of
+  /// all of its concrete types.  Only classes whose instances are never
+  /// modified once constructed, and whose <tt>PostInit</tt> methods depend
+  /// only on their specs, should be memoized.
+  static const bool kMemoized = false;
+};
+
+/// Indicates whether the construction of objects of the type \a T is
+/// memoized, as declared by its <tt>kMemoized</tt> member, if it has
+/// one.
+///
+/// \see FactoryConstructible::kMemoized
+template <typename T, typename Enable = void>
+struct IsMemoized : std::false_type { };
+
+template <typename T>
+struct IsMemoized<T, typename std::enable_if<T::kMemoized>::type>
+    : std::true_type { };
+
+/// Indicates whether the type \a T may have a <tt>PostInit</tt> method
+/// that does something, which is the case unless its method is the one
+/// inherited from \link FactoryConstructible\endlink, which does nothing.
+template <typename T, typename Enable = void>
+struct OverridesPostInit : std::true_type { };
+
+template <typename T>
+struct OverridesPostInit<
+  T, typename std::enable_if<
+       std::is_same<decltype(&T::PostInit),
+                    void (FactoryConstructible::*)(const Environment *,
+                                                   const string &)>::value
+     >::type> : std::false_type { };
+
+template <typename T> class Factory;
+
+/// \class CompiledSpecBase
+///
+/// The part of a \link CompiledSpec \endlink that does not depend on the
+/// type of object being constructed: the tokens of a specification
+/// string, read exactly once, and the location among them of the
+/// initialization of each member.
+class CompiledSpecBase {
+ public:
+  /// Information about the initialization of a single member in a spec.
+  struct Member {
+    /// The name of the member.
+    string name;
+    /// The stream position of the member name in the spec.
+    size_t name_start;
+    /// The index of the first token of the member&rsquo;s initializer.
+    size_t begin;
+    /// One past the index of the last token of the member&rsquo;s
+    /// initializer.
+    size_t end;
+    /// The index of the member in the \link InitializerSchema \endlink of
+    /// the type, if it is usable.
+    size_t slot;
+  };
+
+  virtual ~CompiledSpecBase() { }
+
+  /// Returns whether the compiled spec was <tt>nullptr</tt> or
+  /// <tt>NULL</tt>.
+  bool null() const { return null_; }
+
+  /// Returns the concrete type named by the compiled spec.
+  const string &type() const { return type_; }
+
+  /// Returns the compiled spec itself, as passed to the \link PostInit
+  /// \endlink method of each instance.
+  const string &init_str() const { return init_str_; }
+
+  /// Returns the member initializations of the compiled spec, in order.
+  const vector<Member> &members() const { return members_; }
+
+ protected:
+  CompiledSpecBase() { }
+
+  /// Tokenizes and parses the specified spec string, which must
+  /// conform to the grammar described at \link Factory::CreateOrDie
+  /// \endlink.  Only the structure of the spec is checked here; each
+  /// member&rsquo;s initializer is checked when it is replayed.
+  ///
+  /// \param spec      the spec string to be compiled
+  /// \param base_name the name of the base type of the factory compiling
+  ///                  this spec, for error messages
+  void Parse(const string &spec, const string &base_name);
+
+  /// Checks that every member of the compiled spec has an initializer
+  /// among the specified ones, and that every required member is
+  /// initialized by the compiled spec.
+  void Validate(const Initializers &initializers) const;
+
+  /// Initializes a member by replaying the tokens of its initializer.
+  ///
+  /// \param member      the member initialization of this compiled spec
+  /// \param initializer the initializer of the member being constructed
+  /// \param env         the environment of the object being constructed
+  void InitMember(const Member &member, MemberInitializer *initializer,
+                  Environment *env) const;
+
+  /// Initializes a member of the specified instance by replaying the
+  /// tokens of its initializer through the specified schema.
+  void InitMember(const Member &member, const InitializerSchema &schema,
+                  void *instance, Environment *env) const;
+
+  /// Records the index in the specified schema of each member.
+  void ResolveSlots(const InitializerSchema &schema);
+
+  /// Returns the prefix for error messages.
+  string ErrorPrefix() const { return "Factory<" + base_name_ + ">: "; }
+
+  // data members
+  string base_name_;
+  bool null_ = false;
+  string type_;
+  string init_str_;
+  vector<Member> members_;
+  // The spec string and its tokens, whose positions refer to it.
+  string source_;
+  vector<StreamTokenizer::Token> tokens_;
+
+ private:
+  // Reports an error if the specified tokenizer, which replayed the
+  // tokens of the specified member's initializer, has any tokens left.
+  void CheckConsumed(const Member &member, const StreamTokenizer &st) const;
+
+  // Returns the token at the specified index, or the empty string past
+  // the last token.
+  const string &Tok(size_t idx) const;
+  // Returns the start of the token at the specified index, or the size
+  // of the spec string past the last token.
+  size_t Start(size_t idx) const;
+};
+
+/// \class CompiledSpec
+///
+/// A specification string parsed once by \link Factory::Compile
+/// \endlink, from which any number of objects may be constructed via
+/// \link Instantiate \endlink without tokenizing or parsing the string
+/// again, or looking up the constructor of its type.  A compiled spec is
+/// immutable, so a single instance may be shared freely.
+///
+/// \tparam T the base type of objects constructed from this compiled spec
+template <typename T>
+class CompiledSpec : public CompiledSpecBase {
+ public:
+  /// Constructs a new object from this compiled spec, exactly as \link
+  /// Factory::CreateOrDie \endlink would from the original spec string.
+  ///
+  /// \param env the \link infact::Environment Environment \endlink in
+  ///            which this method was called, or <tt>nullptr</tt> if there
+  ///            is no calling environment
+  shared_ptr<T> Instantiate(Environment *env = nullptr) const {
+    if (null_) {
+      return shared_ptr<T>();
+    }
+    Profiler *profiler = Profiler::Current();
+    int64_t start = profiler != nullptr ? profiler->Now() : 0;
+    if (profiler != nullptr) {
+      profiler->RecordScope();
+    }
+    shared_ptr<Environment> env_ptr(env == nullptr ?
+                                    Environment::CreateEmpty() :
+                                    env->CreateChild());
+    shared_ptr<T> instance(constructor_->NewShared(env));
+    int64_t init = profiler != nullptr ? profiler->Now() : 0;
+    if (schema_ != nullptr) {
+      for (vector<Member>::const_iterator it = members_.begin();
+           it != members_.end();
+           ++it) {
+        InitMember(*it, *schema_, instance.get(), env_ptr.get());
+      }
+      int64_t post_init = profiler != nullptr ? profiler->Now() : 0;
+      if (constructor_->HasPostInit()) {
+        instance->PostInit(env_ptr.get(), init_str_);
+      }
+      if (profiler != nullptr) {
+        profiler->RecordConstruction(type(), start, init, post_init,
+                                     profiler->Now());
+      }
+      return instance;
+    }
+    Initializers initializers;
+    instance->RegisterInitializers(initializers);
+    for (vector<Member>::const_iterator it = members_.begin();
+         it != members_.end();
+         ++it) {
+      typename Initializers::iterator init_it = initializers.find(it->name);
+      if (init_it == initializers.end()) {
+        // The initializers differ from those the spec was validated against.
+        Validate(initializers);
+      }
+      InitMember(*it, init_it->second, env_ptr.get());
+    }
+    int64_t post_init = profiler != nullptr ? profiler->Now() : 0;
+    if (constructor_->HasPostInit()) {
+      instance->PostInit(env_ptr.get(), init_str_);
+    }
+    if (profiler != nullptr) {
+      profiler->RecordConstruction(type(), start, init, post_init,
+                                   profiler->Now());
+    }
+    return instance;
+  }
+
+ private:
+  friend class Factory<T>;
+  CompiledSpec() { }
+
+  const Constructor<T> *constructor_ = nullptr;
+  // The schema of the type, or nullptr if it is not usable.
+  const InitializerSchema *schema_ = nullptr;
 };
 
 /// Factory for dynamically created instance of the specified type.
@@ -764,9 +1409,17 @@ class Factory : public FactoryBase {
   ///            this method was called, or <tt>nullptr</tt> if there is
   ///            no calling environment
   shared_ptr<T> CreateOrDie(StreamTokenizer &st, Environment *env = nullptr) {
+    // Time the construction, if the current thread is being profiled.
+    Profiler *profiler = Profiler::Current();
+    int64_t start = profiler != nullptr ? profiler->Now() : 0;
+    if (profiler != nullptr) {
+      profiler->RecordScope();
+    }
     shared_ptr<Environment> env_ptr(env == nullptr ?
-                                    Environment::CreateEmpty() : env->Copy());
-    size_t start = st.PeekTokenStart();
+                                    Environment::CreateEmpty() :
+                                    env->CreateChild());
+    // Keep the characters of this object's spec available for PostInit.
+    StreamTokenizer::Capture capture(st);
     StreamTokenizer::TokenType token_type = st.PeekTokenType();
     if (token_type == StreamTokenizer::RESERVED_WORD &&
         (st.Peek() == "nullptr" || st.Peek() == "NULL")) {
@@ -796,19 +1449,57 @@ class Factory : public FactoryBase {
     st.Next();
 
     // Attempt to create an instance of type.
-    typename unordered_map<string, const Constructor<T> *>::iterator cons_it =
-        cons_table_->find(type);
-    if (cons_it == cons_table_->end()) {
+    const Constructor<T> *constructor = FindConstructor(type);
+    if (constructor == nullptr) {
       ostringstream err_ss;
       err_ss << "Factory<" << BaseName() << ">: "
              << "error: unknown type: \"" << type << "\"";
       Error(err_ss.str());
     }
-    shared_ptr<T> instance(cons_it->second->NewInstance());
 
-    // Ask new instance to set up member initializers.
+    // Share the live object constructed from an identical spec, if the
+    // construction of the type is memoized.
+    string memo_key;
+    vector<shared_ptr<const void> > memo_references;
+    size_t num_memo_tokens = 0;
+    if (constructor->Memoized()) {
+      num_memo_tokens = MemoTable::ReadKey(st, env, &memo_key,
+                                           &memo_references);
+      if (num_memo_tokens > 0) {
+        shared_ptr<void> memoized = constructor->memo().Find(memo_key);
+        if (memoized != nullptr) {
+          if (profiler != nullptr) {
+            profiler->RecordMemoized(type);
+          }
+          return std::static_pointer_cast<T>(memoized);
+        }
+        st.Rewind(num_memo_tokens);
+      }
+    }
+    shared_ptr<T> instance(constructor->NewShared(env));
+    int64_t init = profiler != nullptr ? profiler->Now() : 0;
+
+    // Use the cached schema of the type to initialize members, if
+    // possible; otherwise, ask new instance to set up member initializers.
+    const InitializerSchema *schema = constructor->Schema();
+    if (!schema->usable()) {
+      schema = nullptr;
+    }
     Initializers initializers;
-    instance->RegisterInitializers(initializers);
+    if (schema == nullptr) {
+      instance->RegisterInitializers(initializers);
+    }
+    // Whether each member of the schema has been initialized.
+    char initialized_buf[64];
+    vector<char> initialized_vec;
+    char *initialized = initialized_buf;
+    if (schema != nullptr) {
+      if (schema->size() > sizeof(initialized_buf)) {
+        initialized_vec.resize(schema->size());
+        initialized = initialized_vec.data();
+      }
+      std::fill(initialized, initialized + schema->size(), 0);
+    }
 
     // Parse initializer list.
     while (st.Peek() != ")") {
@@ -824,8 +1515,21 @@ class Factory : public FactoryBase {
       }
       size_t member_name_start = st.PeekTokenStart();
       string member_name = st.Next();
-      typename Initializers::iterator init_it = initializers.find(member_name);
-      if (init_it == initializers.end()) {
+      size_t member_idx = 0;
+      MemberInitializer *member_initializer = nullptr;
+      bool known_member;
+      if (schema != nullptr) {
+        member_idx = schema->Find(member_name);
+        known_member = member_idx < schema->size();
+      } else {
+        typename Initializers::iterator init_it =
+            initializers.find(member_name);
+        known_member = init_it != initializers.end();
+        if (known_member) {
+          member_initializer = init_it->second;
+        }
+      }
+      if (!known_member) {
         ostringstream err_ss;
         err_ss << "Factory<" << BaseName() << ">: "
                << "error: unknown member name \"" << member_name
@@ -833,7 +1537,6 @@ class Factory : public FactoryBase {
                << "position " << member_name_start;
         Error(err_ss.str());
       }
-      MemberInitializer *member_initializer = init_it->second;
 
       // Read open parenthesis or equals sign.
       size_t member_init_start = st.PeekTokenStart();
@@ -850,7 +1553,13 @@ class Factory : public FactoryBase {
       st.Next();
 
       // Initialize member based on following token(s).
-      member_initializer->Init(st, env_ptr.get());
+      if (schema != nullptr) {
+        if (schema->Init(member_idx, st, env_ptr.get(), instance.get())) {
+          initialized[member_idx] = 1;
+        }
+      } else {
+        member_initializer->Init(st, env_ptr.get());
+      }
 
       // If an open parenthesis was seen, read close parenthesis.
       if (saw_member_init_open_paren) {
@@ -895,6 +1604,16 @@ class Factory : public FactoryBase {
 
     // Run through all member initializers: if any are required but haven't
     // been invoked, it is an error.
+    for (size_t i = 0; schema != nullptr && i < schema->size(); ++i) {
+      if (schema->Required(i) && !initialized[i]) {
+        ostringstream err_ss;
+        err_ss << "Factory<" << BaseName() << ">: "
+               << "error: initialization for member with name \""
+               << schema->member(i).name << "\" required but not found "
+               << "(current stream position: " << st.tellg() << ")";
+        Error(err_ss.str());
+      }
+    }
     for (typename Initializers::const_iterator init_it = initializers.begin();
          init_it != initializers.end();
          ++init_it) {
@@ -910,14 +1629,24 @@ class Factory : public FactoryBase {
       }
     }
 
-    size_t end = st.tellg();
-    // Invoke new instance's Init method.
-    string stream_str = st.str();
-    //cerr << "Full stream string is: \"" << stream_str << "\"" << endl;
-    string init_str = stream_str.substr(start, end - start);
-    //cerr << "PostInit string is: \"" << init_str << "\"" << endl;
-    instance->PostInit(env_ptr.get(), init_str);
+    // Invoke new instance's Init method, copying its spec string only if
+    // the method may use it.
+    int64_t post_init = profiler != nullptr ? profiler->Now() : 0;
+    if (constructor->HasPostInit()) {
+      string init_str = capture.str();
+      //cerr << "PostInit string is: \"" << init_str << "\"" << endl;
+      instance->PostInit(env_ptr.get(), init_str);
+    }
+    if (profiler != nullptr) {
+      profiler->RecordConstruction(type, start, init, post_init,
+                                   profiler->Now());
+    }
 
+    if (num_memo_tokens > 0) {
+      return std::static_pointer_cast<T>(
+          constructor->memo().Insert(memo_key, instance,
+                                     std::move(memo_references)));
+    }
     return instance;
   }
 
@@ -927,6 +1656,121 @@ class Factory : public FactoryBase {
     return CreateOrDie(st, env);
   }
 
+  /// Constructs an object from each of the specified spec strings, as
+  /// \link CreateOrDie \endlink would, but much more cheaply for a batch
+  /// of short specs: each thread tokenizes all of its specs with a single
+  /// StreamTokenizer, which is \link StreamTokenizer::Reset reset\endlink
+  /// for each spec rather than constructed anew, and, if no environment
+  /// is specified, all specs are read in child scopes of a single empty
+  /// one, rather than each in an empty environment of its own.
+  ///
+  /// An error in one spec does not prevent the others from being
+  /// constructed; when errors are reported by exceptions (see \link
+  /// infact::Error Error\endlink), each is caught and reported for its
+  /// spec.  With more than one thread, the specified environment is read
+  /// concurrently, and so must not be modified until this method returns.
+  ///
+  /// \param      specs       the spec strings, each conforming to the
+  ///                         grammar described for \link CreateOrDie
+  ///                         \endlink
+  /// \param      env         the environment in which the specs are read,
+  ///                         or <tt>nullptr</tt> if there is none
+  /// \param[out] objects     set to the object constructed from each spec,
+  ///                         in order, which is <tt>nullptr</tt> for a
+  ///                         spec that failed
+  /// \param[out] errors      if not <tt>nullptr</tt>, set to the error
+  ///                         message of each spec, in order, which is
+  ///                         empty for a spec that succeeded
+  /// \param      num_threads the maximum number of specs to read
+  ///                         concurrently
+  /// \return whether every object was constructed without error
+  bool CreateMany(const vector<string> &specs, Environment *env,
+                  vector<shared_ptr<T> > *objects,
+                  vector<string> *errors = nullptr, int num_threads = 1) {
+    objects->assign(specs.size(), shared_ptr<T>());
+    if (errors != nullptr) {
+      errors->assign(specs.size(), string());
+    }
+    unique_ptr<Environment> empty_env;
+    if (env == nullptr) {
+      empty_env.reset(Environment::CreateEmpty());
+      env = empty_env.get();
+    }
+
+    // Threads take specs in order, each with a tokenizer of its own.
+    std::atomic<size_t> next_spec(0);
+    std::atomic<bool> succeeded(true);
+    auto create = [&]() {
+      StreamTokenizer st("", 0);
+      for (size_t i = next_spec++; i < specs.size(); i = next_spec++) {
+#ifdef INFACT_THROW_EXCEPTIONS
+        try {
+#endif
+          st.Reset(specs[i].data(), specs[i].size());
+          (*objects)[i] = CreateOrDie(st, env);
+#ifdef INFACT_THROW_EXCEPTIONS
+        } catch (std::runtime_error &e) {
+          succeeded = false;
+          if (errors != nullptr) {
+            (*errors)[i] = e.what();
+          }
+        }
+#endif
+      }
+    };
+    size_t max_threads = specs.size() > 0 ? specs.size() : 1;
+    size_t num_workers = num_threads > 1 ?
+        std::min(static_cast<size_t>(num_threads), max_threads) : 1;
+    vector<std::thread> threads;
+    for (size_t i = 1; i < num_workers; ++i) {
+      threads.push_back(std::thread(create));
+    }
+    create();
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    return succeeded;
+  }
+
+  /// Parses the specified spec string once, so that any number of
+  /// objects may later be constructed from it via \link
+  /// CompiledSpec::Instantiate \endlink much more cheaply than by
+  /// invoking \link CreateOrDie \endlink repeatedly.  The type of the
+  /// spec is resolved, and its member names and required members are
+  /// checked, at compile time.
+  ///
+  /// \param spec a spec string conforming to the grammar described for
+  ///             \link CreateOrDie \endlink
+  shared_ptr<const CompiledSpec<T> > Compile(const string &spec) const {
+    shared_ptr<CompiledSpec<T> > compiled(new CompiledSpec<T>());
+    compiled->Parse(spec, BaseName());
+    if (compiled->null()) {
+      return compiled;
+    }
+    compiled->constructor_ = FindConstructor(compiled->type());
+    if (compiled->constructor_ == nullptr) {
+      ostringstream err_ss;
+      err_ss << "Factory<" << BaseName() << ">: "
+             << "error: unknown type: \"" << compiled->type() << "\"";
+      Error(err_ss.str());
+    }
+
+    // Learn the members of the type from its schema, if usable, or else
+    // from a prototype instance.
+    const InitializerSchema *schema = compiled->constructor_->Schema();
+    if (schema->usable()) {
+      compiled->Validate(schema->initializers());
+      compiled->ResolveSlots(*schema);
+      compiled->schema_ = schema;
+      return compiled;
+    }
+    unique_ptr<T> prototype(compiled->constructor_->NewInstance());
+    Initializers initializers;
+    prototype->RegisterInitializers(initializers);
+    compiled->Validate(initializers);
+    return compiled;
+  }
+
 
   /// Returns the name of the base type of objects constructed by this factory.
   virtual const string BaseName() const { return base_name_; }
@@ -939,19 +1783,24 @@ class Factory : public FactoryBase {
   /// \return whether the specified type has been registered with this
   ///         factory
   static bool IsRegistered(const string &type) {
-    return initialized_ && cons_table_->find(type) != cons_table_->end();
+    return FindConstructor(type) != nullptr;
+  }
+
+  /// Returns the constructor registered for the specified type, or
+  /// nullptr if there is no such type.  This method may be invoked by
+  /// many threads concurrently, even while types are being registered,
+  /// and never blocks.
+  ///
+  /// \param type the concrete type whose constructor is to be found
+  static const Constructor<T> *FindConstructor(const string &type) {
+    return static_cast<const Constructor<T> *>(cons_table_.Find(type));
   }
 
   /// \copydoc FactoryBase::CollectRegistered
   virtual void CollectRegistered(unordered_set<string> &registered) const {
-    if (initialized_) {
-      for (typename unordered_map<string, const Constructor<T> *>::iterator it =
-               cons_table_->begin();
-           it != cons_table_->end();
-           ++it) {
-        registered.insert(it->first);
-      }
-    }
+    cons_table_.ForEach([&registered](const string &name, const void *) {
+        registered.insert(name);
+      });
   }
 
   virtual VarMapBase *CreateVarMap(Environment *env) const {
@@ -967,26 +1816,33 @@ class Factory : public FactoryBase {
   }
 
   /// The method used by the \link REGISTER_NAMED \endlink macro to ensure
-  /// that subclasses add themselves to the factory.
+  /// that subclasses add themselves to the factory.  Types may be
+  /// registered at any time, including by shared objects loaded while
+  /// other threads use this factory.
   ///
   /// \param type the type to be registered
   /// \param p    the constructor for the specified type
   static const Constructor<T> *Register(const string &type,
                                         const Constructor<T> *p) {
-    if (!initialized_) {
-      cons_table_ = new unordered_map<string, const Constructor<T> *>();
-      initialized_ = 1;
+    bool first = false;
+    const Constructor<T> *registered =
+        static_cast<const Constructor<T> *>(cons_table_.Insert(type, p, &first));
+    if (first) {
       FactoryContainer::Add(new Factory<T>());
     }
-    typename unordered_map<string, const Constructor<T> *>::iterator cons_it =
-        cons_table_->find(type);
-    if (cons_it == cons_table_->end()) {
-      (*cons_table_)[type] = p;
-      return p;
-    } else {
+    if (registered != p) {
       delete p;
-      return cons_it->second;
     }
+    return registered;
+  }
+
+  /// Removes all memoized objects from the tables of the constructors of
+  /// this factory, so that no object constructed so far is shared with
+  /// any constructed later.
+  static void ClearMemoized() {
+    cons_table_.ForEach([](const string &, const void *constructor) {
+        static_cast<const Constructor<T> *>(constructor)->memo().Clear();
+      });
   }
 
   /// Clears all static data associated with this class.
@@ -995,31 +1851,23 @@ class Factory : public FactoryBase {
   /// It should only be invoked when the factory is no longer needed by
   /// the current process.
   static void ClearStatic() {
-    if (initialized_) {
-      for (typename unordered_map<string, const Constructor<T> *>::iterator it =
-               cons_table_->begin();
-           it != cons_table_->end();
-           ++it) {
-        delete it->second;
-      }
-      delete cons_table_;
-      initialized_ = 0;
-    }
+    cons_table_.ForEach([](const string &, const void *constructor) {
+        delete static_cast<const Constructor<T> *>(constructor);
+      });
+    cons_table_.Clear();
   }
  private:
   // data members
-  /// Initialization flag.
-  static int initialized_;
   /// Factory map of prototype objects.
-  static unordered_map<string, const Constructor<T> *> *cons_table_;
+  static Registry cons_table_;
   static const char *base_name_;
 };
 
 // Initialize the templated static data member cons_table_ right here,
-// since the compiler will happily remove the duplicate definitions.
+// since the compiler will happily remove the duplicate definitions.  Its
+// constant initialization makes it usable by any static initializer.
 template <typename T>
-unordered_map<string, const Constructor<T> *> *
-Factory<T>::cons_table_ = 0;
+Registry Factory<T>::cons_table_;
 
 /// A macro to define a subclass of \link infact::Constructor
 /// Constructor \endlink whose NewInstance method constructs an
@@ -1029,7 +1877,18 @@ Factory<T>::cons_table_ = 0;
 /// This is a helper macro used only by the <tt>REGISTER</tt> macro.
 #define DEFINE_CONS_CLASS(TYPE,NAME,BASE) \
   class NAME ## Constructor : public infact::Constructor<BASE> { \
-   public: virtual BASE *NewInstance() const { return new TYPE(); } };
+   public: virtual BASE *NewInstance() const { return new TYPE(); } \
+    virtual std::shared_ptr<BASE> NewInstanceIn( \
+        const std::shared_ptr<infact::Arena> &arena) const { \
+      return std::allocate_shared<TYPE>(infact::ArenaAllocator<TYPE>(arena)); \
+    } \
+    virtual size_t InstanceSize() const { return sizeof(TYPE); } \
+    virtual bool Memoized() const { \
+      return infact::IsMemoized<TYPE>::value; \
+    } \
+    virtual bool HasPostInit() const { \
+      return infact::OverridesPostInit<TYPE>::value; \
+    } };
 
 /// This macro registers the concrete subtype \a TYPE with the
 /// specified factory for instances of type \a BASE; the \a TYPE is
@@ -1049,7 +1908,6 @@ Factory<T>::cons_table_ = 0;
 /// Provides the necessary implementation for a factory for the specified
 /// <tt>BASE</tt> class type.
 #define IMPLEMENT_FACTORY(BASE) \
-  template<> int infact::Factory<BASE>::initialized_ = 0; \
   template<> const char *infact::Factory<BASE>::base_name_ = #BASE;
 
 }  // namespace infact
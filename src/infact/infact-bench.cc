@@ -0,0 +1,427 @@
+// Copyright 2014, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//   * Redistributions of source code must retain the above copyright
+//     notice, this list of conditions and the following disclaimer.
+//   * Redistributions in binary form must reproduce the above
+//     copyright notice, this list of conditions and the following disclaimer
+//     in the documentation and/or other materials provided with the
+//     distribution.
+//   * Neither the name of Google Inc. nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+// -----------------------------------------------------------------------------
+//
+/// \file
+/// Benchmark driver for the StreamTokenizer, EnvironmentImpl, Factory and
+/// Interpreter classes, run against synthetic configurations built from
+/// the classes in example.h.  Each benchmark's results are written as one
+/// line of JSON, followed by a line with the peak resident set size of
+/// the process, so that results may be tracked across changes.
+///
+/// Usage:
+/// \code
+/// bin/infact-bench [--scale=S] [--min_time=SECONDS] [--filter=SUBSTRING]
+/// \endcode
+/// where <tt>--scale</tt> multiplies the size of every synthetic
+/// configuration, <tt>--min_time</tt> is the least time spent running each
+/// benchmark and <tt>--filter</tt> selects the benchmarks whose names
+/// contain the specified string.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+#include "example.h"
+#include "interpreter.h"
+
+using namespace std;
+using namespace infact;
+
+namespace {
+
+/// The options of a run of the benchmarks.
+struct Options {
+  double scale = 1.0;
+  double min_time = 0.2;
+  string filter;
+};
+
+/// A synthetic configuration.
+struct Config {
+  string name;
+  string text;
+  size_t num_statements = 0;
+};
+
+int64_t
+NowNs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+size_t
+Scaled(const Options &options, size_t size) {
+  return max(static_cast<size_t>(1),
+             static_cast<size_t>(size * options.scale));
+}
+
+// Writes the results of the specified benchmark as a line of JSON.
+//
+// \param name    the name of the benchmark
+// \param samples the time taken by each iteration, in nanoseconds
+// \param items   the number of items processed by each iteration
+// \param bytes   the number of bytes processed by each iteration
+void
+Report(const string &name, vector<int64_t> samples, size_t items,
+       size_t bytes) {
+  sort(samples.begin(), samples.end());
+  double total = 0;
+  for (int64_t sample : samples) {
+    total += sample;
+  }
+  double mean = total / samples.size();
+  auto percentile = [&samples](double p) {
+    size_t idx = static_cast<size_t>(p * (samples.size() - 1) + 0.5);
+    return samples[idx];
+  };
+  cout << "{\"benchmark\":\"" << name << "\""
+       << ",\"iterations\":" << samples.size()
+       << ",\"items\":" << items
+       << ",\"bytes\":" << bytes
+       << ",\"mean_ns\":" << static_cast<int64_t>(mean)
+       << ",\"min_ns\":" << samples.front()
+       << ",\"p50_ns\":" << percentile(0.5)
+       << ",\"p90_ns\":" << percentile(0.9)
+       << ",\"p99_ns\":" << percentile(0.99)
+       << ",\"max_ns\":" << samples.back()
+       << ",\"items_per_s\":" << static_cast<int64_t>(items * 1e9 / mean)
+       << ",\"bytes_per_s\":" << static_cast<int64_t>(bytes * 1e9 / mean)
+       << "}" << endl;
+}
+
+// Runs the specified function repeatedly, for at least the minimum time
+// and at least a few times, and reports the time taken by each run,
+// unless the benchmark is filtered out.
+template <typename Function>
+void
+Run(const Options &options, const string &name, size_t items, size_t bytes,
+    Function function) {
+  if (name.find(options.filter) == string::npos) {
+    return;
+  }
+  static const size_t kMinIterations = 5;
+  static const size_t kMaxIterations = 1000000;
+  vector<int64_t> samples;
+  int64_t end = NowNs() + static_cast<int64_t>(options.min_time * 1e9);
+  while (samples.size() < kMaxIterations &&
+         (samples.size() < kMinIterations || NowNs() < end)) {
+    int64_t start = NowNs();
+    function();
+    samples.push_back(NowNs() - start);
+  }
+  Report(name, samples, items, bytes);
+}
+
+// Many small objects, gathered into wide vectors.
+Config
+WideConfig(size_t num_objects) {
+  Config config;
+  config.name = "wide";
+  ostringstream os;
+  for (size_t i = 0; i < num_objects; ++i) {
+    os << "c" << i << " = Cow(name(\"cow " << i << "\"), age(" << i % 20
+       << "));\n";
+  }
+  os << "Animal[] herd = {";
+  for (size_t i = 0; i < num_objects; ++i) {
+    os << (i > 0 ? ", " : "") << "c" << i;
+  }
+  os << "};\n";
+  os << "Animal[] flock = {";
+  for (size_t i = 0; i < num_objects; ++i) {
+    os << (i > 0 ? ", " : "") << "Sheep(name(\"sheep " << i
+       << "\"), counts({1, 2, 3}))";
+  }
+  os << "};\n";
+  config.text = os.str();
+  config.num_statements = num_objects + 2;
+  return config;
+}
+
+// A long chain of statements, each depending on the one before it, whose
+// objects are nested as deeply as the example classes allow.
+Config
+DeepConfig(size_t depth) {
+  Config config;
+  config.name = "deep";
+  ostringstream os;
+  os << "int age0 = 1;\n";
+  for (size_t i = 1; i <= depth; ++i) {
+    os << "int age" << i << " = age" << i - 1 << ";\n"
+       << "o" << i << " = HumanPetOwner(pets({Cow(name(\"cow " << i
+       << "\"), age(age" << i << ")), Sheep(name(\"sheep " << i
+       << "\"), counts({" << i << "}))}));\n"
+       << "p" << i << " = PersonImpl(name(\"person " << i
+       << "\"), cm_height(age" << i << "), birthday(DateImpl(year(1990), "
+       << "month(" << i % 12 + 1 << "), day(" << i % 28 + 1 << "))));\n";
+  }
+  config.text = os.str();
+  config.num_statements = 3 * depth + 1;
+  return config;
+}
+
+// Long numeric arrays.
+Config
+NumericConfig(size_t size) {
+  Config config;
+  config.name = "numeric";
+  ostringstream os;
+  // Every weight has a decimal point, so that none is read as an int.
+  os << fixed << setprecision(3) << "double[] weights = {";
+  for (size_t i = 0; i < size; ++i) {
+    os << (i > 0 ? ", " : "") << (i % 1000) * 0.001 - 0.5;
+  }
+  os << "};\nint[] ids = {";
+  for (size_t i = 0; i < size; ++i) {
+    os << (i > 0 ? ", " : "") << i;
+  }
+  os << "};\n";
+  config.text = os.str();
+  config.num_statements = 2;
+  return config;
+}
+
+// Many variables of primitive types.
+Config
+VariablesConfig(size_t num_variables) {
+  Config config;
+  config.name = "variables";
+  ostringstream os;
+  for (size_t i = 0; i < num_variables; ++i) {
+    switch (i % 4) {
+      case 0: os << "int v" << i << " = " << i << ";\n"; break;
+      case 1: os << "double v" << i << " = " << i << ".5;\n"; break;
+      case 2: os << "string v" << i << " = \"value " << i << "\";\n"; break;
+      default: os << "bool v" << i << " = true;\n"; break;
+    }
+  }
+  config.text = os.str();
+  config.num_statements = num_variables;
+  return config;
+}
+
+// Writes a main file importing the specified number of files, each
+// defining a few objects, to the specified directory, returning the
+// name of the main file and, via the specified vector, all files written.
+Config
+WriteImportsConfig(const string &dir, size_t num_imports,
+                   vector<string> *files) {
+  Config config;
+  config.name = "imports";
+  ostringstream main_os;
+  for (size_t i = 0; i < num_imports; ++i) {
+    string filename = dir + "/import" + to_string(i) + ".infact";
+    ofstream os(filename.c_str());
+    os << "int n" << i << " = " << i << ";\n"
+       << "a" << i << " = Cow(name(\"cow " << i << "\"), age(n" << i
+       << "));\n"
+       << "o" << i << " = HumanPetOwner(pets({a" << i << "}));\n";
+    files->push_back(filename);
+    main_os << "import \"import" << i << ".infact\";\n";
+  }
+  config.text = dir + "/imports.infact";
+  ofstream os(config.text.c_str());
+  os << main_os.str();
+  files->push_back(config.text);
+  config.num_statements = 3 * num_imports;
+  return config;
+}
+
+size_t
+CountTokens(const string &text) {
+  size_t num_tokens = 0;
+  StreamTokenizer st(text.data(), text.size());
+  while (st.HasNext()) {
+    st.Next();
+    ++num_tokens;
+  }
+  return num_tokens;
+}
+
+void
+Usage(const char *program) {
+  cerr << "usage: " << program << " [--scale=S] [--min_time=SECONDS] "
+       << "[--filter=SUBSTRING]" << endl;
+}
+
+}  // namespace
+
+int
+main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 8, "--scale=") == 0) {
+      options.scale = atof(arg.c_str() + 8);
+    } else if (arg.compare(0, 11, "--min_time=") == 0) {
+      options.min_time = atof(arg.c_str() + 11);
+    } else if (arg.compare(0, 9, "--filter=") == 0) {
+      options.filter = arg.substr(9);
+    } else {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.scale <= 0) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  vector<Config> configs;
+  configs.push_back(WideConfig(Scaled(options, 1000)));
+  configs.push_back(DeepConfig(Scaled(options, 300)));
+  configs.push_back(NumericConfig(Scaled(options, 100000)));
+  configs.push_back(VariablesConfig(Scaled(options, 10000)));
+
+  // Tokenizing and evaluating whole configurations.
+  for (const Config &config : configs) {
+    size_t num_tokens = CountTokens(config.text);
+    Run(options, "tokenizer/" + config.name, num_tokens, config.text.size(),
+        [&config]() {
+          StreamTokenizer st(config.text.data(), config.text.size());
+          while (st.HasNext()) {
+            st.Next();
+          }
+        });
+    Run(options, "eval/" + config.name, config.num_statements,
+        config.text.size(), [&config]() {
+          Interpreter interpreter;
+          interpreter.EvalString(config.text);
+        });
+  }
+
+  // Evaluating a configuration spread over many imported files.
+  char dir_template[] = "/tmp/infact-bench-XXXXXX";
+  if (mkdtemp(dir_template) != nullptr) {
+    vector<string> files;
+    Config config = WriteImportsConfig(dir_template, Scaled(options, 100),
+                                       &files);
+    Run(options, "eval/imports", config.num_statements, 0, [&config]() {
+        Interpreter interpreter;
+        interpreter.Eval(config.text);
+      });
+    // The same, with every import found in a cache after the first run.
+    shared_ptr<ImportCache> import_cache(new ImportCache());
+    Run(options, "eval/imports_cached", config.num_statements, 0,
+        [&config, &import_cache]() {
+          Interpreter interpreter;
+          interpreter.SetImportCache(import_cache);
+          interpreter.Eval(config.text);
+        });
+    for (const string &filename : files) {
+      unlink(filename.c_str());
+    }
+    rmdir(dir_template);
+  } else {
+    cerr << "infact-bench: cannot create a temporary directory; skipping "
+         << "eval/imports" << endl;
+  }
+
+  // Constructing interpreters and empty environments.
+  Run(options, "construct/interpreter", 1, 0, []() {
+      Interpreter interpreter;
+    });
+  Run(options, "construct/empty_env", 1, 0, []() {
+      unique_ptr<Environment> env(Environment::CreateEmpty());
+    });
+
+  // Copying and looking up variables in a large environment.
+  const Config &variables = configs[3];
+  Interpreter interpreter;
+  interpreter.EvalString(variables.text);
+  Run(options, "env_copy/variables", variables.num_statements, 0,
+      [&interpreter]() {
+        unique_ptr<Environment> copy(interpreter.env()->Copy());
+      });
+  vector<string> varnames;
+  for (size_t i = 0; i < variables.num_statements; i += 4) {
+    varnames.push_back("v" + to_string(i));
+  }
+  Run(options, "get/int", varnames.size(), 0, [&interpreter, &varnames]() {
+      int value = 0;
+      for (const string &varname : varnames) {
+        interpreter.Get(varname, &value);
+      }
+    });
+  Interpreter objects;
+  objects.EvalString(configs[0].text);
+  Run(options, "get/object", configs[0].num_statements - 2, 0,
+      [&objects, &configs]() {
+        shared_ptr<Animal> animal;
+        for (size_t i = 0; i + 2 < configs[0].num_statements; ++i) {
+          objects.Get("c" + to_string(i), &animal);
+        }
+      });
+
+  // Constructing single objects from spec strings.
+  Factory<Animal> animal_factory;
+  Factory<Person> person_factory;
+  Factory<PetOwner> pet_owner_factory;
+  string cow_spec = "Cow(name(\"Bessie\"), age(3))";
+  string person_spec = "PersonImpl(name(\"Fred\"), cm_height(180), "
+      "birthday(DateImpl(year(1990), month(1), day(10))))";
+  string owner_spec = "HumanPetOwner(pets({Cow(name(\"Bessie\")), "
+      "Sheep(name(\"Dolly\"), counts({1, 2, 3}))}))";
+  Run(options, "create_or_die/cow", 1, cow_spec.size(),
+      [&animal_factory, &cow_spec]() {
+        animal_factory.CreateOrDie(cow_spec, "");
+      });
+  Run(options, "create_or_die/person", 1, person_spec.size(),
+      [&person_factory, &person_spec]() {
+        person_factory.CreateOrDie(person_spec, "");
+      });
+  Run(options, "create_or_die/pet_owner", 1, owner_spec.size(),
+      [&pet_owner_factory, &owner_spec]() {
+        pet_owner_factory.CreateOrDie(owner_spec, "");
+      });
+  vector<string> batch(Scaled(options, 256), cow_spec);
+  Run(options, "create_many/cow", batch.size(), batch.size() * cow_spec.size(),
+      [&animal_factory, &batch]() {
+        vector<shared_ptr<Animal> > animals;
+        animal_factory.CreateMany(batch, nullptr, &animals);
+      });
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  cout << "{\"peak_rss_kb\":" << usage.ru_maxrss << "}" << endl;
+  return 0;
+}
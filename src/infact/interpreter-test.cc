@@ -32,14 +32,612 @@
 /// Test driver for the Interpreter class.
 /// \author dbikel@google.com (Dan Bikel)
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 
+#include "example.h"
 #include "interpreter.h"
 
 using namespace std;
 using namespace infact;
 
+/// The number of checks that have failed.
+static int num_failures = 0;
+
+/// The files written by the checks, to be removed when they are done.
+static vector<string> written_files;
+
+/// Counts and reports a failure if the specified condition is false.
+static void Check(bool condition, const string &message) {
+  if (!condition) {
+    cout << "FAILED: " << message << endl;
+    ++num_failures;
+  }
+}
+
+/// Writes the specified contents to the named file.
+static void WriteFile(const string &filename, const string &contents) {
+  ofstream file(filename.c_str(), ios_base::out | ios_base::binary);
+  file << contents;
+  if (find(written_files.begin(), written_files.end(), filename) ==
+      written_files.end()) {
+    written_files.push_back(filename);
+  }
+}
+
+/// Evaluates the named file, returning the error reports the interpreter
+/// wrote to <tt>cerr</tt>, and setting <tt>*threw</tt> to whether an
+/// exception escaped the interpreter.
+static string EvalCapturingErrors(Interpreter *interpreter,
+                                  const string &filename, bool *threw) {
+  ostringstream errors;
+  streambuf *cerr_buf = cerr.rdbuf(errors.rdbuf());
+  *threw = false;
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    interpreter->Eval(filename);
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::exception &e) {
+    *threw = true;
+  }
+#endif
+  cerr.rdbuf(cerr_buf);
+  return errors.str();
+}
+
+/// Returns the environment of the specified interpreter as printed, with
+/// the addresses of objects elided and the variables in sorted order, so
+/// that the environments of two interpreters can be compared.
+static string CanonicalEnv(const Interpreter &interpreter) {
+  ostringstream env_os;
+  interpreter.PrintEnv(env_os);
+  string printed = env_os.str();
+  string elided;
+  for (size_t i = 0; i < printed.size(); ++i) {
+    if (printed.compare(i, 2, "0x") == 0) {
+      elided += "PTR";
+      for (i += 2; i < printed.size() && isxdigit(printed[i]); ++i) { }
+      --i;
+    } else {
+      elided += printed[i];
+    }
+  }
+  istringstream lines_is(elided);
+  vector<string> lines;
+  for (string line; getline(lines_is, line); ) {
+    lines.push_back(line);
+  }
+  sort(lines.begin(), lines.end());
+  string canonical;
+  for (const string &line : lines) {
+    canonical += line + "\n";
+  }
+  return canonical;
+}
+
+namespace infact {
+
+/// An animal whose age is the value of the variable named
+/// <tt>"scale"</tt> that its <tt>PostInit</tt> method finds in the
+/// environment in which it is constructed, or -1 if there is none.
+class Probe : public Animal {
+ public:
+  virtual void RegisterInitializers(Initializers &initializers) {
+    INFACT_ADD_REQUIRED_PARAM_(name);
+    INFACT_ADD_PARAM_(age);
+  }
+
+  virtual void PostInit(const Environment *env, const string &init_str) {
+    const EnvironmentImpl *env_impl =
+        dynamic_cast<const EnvironmentImpl *>(env);
+    if (env_impl == nullptr || !env_impl->Get("scale", &scale_)) {
+      scale_ = -1;
+    }
+  }
+
+  virtual const string &name() const { return name_; }
+  virtual int age() const { return scale_; }
+
+ private:
+  string name_;
+  int age_ = 0;
+  int scale_ = -1;
+};
+
+REGISTER_ANIMAL(Probe)
+
+/// A cow whose construction is memoized, which counts how many times it
+/// has been constructed.
+class MemoCow : public Animal {
+ public:
+  static const bool kMemoized = true;
+
+  MemoCow() { ++num_constructed; }
+
+  virtual void RegisterInitializers(Initializers &initializers) {
+    INFACT_ADD_REQUIRED_PARAM_(name);
+    INFACT_ADD_PARAM_(age);
+    INFACT_ADD_PARAM_(pal);
+  }
+
+  virtual const string &name() const { return name_; }
+  virtual int age() const { return age_; }
+
+  /// The number of instances constructed so far.
+  static std::atomic<int> num_constructed;
+
+ private:
+  string name_;
+  int age_ = 2;
+  shared_ptr<Animal> pal_;
+};
+
+std::atomic<int> MemoCow::num_constructed(0);
+
+REGISTER_ANIMAL(MemoCow)
+
+}  // namespace infact
+
+/// Checks that evaluating the named file concurrently yields the same
+/// environment and error reports as evaluating it in order.
+static void CheckParallelMatchesSequential(const string &filename) {
+  Interpreter sequential;
+  Interpreter parallel;
+  parallel.SetNumThreads(4);
+  bool sequential_threw;
+  bool parallel_threw;
+  string sequential_errors =
+      EvalCapturingErrors(&sequential, filename, &sequential_threw);
+  string parallel_errors =
+      EvalCapturingErrors(&parallel, filename, &parallel_threw);
+  Check(!sequential_threw && !parallel_threw,
+        "evaluating " + filename + " threw an exception");
+  Check(parallel_errors == sequential_errors,
+        "parallel evaluation of " + filename + " reported \"" +
+        parallel_errors + "\" rather than \"" + sequential_errors + "\"");
+  Check(CanonicalEnv(parallel) == CanonicalEnv(sequential),
+        "parallel evaluation of " + filename + " yielded\n" +
+        CanonicalEnv(parallel) + "rather than\n" + CanonicalEnv(sequential));
+}
+
+/// Checks parallel evaluation (see Interpreter::SetNumThreads) against
+/// evaluation in order, on valid input and on input with errors.
+static void CheckParallelEvaluation(const string &dir) {
+  WriteFile(dir + "/base.infact", "int base_age = 5;\n");
+  WriteFile(dir + "/parallel.infact",
+            "int a = 1;\n"
+            "int[] v = {1, 2, 3};\n"
+            "c = Cow(name(\"Bessie\"), age(a));\n"
+            "import \"base.infact\";\n"
+            "s = Sheep(name(\"Dolly\"), age(base_age), counts(v));\n"
+            "Animal[] pets = {c, s, Cow(name(\"x\"))};\n"
+            "o = HumanPetOwner(pets(pets));\n"
+            "int a = 2;\n"
+            "d = Cow(name(\"Daisy\"), age(a));\n");
+  CheckParallelMatchesSequential(dir + "/parallel.infact");
+  Interpreter parallel;
+  parallel.SetNumThreads(4);
+  parallel.Eval(dir + "/parallel.infact");
+  shared_ptr<Animal> c;
+  shared_ptr<Animal> d;
+  Check(parallel.Get("c", &c) && c->age() == 1 &&
+        parallel.Get("d", &d) && d->age() == 2,
+        "parallel evaluation did not see reassigned variable in order");
+
+  // A statement that cannot be evaluated, and one that cannot be
+  // tokenized, stop evaluation as they do when evaluating in order.
+  WriteFile(dir + "/eval-error.infact",
+            "int i = 1;\n"
+            "int j = \"x\";\n"
+            "int k = 3;\n");
+  CheckParallelMatchesSequential(dir + "/eval-error.infact");
+  WriteFile(dir + "/tokenizer-error.infact",
+            "bool f = true;\n"
+            "int i = 3;\n"
+            "string s = \"abc");
+  CheckParallelMatchesSequential(dir + "/tokenizer-error.infact");
+
+  // A PostInit method sees a variable set earlier in the same file as it
+  // would in order only if its statement names that variable; otherwise,
+  // it sees the value set before the file was evaluated.
+  WriteFile(dir + "/probe.infact",
+            "int scale = 1;\n"
+            "p = Probe(name(\"p\"), age(scale));\n"
+            "int scale = 2;\n"
+            "q = Probe(name(\"q\"), age(scale));\n"
+            "r = Probe(name(\"r\"));\n");
+  for (int num_threads : {1, 4}) {
+    Interpreter probing;
+    probing.SetNumThreads(num_threads);
+    probing.EvalString("int scale = 0;");
+    probing.Eval(dir + "/probe.infact");
+    shared_ptr<Animal> p;
+    shared_ptr<Animal> q;
+    shared_ptr<Animal> r;
+    Check(probing.Get("p", &p) && p->age() == 1 &&
+          probing.Get("q", &q) && q->age() == 2,
+          "PostInit did not see the variables its statement names");
+    Check(probing.Get("r", &r) && r->age() == (num_threads == 1 ? 2 : 0),
+          "PostInit did not see the documented value of an unnamed variable");
+  }
+}
+
+/// Checks lazy evaluation (see Interpreter::SetLazy) against eager
+/// evaluation, where variables are reassigned after values referring to
+/// them are bound but before those values are constructed.
+static void CheckLazyEvaluation(const string &dir) {
+  WriteFile(dir + "/lazy.infact",
+            "int a = 1;\n"
+            "c = Cow(name(\"Bessie\"), age(a));\n"
+            "int a = 2;\n"
+            "d = Cow(name(\"Daisy\"), age(a));\n"
+            "alias = c;\n"
+            "c = Sheep(name(\"Dolly\"), age(4));\n"
+            "Animal[] pets = {alias, d};\n");
+  Interpreter eager;
+  Interpreter lazy;
+  lazy.SetLazy(true);
+  eager.Eval(dir + "/lazy.infact");
+  lazy.Eval(dir + "/lazy.infact");
+  int a = 0;
+  shared_ptr<Animal> alias;
+  shared_ptr<Animal> c;
+  shared_ptr<Animal> d;
+  vector<shared_ptr<Animal> > pets;
+  Check(lazy.Get("a", &a) && a == 2, "lazy evaluation did not set a to 2");
+  Check(lazy.Get("alias", &alias) && alias->name() == "Bessie" &&
+        alias->age() == 1,
+        "lazily constructed alias did not see a as it was when bound");
+  Check(lazy.Get("c", &c) && c->name() == "Dolly",
+        "lazily bound c was not reassigned");
+  Check(lazy.Get("d", &d) && d->age() == 2,
+        "lazily constructed d did not see a as reassigned");
+  Check(lazy.Get("pets", &pets) && pets.size() == 2 && pets[0] == alias &&
+        pets[1] == d,
+        "lazily constructed pets did not share alias and d");
+  Check(CanonicalEnv(lazy) == CanonicalEnv(eager),
+        "lazy evaluation yielded\n" + CanonicalEnv(lazy) + "rather than\n" +
+        CanonicalEnv(eager));
+
+  // A PostInit method sees a variable its statement names as it was when
+  // bound, but any other variable as it is when the object is
+  // constructed.
+  WriteFile(dir + "/lazy-probe.infact",
+            "int scale = 1;\n"
+            "p = Probe(name(\"Pat\"));\n"
+            "q = Probe(name(\"Quinn\"), age(scale));\n"
+            "int scale = 2;\n");
+  Interpreter probing;
+  probing.SetLazy(true);
+  probing.Eval(dir + "/lazy-probe.infact");
+  shared_ptr<Animal> p;
+  shared_ptr<Animal> q;
+  Check(probing.Get("p", &p) && p->age() == 2,
+        "lazily constructed p did not see scale as it was when constructed");
+  Check(probing.Get("q", &q) && q->age() == 1,
+        "lazily constructed q did not see scale as it was when bound");
+
+  // An error constructing a value is raised whenever it is looked up,
+  // rather than by setting a variable it refers to.
+  WriteFile(dir + "/lazy-error.infact",
+            "c = Cow(name(\"x\"), age(b));\n"
+            "int b = 3;\n"
+            "int after = 4;\n");
+  Interpreter failing;
+  failing.SetLazy(true);
+  bool threw;
+  string errors =
+      EvalCapturingErrors(&failing, dir + "/lazy-error.infact", &threw);
+  int after = 0;
+  Check(!threw && errors.empty() && failing.Get("after", &after) &&
+        after == 4,
+        "an error constructing a lazily bound value stopped evaluation: " +
+        errors);
+#ifdef INFACT_THROW_EXCEPTIONS
+  for (int i = 0; i < 2; ++i) {
+    string error;
+    try {
+      failing.Get("c", &c);
+    } catch (std::runtime_error &e) {
+      error = e.what();
+    }
+    Check(error.find("cannot construct variable c") != string::npos &&
+          error.find("(line: 1)") != string::npos,
+          "looking up a lazily bound value that cannot be constructed "
+          "reported \"" + error + "\"");
+  }
+  ostringstream env_os;
+  try {
+    failing.PrintEnv(env_os);
+  } catch (std::runtime_error &e) {
+    Check(false, string("printing the environment threw: ") + e.what());
+  }
+  Check(env_os.str().find("// c cannot be constructed;") != string::npos,
+        "printing the environment did not note that c cannot be "
+        "constructed");
+#endif
+}
+
+/// Returns the contents of the named file.
+static string ReadFile(const string &filename) {
+  ifstream file(filename.c_str(), ios_base::in | ios_base::binary);
+  return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+/// Checks that a snapshot (see Interpreter::EvalAndSaveSnapshot) restores
+/// the environment of the evaluation it recorded, and that a snapshot
+/// that is stale or cannot be restored is rejected, leaving the
+/// environment unchanged.
+static void CheckSnapshots(const string &dir) {
+  string config = dir + "/snapshot.infact";
+  string snapshot = dir + "/snapshot.snap";
+  string contents =
+      "int i = 42;\n"
+      "double[] dv = {0.5, 1.5};\n"
+      "string[] sv = {\"a\", \"b\"};\n"
+      "c = Cow(name(\"Bessie\"), age(i));\n"
+      "Animal[] pets = {c, Sheep(name(\"Dolly\"), age(4))};\n";
+  WriteFile(config, contents);
+  WriteFile(snapshot, "");
+  Interpreter evaluated;
+  Check(evaluated.EvalAndSaveSnapshot(config, snapshot),
+        "cannot evaluate " + config + " and save a snapshot");
+  Interpreter restored;
+  Check(restored.LoadSnapshot(snapshot), "cannot load snapshot " + snapshot);
+  Check(CanonicalEnv(restored) == CanonicalEnv(evaluated),
+        "snapshot restored\n" + CanonicalEnv(restored) + "rather than\n" +
+        CanonicalEnv(evaluated));
+  shared_ptr<Animal> c;
+  vector<shared_ptr<Animal> > pets;
+  Check(restored.Get("c", &c) && c->age() == 42 &&
+        restored.Get("pets", &pets) && pets.size() == 2 && pets[0] == c,
+        "snapshot did not restore objects sharing instances");
+
+  // A corrupted snapshot is rejected before anything is restored from
+  // it, and leaves the environment unchanged, whether an encoded value
+  // was altered or a token would fail to be replayed.
+  string saved = ReadFile(snapshot);
+  string altered = saved;
+  // The variable i and its type are each written after their length.
+  size_t i_statement = altered.find(string("i\x03\0\0\0\0\0\0\0int", 12));
+  size_t value = altered.find('\x2a', i_statement);
+  if (i_statement != string::npos && value != string::npos) {
+    altered[value] ^= 1;
+  }
+  string unrestorable = saved;
+  size_t bessie = unrestorable.rfind("Bessie");
+  if (bessie != string::npos && bessie + 6 < unrestorable.size()) {
+    // The string token becomes an identifier naming no variable.
+    unrestorable[bessie + 6] = static_cast<char>(StreamTokenizer::IDENTIFIER);
+  }
+  Interpreter unchanged;
+  unchanged.EvalString("int z = 9;");
+  string env_before = CanonicalEnv(unchanged);
+  bool threw;
+  ostringstream errors;
+  streambuf *cerr_buf = cerr.rdbuf(errors.rdbuf());
+  Check(altered != saved, "cannot find the encoded value of i to alter");
+  WriteFile(snapshot, altered);
+  Check(!unchanged.LoadSnapshot(snapshot),
+        "loaded a snapshot with an altered value");
+  WriteFile(snapshot, unrestorable);
+  Check(!unchanged.LoadSnapshot(snapshot) && errors.str().empty(),
+        "loaded a snapshot with an altered token, or began restoring it");
+  WriteFile(snapshot, saved.substr(0, saved.size() / 2));
+  Check(!unchanged.LoadSnapshot(snapshot), "loaded a truncated snapshot");
+  cerr.rdbuf(cerr_buf);
+  Check(CanonicalEnv(unchanged) == env_before,
+        "a rejected snapshot changed the environment to\n" +
+        CanonicalEnv(unchanged));
+
+  // A snapshot of a file that has changed since is stale.
+  WriteFile(snapshot, saved);
+  WriteFile(config, contents + "int j = 7;\n");
+  Interpreter stale;
+  Check(!stale.LoadSnapshot(snapshot), "loaded a stale snapshot");
+  Check(CanonicalEnv(stale).empty(),
+        "a stale snapshot changed the environment");
+  EvalCapturingErrors(&stale, config, &threw);
+  int j = 0;
+  Check(stale.Get("j", &j) && j == 7,
+        "cannot evaluate " + config + " after rejecting its snapshot");
+}
+
+/// Checks that reloading a file after editing one statement (see
+/// Interpreter::Reload) rebuilds only the objects that statement
+/// affects, and that a reload that fails leaves the environment as it
+/// was.
+static void CheckReload(const string &dir) {
+  string config = dir + "/reload.infact";
+  WriteFile(config,
+            "int n = 1;\n"
+            "a = Cow(name(\"Bessie\"), age(n));\n"
+            "b = Cow(name(\"Daisy\"));\n"
+            "Animal[] pets = {b};\n");
+  Interpreter interpreter;
+  Check(interpreter.EvalReloadable(config), "cannot evaluate " + config);
+  shared_ptr<Animal> a;
+  shared_ptr<Animal> b;
+  interpreter.Get("a", &a);
+  interpreter.Get("b", &b);
+
+  WriteFile(config,
+            "int n = 1;\n"
+            "a = Cow(name(\"Bessie\"), age(n));\n"
+            "b = Cow(name(\"Daisy\"), age(3));\n"
+            "Animal[] pets = {b};\n");
+  vector<string> rebuilt;
+  Check(interpreter.Reload(&rebuilt), "cannot reload " + config);
+  shared_ptr<Animal> reloaded_a;
+  shared_ptr<Animal> reloaded_b;
+  vector<shared_ptr<Animal> > pets;
+  Check(interpreter.Get("a", &reloaded_a) && reloaded_a == a,
+        "reload rebuilt unchanged object a");
+  Check(interpreter.Get("b", &reloaded_b) && reloaded_b != b &&
+        reloaded_b->age() == 3,
+        "reload did not rebuild edited object b");
+  Check(interpreter.Get("pets", &pets) && pets.size() == 1 &&
+        pets[0] == reloaded_b,
+        "reload did not rebuild pets, which refers to b");
+  Check(rebuilt.size() == 2 && rebuilt[0] == "b" && rebuilt[1] == "pets",
+        "reload did not report rebuilding exactly b and pets");
+
+  // A reload that fails leaves the environment as it was.
+  WriteFile(config,
+            "int n = 1;\n"
+            "a = Cow(name(\"Bessie\"), age(n));\n"
+            "b = Cow(age(4));\n"
+            "Animal[] pets = {b};\n");
+  bool reloaded;
+  ostringstream errors;
+  streambuf *cerr_buf = cerr.rdbuf(errors.rdbuf());
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    reloaded = interpreter.Reload();
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::exception &e) {
+    reloaded = false;
+  }
+#endif
+  cerr.rdbuf(cerr_buf);
+  shared_ptr<Animal> unchanged_b;
+  Check(!reloaded, "reloaded a file with an error");
+  Check(interpreter.Get("b", &unchanged_b) && unchanged_b == reloaded_b,
+        "a failed reload changed the environment");
+}
+
+/// Checks that forks (see Interpreter::Fork) of a base interpreter hide
+/// its variables without changing them, and may be created and used
+/// concurrently, whether or not the base was evaluated lazily.
+static void CheckForks() {
+  const string base_statements =
+      "int threshold = 5;\n"
+      "string label = \"base\";\n"
+      "c = Cow(name(\"Bessie\"), age(threshold));\n";
+  Interpreter base;
+  base.EvalString(base_statements);
+  shared_ptr<Animal> base_c;
+  base.Get("c", &base_c);
+  {
+    unique_ptr<Interpreter> fork = base.Fork();
+    fork->EvalString("int threshold = 7;\nstring label = \"fork\";\n");
+    int threshold = 0;
+    shared_ptr<Animal> c;
+    Check(fork->Get("threshold", &threshold) && threshold == 7,
+          "a fork's own value did not hide that of its base");
+    Check(base.Get("threshold", &threshold) && threshold == 5,
+          "setting a variable in a fork changed its base");
+    Check(fork->Get("c", &c) && c == base_c,
+          "a fork did not share the object of its base");
+
+    // Taking a variable of the base from a fork yields its value without
+    // removing it, and taking the fork's own value reveals the base's.
+    shared_ptr<Animal> taken;
+    Check(fork->Take("c", &taken) && taken == base_c &&
+          base.Get("c", &c) && c == base_c && fork->Get("c", &c) &&
+          c == base_c,
+          "taking a variable of its base from a fork removed it");
+    string label;
+    Check(fork->Take("label", &label) && label == "fork" &&
+          fork->Get("label", &label) && label == "base" &&
+          base.Get("label", &label) && label == "base",
+          "taking a fork's own variable did not reveal that of its base");
+  }
+
+  // Many forks are evaluated concurrently against an eager base and a
+  // lazy one, whose objects are each constructed once, on first use.
+  Interpreter lazy_base;
+  lazy_base.SetLazy(true);
+  lazy_base.EvalString(base_statements);
+  for (Interpreter *shared_base : {&base, &lazy_base}) {
+    std::atomic<int> num_wrong(0);
+    std::atomic<Animal *> seen_c(nullptr);
+    vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+      threads.push_back(std::thread([&, t]() {
+          for (int i = 0; i < 50; ++i) {
+            int age = t * 100 + i;
+            unique_ptr<Interpreter> fork = shared_base->Fork();
+            fork->EvalString("int threshold = " + std::to_string(age) +
+                             ";\nd = Cow(name(\"Daisy\"), age(threshold));\n");
+            shared_ptr<Animal> c;
+            shared_ptr<Animal> d;
+            Animal *expected = nullptr;
+            if (!fork->Get("d", &d) || d->age() != age ||
+                !fork->Get("c", &c) || c->age() != 5 ||
+                (!seen_c.compare_exchange_strong(expected, c.get()) &&
+                 expected != c.get())) {
+              ++num_wrong;
+            }
+          }
+        }));
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    string mode = shared_base == &base ? "eager" : "lazy";
+    Check(num_wrong == 0,
+          "concurrent forks of a " + mode + " base saw wrong values");
+  }
+}
+
+/// Checks that identical specs of a memoized type (see
+/// FactoryConstructible::kMemoized) share an instance while it lives, and
+/// that specs differing in the values of the variables they refer to do
+/// not.
+static void CheckMemoization() {
+  Interpreter interpreter;
+  interpreter.EvalString(
+      "int i = 3;\n"
+      "pal = Cow(name(\"Pal\"));\n"
+      "a = MemoCow(name(\"Bess\"), age(i), pal(pal));\n"
+      "b = MemoCow(name(\"Bess\"), age(i), pal(pal));\n"
+      "spaced = MemoCow( name ( \"Bess\" ),age(i),\n  pal(pal) );\n"
+      "pal = Cow(name(\"Pal\"));\n"
+      "c = MemoCow(name(\"Bess\"), age(i), pal(pal));\n");
+  shared_ptr<Animal> a;
+  shared_ptr<Animal> b;
+  shared_ptr<Animal> spaced;
+  shared_ptr<Animal> c;
+  Check(interpreter.Get("a", &a) && interpreter.Get("b", &b) && a == b,
+        "identical memoized specs did not share an instance");
+  Check(interpreter.Get("spaced", &spaced) && spaced == a,
+        "memoized specs differing only in whitespace did not share an "
+        "instance");
+  Check(interpreter.Get("c", &c) && c != a,
+        "a memoized spec referring to a reassigned object variable shared "
+        "an instance");
+
+  // Once no instance of a spec is left, the spec yields a new one.
+  const string ephemeral = "e = MemoCow(name(\"Ephemeral\"));";
+  int num_constructed = 0;
+  {
+    Interpreter first;
+    first.EvalString(ephemeral);
+    num_constructed = MemoCow::num_constructed;
+    Interpreter second;
+    second.EvalString(ephemeral);
+    Check(MemoCow::num_constructed == num_constructed,
+          "a memoized spec with a live instance yielded a new one");
+  }
+  Interpreter third;
+  third.EvalString(ephemeral);
+  shared_ptr<Animal> e;
+  Check(MemoCow::num_constructed == num_constructed + 1 &&
+        third.Get("e", &e) && e->name() == "Ephemeral",
+        "a memoized spec whose instance expired did not yield a new one");
+}
+
 int
 main(int argc, char **argv) {
   cout << "Here is a list of abstract types and the concrete implementations\n"
@@ -75,7 +673,27 @@ main(int argc, char **argv) {
   cout << "\n\nEnvironment: " << endl;
   interpreter.PrintEnv(cout);
 
+  cout << "\nNow checking other modes of evaluation." << endl;
+  char dir[] = "/tmp/interpreter-test-XXXXXX";
+  if (mkdtemp(dir) == nullptr) {
+    Check(false, "cannot create a temporary directory");
+  } else {
+    CheckParallelEvaluation(dir);
+    CheckLazyEvaluation(dir);
+    CheckSnapshots(dir);
+    CheckReload(dir);
+    for (const string &filename : written_files) {
+      unlink(filename.c_str());
+    }
+    rmdir(dir);
+  }
+  CheckForks();
+  CheckMemoization();
+  cout << (num_failures == 0 ? "All checks passed." : "Some checks failed.")
+       << endl;
+
   cout << "\nHave a nice day!\n" << endl;
+  return num_failures == 0 ? 0 : 1;
 }
 
 /// \mainpage InFact Framework
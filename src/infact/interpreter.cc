@@ -33,17 +33,69 @@
 /// Interpreter implementation.
 /// Author: dbikel@google.com (Dan Bikel)
 
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <iterator>
+#include <queue>
+#include <spawn.h>
 #include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
 
 #include "error.h"
+#include "factory.h"
 #include "interpreter.h"
 
 using namespace std;
 
+extern char **environ;
+
 namespace infact {
 
 using std::ostringstream;
 
+MappedFileBuffer::~MappedFileBuffer() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+}
+
+unique_ptr<FileBuffer>
+MappedFileBuffer::Open(const string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return unique_ptr<FileBuffer>();
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    close(fd);
+    return unique_ptr<FileBuffer>();
+  }
+  size_t size = file_stat.st_size;
+  void *data = nullptr;
+  // It is an error to map zero bytes, so empty files simply have no mapping.
+  if (size > 0) {
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return unique_ptr<FileBuffer>();
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+  }
+  // The mapping remains valid after the file descriptor is closed.
+  close(fd);
+  return unique_ptr<FileBuffer>(new MappedFileBuffer(data, size));
+}
+
 // TODO(dbikel): Use std::make_unique here when we start using C++14.
 unique_ptr<istream>
 DefaultIStreamBuilder::Build(const string &filename,
@@ -51,24 +103,478 @@ DefaultIStreamBuilder::Build(const string &filename,
   return unique_ptr<istream>(new std::ifstream(filename, mode));
 }
 
+unique_ptr<FileBuffer>
+DefaultIStreamBuilder::BuildBuffer(const string &filename) const {
+  return MappedFileBuffer::Open(filename);
+}
+
+bool
+DefaultIStreamBuilder::Stat(const string &filename, FileStamp *stamp) const {
+  stamp->valid = false;
+  struct stat file_stat;
+  if (stat(filename.c_str(), &file_stat) != 0 ||
+      S_ISDIR(file_stat.st_mode) || access(filename.c_str(), R_OK) != 0) {
+    return false;
+  }
+  if (!S_ISREG(file_stat.st_mode)) {
+    // A FIFO or device such as /dev/stdin can be read, but not identified
+    // by its stamp, so it is left invalid and the file is never cached.
+    return true;
+  }
+  stamp->valid = true;
+  stamp->device = file_stat.st_dev;
+  stamp->inode = file_stat.st_ino;
+  stamp->size = file_stat.st_size;
+  stamp->mtime_ns =
+      static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000 +
+      file_stat.st_mtim.tv_nsec;
+  return true;
+}
+
+namespace {
+
+/// A FileBuffer sharing the contents of another.
+class SharedFileBuffer : public FileBuffer {
+ public:
+  explicit SharedFileBuffer(shared_ptr<const FileBuffer> buffer) :
+      buffer_(std::move(buffer)) { }
+
+  const char *data() const override { return buffer_->data(); }
+  size_t size() const override { return buffer_->size(); }
+
+ private:
+  shared_ptr<const FileBuffer> buffer_;
+};
+
+/// Returns whether the specified character ends a number, reserved word
+/// or identifier token.
+bool EndsWord(char c) {
+  return isspace(static_cast<unsigned char>(c)) || c == '"' ||
+      strchr(DEFAULT_RESERVED_CHARS, c) != nullptr;
+}
+
+/// Appends the names of the files imported by the specified contents of
+/// a file to the specified vector.  This is a lightweight scan, rather
+/// than a full tokenization, that never fails: a malformed file simply
+/// yields fewer imports, and its errors are reported when it is
+/// evaluated.
+void ScanImports(const char *data, size_t size, vector<string> *imports) {
+  const char *end = data + size;
+  bool after_import = false;
+  for (const char *p = data; p < end; ) {
+    if (isspace(static_cast<unsigned char>(*p))) {
+      ++p;
+    } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+      while (p < end && *p != '\n') {
+        ++p;
+      }
+    } else if (*p == '"') {
+      string literal;
+      for (++p; p < end && *p != '"'; ++p) {
+        if (*p == '\\' && p + 1 < end) {
+          ++p;
+        }
+        literal += *p;
+      }
+      if (p < end && after_import) {
+        imports->push_back(literal);
+      }
+      ++p;
+      after_import = false;
+    } else if (EndsWord(*p)) {
+      ++p;
+      after_import = false;
+    } else {
+      const char *word = p;
+      while (p < end && !EndsWord(*p)) {
+        ++p;
+      }
+      after_import = p - word == 6 && memcmp(word, "import", 6) == 0;
+    }
+  }
+}
+
+/// Returns the specified number of characters of the specified file
+/// starting at the specified position (or fewer, if the file ends
+/// first), by opening it again with the specified builder.  This is how
+/// the context of an error in a file read as an istream is recovered
+/// without retaining all the characters of its line while tokenizing.
+string RereadFile(const IStreamBuilder &istream_builder,
+                  const string &filename, size_t start, size_t length) {
+  unique_ptr<FileBuffer> buffer = istream_builder.BuildBuffer(filename);
+  if (buffer != nullptr) {
+    return start < buffer->size() ?
+        string(buffer->data() + start,
+               std::min(length, buffer->size() - start)) : string();
+  }
+  unique_ptr<istream> file = istream_builder.Build(filename);
+  if (!file->seekg(start)) {
+    // The stream may not be seekable, as when it is decompressed.
+    file = istream_builder.Build(filename);
+    file->ignore(start);
+  }
+  string characters(length, '\0');
+  file->read(&characters[0], length);
+  characters.resize(file->gcount());
+  return characters;
+}
+
+}  // namespace
+
+PrefetchingIStreamBuilder::~PrefetchingIStreamBuilder() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+  }
+  work_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+unique_ptr<FileBuffer>
+PrefetchingIStreamBuilder::BuildBuffer(const string &filename) const {
+  shared_ptr<Task> task;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = pending_.find(filename);
+    if (it != pending_.end()) {
+      task = it->second;
+      for (const string &candidate : task->candidates) {
+        pending_.erase(candidate);
+      }
+      // A prefetch not yet started is not waited for: the file is read
+      // here instead.
+      if (!task->started) {
+        task->started = true;
+        task.reset();
+      }
+    }
+  }
+  shared_ptr<const FileBuffer> buffer;
+  if (task != nullptr) {
+    const Fetched &fetched = task->future.get();
+    // A prefetched copy is used only if the file is unchanged since it
+    // was read, or if the wrapped builder cannot tell.
+    FileStamp stamp;
+    if (fetched.filename == filename && fetched.buffer != nullptr &&
+        builder_->Stat(filename, &stamp) &&
+        (stamp.valid ? stamp == fetched.stamp : !fetched.stamp.valid)) {
+      buffer = fetched.buffer;
+    }
+  }
+  if (buffer == nullptr) {
+    buffer = Fetch(vector<string>(1, filename)).buffer;
+    if (buffer == nullptr) {
+      return unique_ptr<FileBuffer>();
+    }
+  }
+  return unique_ptr<FileBuffer>(new SharedFileBuffer(std::move(buffer)));
+}
+
+void
+PrefetchingIStreamBuilder::Prefetch(const string &filename) const {
+  Prefetch(vector<string>(1, filename));
+}
+
+PrefetchingIStreamBuilder::Fetched
+PrefetchingIStreamBuilder::Fetch(const vector<string> &candidates) const {
+  Fetched fetched;
+  fetched.candidates = candidates;
+  for (const string &candidate : candidates) {
+    if (!builder_->Stat(candidate, &fetched.stamp)) {
+      continue;
+    }
+    fetched.filename = candidate;
+    fetched.buffer = builder_->BuildBuffer(candidate);
+    if (fetched.buffer == nullptr) {
+      unique_ptr<istream> file =
+          builder_->Build(candidate,
+                          std::ios_base::in | std::ios_base::binary);
+      fetched.buffer = StringFileBuffer::Read(*file);
+    } else {
+      // A mapped file is read only when its pages are first touched, so
+      // they are touched here, rather than when the file is evaluated.
+      volatile char sink = 0;
+      const char *data = fetched.buffer->data();
+      for (size_t i = 0; i < fetched.buffer->size(); i += 4096) {
+        sink = sink + data[i];
+      }
+    }
+    PrefetchImports(candidate, *fetched.buffer);
+    break;
+  }
+  return fetched;
+}
+
+void
+PrefetchingIStreamBuilder::Prefetch(const vector<string> &candidates) const {
+  std::lock_guard<std::mutex> lock(mu_);
+  if (stopping_ || num_threads_ == 0) {
+    return;
+  }
+  for (const string &candidate : candidates) {
+    if (pending_.count(candidate) != 0) {
+      return;
+    }
+  }
+  shared_ptr<Task> task = std::make_shared<Task>();
+  task->candidates = candidates;
+  task->future = task->promise.get_future().share();
+  queue_.push_back(task);
+  for (const string &candidate : candidates) {
+    pending_[candidate] = task;
+  }
+  if (queue_.size() > num_idle_ && workers_.size() < num_threads_) {
+    try {
+      workers_.push_back(std::thread([this]() { Work(); }));
+    } catch (std::system_error &e) {
+      // Prefetching is only an optimization, so a file that cannot be
+      // read in the background is simply read when it is needed.
+    }
+  }
+  work_.notify_one();
+}
+
+void
+PrefetchingIStreamBuilder::PrefetchImports(const string &filename,
+                                           const FileBuffer &buffer) const {
+  vector<string> imports;
+  ScanImports(buffer.data(), buffer.size(), &imports);
+  // Imports are resolved just as by Interpreter::FindFile: relative to
+  // the importing file first, and then to the working directory.
+  size_t slash_pos = filename.rfind('/');
+  for (const string &import : imports) {
+    vector<string> candidates;
+    if (slash_pos != string::npos && !import.empty() && import[0] != '/') {
+      candidates.push_back(filename.substr(0, slash_pos + 1) + import);
+    }
+    candidates.push_back(import);
+    Prefetch(candidates);
+  }
+}
+
+void
+PrefetchingIStreamBuilder::Work() const {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    ++num_idle_;
+    work_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+    --num_idle_;
+    if (stopping_) {
+      return;
+    }
+    shared_ptr<Task> task = std::move(queue_.front());
+    queue_.pop_front();
+    if (task->started) {
+      continue;
+    }
+    task->started = true;
+    lock.unlock();
+    // An error is rethrown if and when BuildBuffer takes this prefetch.
+    try {
+      task->promise.set_value(Fetch(task->candidates));
+    } catch (...) {
+      task->promise.set_exception(std::current_exception());
+    }
+    lock.lock();
+  }
+}
+
+DecompressingIStreamBuilder::DecompressingIStreamBuilder(
+    unique_ptr<IStreamBuilder> builder) : builder_(std::move(builder)) {
+  SetDecompressor(".gz", {"gzip", "-dc", "--"});
+  SetDecompressor(".xz", {"xz", "-dc", "--"});
+  SetDecompressor(".zst", {"zstd", "-dcq", "--"});
+}
+
+unique_ptr<istream>
+DecompressingIStreamBuilder::Build(const string &filename,
+                                   std::ios_base::openmode mode) const {
+  const vector<string> *command = Decompressor(filename);
+  if (command == nullptr) {
+    return builder_->Build(filename, mode);
+  }
+  return unique_ptr<istream>(
+      new std::istringstream(Decompress(filename, *command), mode));
+}
+
+unique_ptr<FileBuffer>
+DecompressingIStreamBuilder::BuildBuffer(const string &filename) const {
+  const vector<string> *command = Decompressor(filename);
+  if (command == nullptr) {
+    return builder_->BuildBuffer(filename);
+  }
+  return unique_ptr<FileBuffer>(
+      new StringFileBuffer(Decompress(filename, *command)));
+}
+
+const vector<string> *
+DecompressingIStreamBuilder::Decompressor(const string &filename) const {
+  for (const auto &decompressor : decompressors_) {
+    const string &suffix = decompressor.first;
+    if (filename.size() > suffix.size() &&
+        filename.compare(filename.size() - suffix.size(), suffix.size(),
+                         suffix) == 0) {
+      return &decompressor.second;
+    }
+  }
+  return nullptr;
+}
+
+string
+DecompressingIStreamBuilder::Decompress(const string &filename,
+                                        const vector<string> &command) const {
+  vector<string> args(command);
+  args.push_back(filename);
+  vector<char *> argv;
+  for (string &arg : args) {
+    argv.push_back(&arg[0]);
+  }
+  argv.push_back(nullptr);
+
+  int fds[2];
+  // Both ends of the pipe are closed on exec, so that a decompressor
+  // spawned concurrently by another thread cannot hold the write end open
+  // (and so delay the end of this file); the child's standard output is a
+  // duplicate, which stays open.
+  if (args.size() < 2 || pipe2(fds, O_CLOEXEC) != 0) {
+    Error("infact::DecompressingIStreamBuilder: error: cannot run "
+          "decompressor for file \"" + filename + "\"");
+    return "";
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  pid_t pid;
+  int spawn_error = posix_spawnp(&pid, argv[0], &actions, nullptr,
+                                 argv.data(), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+  if (spawn_error != 0) {
+    close(fds[0]);
+    Error("infact::DecompressingIStreamBuilder: error: cannot run \"" +
+          args[0] + "\" to decompress file \"" + filename + "\"");
+    return "";
+  }
+
+  // The decompressed contents are read as they are produced.
+  string contents;
+  char chunk[1 << 16];
+  int read_error = 0;
+  for (;;) {
+    ssize_t num_read = read(fds[0], chunk, sizeof(chunk));
+    if (num_read > 0) {
+      contents.append(chunk, num_read);
+    } else if (num_read == 0) {
+      break;
+    } else if (errno != EINTR) {
+      read_error = errno;
+      break;
+    }
+  }
+  // Closing the pipe first ends a decompressor still writing to it, so
+  // that it is reaped even after a read error.
+  close(fds[0]);
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (read_error != 0) {
+    Error("infact::DecompressingIStreamBuilder: error: cannot read output "
+          "of \"" + args[0] + "\" decompressing file \"" + filename + "\": " +
+          strerror(read_error));
+    return "";
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    Error("infact::DecompressingIStreamBuilder: error: \"" + args[0] +
+          "\" failed to decompress file \"" + filename + "\"");
+  }
+  return contents;
+}
+
+const shared_ptr<ImportCache> &
+ImportCache::Global() {
+  static const shared_ptr<ImportCache> global_cache(new ImportCache());
+  return global_cache;
+}
+
+shared_ptr<const ImportCache::Entry>
+ImportCache::Insert(const string &filename, const FileStamp &stamp,
+                    string contents) {
+  // Files are tokenized outside the lock, so that several may be
+  // tokenized concurrently.
+  shared_ptr<Entry> entry = std::make_shared<Entry>();
+  entry->stamp = stamp;
+  entry->contents = std::move(contents);
+  StreamTokenizer st(entry->contents.data(), entry->contents.size());
+  while (st.HasNext()) {
+    entry->tokens.push_back(st.PeekToken());
+    st.Next();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Remove(filename);
+  size_t bytes = entry->bytes();
+  if (bytes <= capacity_) {
+    Evict(capacity_ - bytes);
+    lru_.push_front(filename);
+    Slot &slot = entries_[filename];
+    slot.entry = entry;
+    slot.lru_it = lru_.begin();
+    bytes_ += bytes;
+  }
+  return entry;
+}
+
+void
+ImportCache::Remove(const string &filename) {
+  unordered_map<string, Slot>::iterator it = entries_.find(filename);
+  if (it != entries_.end()) {
+    bytes_ -= it->second.entry->bytes();
+    lru_.erase(it->second.lru_it);
+    entries_.erase(it);
+  }
+}
+
+void
+ImportCache::Evict(size_t max_bytes) {
+  while (bytes_ > max_bytes && !lru_.empty()) {
+    Remove(lru_.back());
+  }
+}
+
+Interpreter::Interpreter(Interpreter *parent) :
+    env_(parent->env_->Fork()),
+    istream_builder_(parent->istream_builder_),
+    import_cache_(parent->import_cache_),
+    streaming_(parent->streaming_),
+    num_threads_(parent->num_threads_),
+    lazy_(parent->lazy_),
+    profiler_(parent->profiler_),
+    debug_(parent->debug_) {
+  // Files named by load(...) literals evaluated by the fork are resolved
+  // relative to the files it is evaluating.
+  env_->SetFileLoader([this](const string &filename) {
+      return LoadFile(filename);
+    });
+}
+
 bool
 Interpreter::IsAbsolute(const string &filename) const {
   return filename.length() > 0 && filename[0] == '/';
 }
 
 bool
-Interpreter::CanReadFile(const string &filename) const {
-  unique_ptr<istream> file = istream_builder_->Build(filename);
-  return file->good();
+Interpreter::CanReadFile(const string &filename, FileStamp *stamp) const {
+  return istream_builder_->Stat(filename, stamp);
 }
 
 bool
 Interpreter::CanReadFile(const string &f1, const string &f2,
-                         string *filename) const {
-  if (CanReadFile(f1)) {
+                         string *filename, FileStamp *stamp) const {
+  if (CanReadFile(f1, stamp)) {
     *filename = f1;
     return true;
-  } else if (CanReadFile(f2)) {
+  } else if (f2 != f1 && CanReadFile(f2, stamp)) {
     *filename = f2;
     return true;
   } else {
@@ -76,6 +582,65 @@ Interpreter::CanReadFile(const string &f1, const string &f2,
   }
 }
 
+bool
+Interpreter::FindFile(const string &filename, string *found,
+                      string *relative_filename, FileStamp *stamp) const {
+  // Test to see if the named file exists.  If the path is not
+  // absolute, we try to get the dirname of current file, if it
+  // exists, and create a relative path, which takes precedence
+  // over a path relative to the current working directory.
+  relative_filename->clear();
+  if (!IsAbsolute(filename)) {
+    size_t slash_pos = curr_filename().rfind('/');
+    if (slash_pos != string::npos) {
+      string dirname = curr_filename().substr(0, slash_pos);
+      *relative_filename = dirname + '/' + filename;
+    }
+  }
+  const string &first =
+      relative_filename->empty() ? filename : *relative_filename;
+  if (!CanReadFile(first, filename, found, stamp)) {
+    return false;
+  }
+  if (debug_ >= 1) {
+    std::cerr << "infact::Interpreter: tested paths \""
+              << first << "\" and \"" << filename
+              << "\" and found that \"" << *found
+              << "\" exists and is readable\n";
+  }
+  return true;
+}
+
+shared_ptr<const FileBuffer>
+Interpreter::LoadFile(const string &filename) const {
+  string relative_filename;
+  string found;
+  FileStamp stamp;
+  if (!FindFile(filename, &found, &relative_filename, &stamp)) {
+    ostringstream err_ss;
+    err_ss << "infact::Interpreter: error: cannot load file \"";
+    if (!relative_filename.empty()) {
+      err_ss << relative_filename << "\" or \"";
+    }
+    err_ss << filename << "\" (or file does not exist)";
+    Error(err_ss.str());
+  }
+  if (recording_ != nullptr) {
+    recording_->files.push_back(found);
+  }
+  // Files are mapped into memory when the IStreamBuilder can do so, and
+  // otherwise read in their entirety.
+  shared_ptr<const FileBuffer> buffer(istream_builder_->BuildBuffer(found));
+  if (buffer == nullptr) {
+    unique_ptr<istream> file =
+        istream_builder_->Build(found,
+                                std::ios_base::in | std::ios_base::binary);
+    buffer = StringFileBuffer::Read(*file);
+  }
+  RecordLoad(found, *buffer);
+  return buffer;
+}
+
 bool
 Interpreter::HasCycle(const string &filename,
                       const vector<string> &filenames) const {
@@ -89,7 +654,8 @@ Interpreter::HasCycle(const string &filename,
 
 void
 Interpreter::Eval(const string &filename) {
-  if (!CanReadFile(filename)) {
+  FileStamp stamp;
+  if (!CanReadFile(filename, &stamp)) {
     ostringstream err_ss;
     err_ss << "infact::Interpreter: error: cannot read file "
            << "\"" << filename << "\" (or file does not exist)\n";
@@ -103,10 +669,85 @@ Interpreter::Eval(const string &filename) {
 // files.
 void
 Interpreter::EvalFile(const string &filename) {
+  if (recording_ != nullptr) {
+    recording_->files.push_back(filename);
+  }
+  int64_t start = profiler_ != nullptr ? profiler_->Now() : 0;
+  filenames_.push_back(filename);
+  unique_ptr<FileBuffer> buffer = istream_builder_->BuildBuffer(filename);
+  if (buffer != nullptr) {
+    StreamTokenizer st(buffer->data(), buffer->size());
+    Eval(st);
+  } else {
+    unique_ptr<istream> file = istream_builder_->Build(curr_filename());
+    if (!file->good()) {
+      ostringstream err_ss;
+      err_ss << "infact::Interpreter: error: cannot read file "
+             << "\"" << filename << "\"\n";
+      Error(err_ss.str());
+    }
+    StreamTokenizer st(*file);
+    shared_ptr<IStreamBuilder> istream_builder = istream_builder_;
+    st.set_reread([istream_builder, filename](size_t start, size_t length) {
+      return RereadFile(*istream_builder, filename, start, length);
+    });
+    Eval(st);
+  }
+  filenames_.pop_back();
+  if (profiler_ != nullptr) {
+    profiler_->RecordFile(filename, start, profiler_->Now());
+  }
+}
+
+void
+Interpreter::EvalImportedFile(const string &filename, const FileStamp &stamp) {
+  if (import_cache_ == nullptr || !stamp.valid) {
+    EvalFile(filename);
+    return;
+  }
+  shared_ptr<const ImportCache::Entry> entry =
+      import_cache_->Find(filename, stamp);
+  if (entry == nullptr) {
+    string contents;
+    unique_ptr<FileBuffer> buffer = istream_builder_->BuildBuffer(filename);
+    if (buffer != nullptr) {
+      contents.assign(buffer->data(), buffer->size());
+    } else {
+      unique_ptr<istream> file = istream_builder_->Build(filename);
+      contents.assign(std::istreambuf_iterator<char>(*file),
+                      std::istreambuf_iterator<char>());
+    }
+    int64_t start = profiler_ != nullptr ? profiler_->Now() : 0;
+#ifdef INFACT_THROW_EXCEPTIONS
+    try {
+#endif
+      entry = import_cache_->Insert(filename, stamp, std::move(contents));
+      if (profiler_ != nullptr) {
+        profiler_->RecordTokenize(filename, start, profiler_->Now());
+      }
+#ifdef INFACT_THROW_EXCEPTIONS
+    } catch (std::runtime_error &e) {
+      // A file that cannot be tokenized is evaluated without the cache,
+      // so that its statements preceding the error are still evaluated.
+      EvalFile(filename);
+      return;
+    }
+#endif
+  }
+  // The cached tokens are replayed, with stream positions (and lines for
+  // error messages) taken from the cached contents.
+  if (recording_ != nullptr) {
+    recording_->files.push_back(filename);
+  }
+  int64_t start = profiler_ != nullptr ? profiler_->Now() : 0;
   filenames_.push_back(filename);
-  unique_ptr<istream> file = istream_builder_->Build(curr_filename());
-  Eval(*file);
+  StreamTokenizer st(entry->contents.data(), entry->contents.size(),
+                     entry->tokens.data(), entry->tokens.size());
+  Eval(st);
   filenames_.pop_back();
+  if (profiler_ != nullptr) {
+    profiler_->RecordFile(filename, start, profiler_->Now());
+  }
 }
 
 void
@@ -129,40 +770,19 @@ Interpreter::Import(StreamTokenizer &st) {
 
   // Grab the string naming the file to be imported.
   string original_import_filename = st.Next();
-  string relative_import_filename = original_import_filename;
-
-  // Test to see if the named file exists.  If the path is not
-  // absolute, we try to get the dirname of current file, if it
-  // exists, and create a relative path, which takes precedence
-  // over a path relative to the current working directory.
-  bool relative = false;
-  if (!IsAbsolute(original_import_filename)) {
-    size_t slash_pos = curr_filename().rfind('/');
-    if (slash_pos != string::npos) {
-      string dirname = curr_filename().substr(0, slash_pos);
-      relative_import_filename = dirname + '/' + original_import_filename;
-      relative = true;
-    }
-  }
-
+  string relative_import_filename;
   string import_filename;
-  if (!CanReadFile(relative_import_filename, original_import_filename,
-                   &import_filename)) {
+  FileStamp stamp;
+  if (!FindFile(original_import_filename, &import_filename,
+                &relative_import_filename, &stamp)) {
     ostringstream err_ss;
     err_ss << "infact::Interpreter: " << filestack(st, st.tellg())
            << "error: cannot read file \"";
-    if (relative) {
+    if (!relative_import_filename.empty()) {
       err_ss << relative_import_filename << "\" or \"";
     }
     err_ss << original_import_filename << "\" (or file does not exist)\n";
     Error(err_ss.str());
-  } else {
-    if (debug_ >= 1) {
-      std::cerr << "infact::Interpreter: tested paths \""
-                << relative_import_filename << "\" and \""
-                << original_import_filename << "\" and found that \""
-                << import_filename << "\" exists and is readable\n";
-    }
   }
 
   if (HasCycle(import_filename, filenames_)) {
@@ -173,9 +793,9 @@ Interpreter::Import(StreamTokenizer &st) {
     Error(err_ss.str());
   }
 
-  // Finally, evaluate file using the private EvalFile method.  The imported
-  // file gets interpreted using the current Environment.
-  EvalFile(import_filename);
+  // Finally, evaluate file using the private EvalImportedFile method.  The
+  // imported file gets interpreted using the current Environment.
+  EvalImportedFile(import_filename, stamp);
 
   if (st.Peek() != ";") {
     WrongTokenError(st, st.PeekTokenStart(), ";", st.Peek(),
@@ -188,88 +808,1038 @@ Interpreter::Import(StreamTokenizer &st) {
 
 void
 Interpreter::Eval(StreamTokenizer &st) {
+  if (recording_ != nullptr || reloading_ != nullptr) {
+    // Statements are recorded one at a time, as they are evaluated.
+  } else if (streaming_) {
+    st.EnableStreaming();
+  } else if (num_threads_ > 1 && !lazy_ && st.buffer() != nullptr) {
+    EvalParallel(st);
+    return;
+  }
   // Keeps reading import or assignment statements until there are no
   // more tokens.
   while (st.PeekTokenType() != StreamTokenizer::EOF_TYPE) {
 #ifdef INFACT_THROW_EXCEPTIONS
     try {
 #endif
-    StreamTokenizer::TokenType token_type = st.PeekTokenType();
     // First, see if we have an import statement.
-    if (token_type == StreamTokenizer::RESERVED_WORD && st.Peek() == "import") {
+    if (st.PeekTokenType() == StreamTokenizer::RESERVED_WORD &&
+        st.Peek() == "import") {
       Import(st);
       // Now continue this loop reading either assignment or import statements.
       continue;
     }
-    // Read variable name or type specifier.
-    VarMapBase *varmap = env_->GetVarMapForType(st.Peek());
-    bool is_type_specifier =  varmap != nullptr;
-    if (token_type != StreamTokenizer::IDENTIFIER && !is_type_specifier) {
-      string expected_type =
-          string(StreamTokenizer::TypeName(StreamTokenizer::IDENTIFIER)) +
-          " or type specifier";
-      string found_type = StreamTokenizer::TypeName(token_type);
-      WrongTokenTypeError(st, st.PeekTokenStart(), expected_type, found_type,
-                          st.Peek());
-    }
-
-    string type = "";
-    if (is_type_specifier) {
-      // Consume and remember the type specifier.
-      st.Next();              // Explicit type could be a concrete type.
-      type = varmap->Name();  // Remember the abstract type.
-
-      // Check that next token is a variable name.
-      StreamTokenizer::TokenType token_type = st.PeekTokenType();
-      if (token_type != StreamTokenizer::IDENTIFIER) {
-        WrongTokenTypeError(st, st.PeekTokenStart(),
-                            StreamTokenizer::IDENTIFIER, token_type, st.Peek());
+    EvalStatement(st, env_.get());
+#ifdef INFACT_THROW_EXCEPTIONS
+    }
+    catch (std::runtime_error &e) {
+      cerr << ExceptionReport(st, e.what()) << endl;
+      if (recording_ != nullptr) {
+        recording_->failed = true;
+      }
+      if (reloading_ != nullptr) {
+        reloading_->failed = true;
+      }
+      // For now, we simply give up.
+      break;
+    }
+#endif
+  }
+}
+
+void
+Interpreter::EvalStatement(StreamTokenizer &st, EnvironmentImpl *env) {
+  Profiler::Scope profile_scope(profiler_.get());
+  int64_t start = profiler_ != nullptr ? profiler_->Now() : 0;
+  StreamTokenizer::TokenType token_type = st.PeekTokenType();
+  // Read variable name or type specifier.
+  VarMapBase *varmap = env->GetVarMapForType(st.Peek());
+  bool is_type_specifier =  varmap != nullptr;
+  if (token_type != StreamTokenizer::IDENTIFIER && !is_type_specifier) {
+    string expected_type =
+        string(StreamTokenizer::TypeName(StreamTokenizer::IDENTIFIER)) +
+        " or type specifier";
+    string found_type = StreamTokenizer::TypeName(token_type);
+    WrongTokenTypeError(st, st.PeekTokenStart(), expected_type, found_type,
+                        st.Peek());
+  }
+
+  string type = "";
+  if (is_type_specifier) {
+    // Consume and remember the type specifier.
+    st.Next();              // Explicit type could be a concrete type.
+    type = varmap->Name();  // Remember the abstract type.
+
+    // Check that next token is a variable name.
+    StreamTokenizer::TokenType token_type = st.PeekTokenType();
+    if (token_type != StreamTokenizer::IDENTIFIER) {
+      WrongTokenTypeError(st, st.PeekTokenStart(),
+                          StreamTokenizer::IDENTIFIER, token_type, st.Peek());
+    }
+  }
+
+  string varname = st.Next();
+
+  // Next, read equals sign.
+  token_type = st.PeekTokenType();
+  if (st.Peek() != "=") {
+    WrongTokenError(st, st.PeekTokenStart(), "=", st.Peek(),
+                    st.PeekTokenType());
+  }
+
+  // Consume equals sign.
+  st.Next();
+
+  if (st.PeekTokenType() == StreamTokenizer::EOF_TYPE) {
+    ostringstream err_ss;
+    err_ss << "infact::Interpreter: " << filestack(st, st.tellg())
+           << "error: unexpected EOF";
+    Error(err_ss.str());
+  }
+
+  // Consume and set the value for this variable in the environment.
+  if (reloading_ != nullptr) {
+    EvalReloadableStatement(varname, type, st, env);
+  } else if (recording_ != nullptr) {
+    SnapshotRecord *record = BeginRecord(varname, type, st);
+    env->ReadAndSet(varname, st, type);
+    EndRecord(record, env);
+  } else if (lazy_ && !streaming_) {
+    env->ReadAndSetLazily(varname, st, type, curr_filename());
+  } else {
+    env->ReadAndSet(varname, st, type);
+  }
+
+  token_type = st.PeekTokenType();
+  if (st.Peek() != ";") {
+    WrongTokenError(st, st.PeekTokenStart(), ";", st.Peek(),
+                    st.PeekTokenType());
+  }
+  // Consume semicolon.
+  st.Next();
+  if (profiler_ != nullptr) {
+    profiler_->RecordStatement(curr_filename(), varname,
+                               profile_scope.constructed(), start,
+                               profiler_->Now());
+  }
+}
+
+struct Interpreter::ParallelStatement {
+  // The range of tokens of this statement.
+  size_t begin;
+  size_t end;
+  // The variable set by this statement, or the empty string if the
+  // statement is malformed.
+  string varname;
+  // The variables this statement refers to that are set by earlier
+  // statements, with the indices of those statements.
+  vector<pair<string, size_t> > inputs;
+  // The indices of the statements referring to the variable set by this
+  // statement.
+  vector<size_t> dependents;
+  // The number of statements setting this statement's inputs that have yet
+  // to be evaluated.
+  size_t num_pending = 0;
+  // Whether this statement was evaluated without error.
+  bool succeeded = false;
+  // The scope in which this statement is evaluated, which is a fork of
+  // the environment of the interpreter.
+  unique_ptr<EnvironmentImpl> scope;
+  // The exception thrown by this statement, if evaluated and failed, and
+  // the message to report for it.
+  std::exception_ptr exception;
+  string report;
+};
+
+void
+Interpreter::EvalParallel(StreamTokenizer &st) {
+  const char *data = st.buffer();
+  size_t size = st.buffer_size();
+  vector<StreamTokenizer::Token> tokens;
+  // An error tokenizing the input is reported only after the complete
+  // statements before it are evaluated, as it is when evaluating them
+  // in order.
+  string tokenizer_error;
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    while (st.HasNext()) {
+      tokens.push_back(st.PeekToken());
+      st.Next();
+    }
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::runtime_error &e) {
+    tokenizer_error = e.what();
+    // The statement during which the error occurred is incomplete.
+    while (!tokens.empty() &&
+           !(tokens.back().type == StreamTokenizer::RESERVED_CHAR &&
+             tokens.back().tok == ";")) {
+      tokens.pop_back();
+    }
+  }
+#endif
+
+  // Statements are evaluated concurrently in runs delimited by imports,
+  // which are evaluated in place.
+  vector<ParallelStatement> statements;
+  size_t begin = 0;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    bool is_semicolon = tokens[i].type == StreamTokenizer::RESERVED_CHAR &&
+                        tokens[i].tok == ";";
+    if (!is_semicolon && i + 1 < tokens.size()) {
+      continue;
+    }
+    size_t end = i + 1;
+    if (tokens[begin].type == StreamTokenizer::RESERVED_WORD &&
+        tokens[begin].tok == "import") {
+      if (!EvalStatements(data, size, tokens, &statements)) {
+        return;
+      }
+      statements.clear();
+      StreamTokenizer import_st(data, size, &tokens[begin], end - begin);
+#ifdef INFACT_THROW_EXCEPTIONS
+      try {
+#endif
+        Import(import_st);
+#ifdef INFACT_THROW_EXCEPTIONS
+      } catch (std::runtime_error &e) {
+        cerr << ExceptionReport(import_st, e.what()) << endl;
+        return;
+      }
+#endif
+    } else {
+      statements.push_back(ParallelStatement());
+      statements.back().begin = begin;
+      statements.back().end = end;
+    }
+    begin = end;
+  }
+  if (EvalStatements(data, size, tokens, &statements) &&
+      !tokenizer_error.empty()) {
+    cerr << ExceptionReport(st, tokenizer_error) << endl;
+  }
+}
+
+bool
+Interpreter::EvalStatements(const char *data, size_t size,
+                            const vector<StreamTokenizer::Token> &tokens,
+                            vector<ParallelStatement> *statements) {
+  if (statements->empty()) {
+    return true;
+  }
+
+  // A statement depends on the last earlier statement setting each
+  // variable it may refer to, which is any identifier after its equals
+  // sign that is not the name of a constructor or member, or any string
+  // (since a string naming a variable stands for its value); it cannot
+  // depend on a later statement, since each statement's variable is set
+  // in a scope of its own.
+  unordered_map<string, size_t> last_set;
+  for (size_t i = 0; i < statements->size(); ++i) {
+    ParallelStatement &statement = (*statements)[i];
+    const StreamTokenizer::Token *statement_tokens = &tokens[statement.begin];
+    size_t num_tokens = statement.end - statement.begin;
+    size_t equals = 1;
+    for (; equals < num_tokens && equals <= 2; ++equals) {
+      if (statement_tokens[equals].type == StreamTokenizer::RESERVED_CHAR &&
+          statement_tokens[equals].tok == "=") {
+        break;
+      }
+    }
+    if (equals < num_tokens && equals <= 2 &&
+        statement_tokens[equals - 1].type == StreamTokenizer::IDENTIFIER) {
+      statement.varname = statement_tokens[equals - 1].tok;
+    }
+    unordered_set<size_t> depends_on;
+    for (size_t j = equals + 1; j < num_tokens; ++j) {
+      const StreamTokenizer::Token &token = statement_tokens[j];
+      bool is_name =
+          j + 1 < num_tokens && statement_tokens[j + 1].tok == "(" &&
+          statement_tokens[j + 1].type == StreamTokenizer::RESERVED_CHAR;
+      if ((token.type != StreamTokenizer::IDENTIFIER || is_name) &&
+          token.type != StreamTokenizer::STRING) {
+        continue;
+      }
+      unordered_map<string, size_t>::const_iterator it =
+          last_set.find(token.tok);
+      if (it == last_set.end() || !depends_on.insert(it->second).second) {
+        continue;
+      }
+      statement.inputs.push_back(make_pair(token.tok, it->second));
+      (*statements)[it->second].dependents.push_back(i);
+      ++statement.num_pending;
+    }
+    if (!statement.varname.empty()) {
+      last_set[statement.varname] = i;
+    }
+    statement.scope.reset(env_->Fork());
+  }
+
+  // Threads take the first statement whose inputs have all been set, and
+  // skip those after a failed statement, which would never have been
+  // evaluated in order.
+  std::mutex mutex;
+  std::condition_variable ready_cv;
+  std::priority_queue<size_t, vector<size_t>, std::greater<size_t> > ready;
+  size_t num_done = 0;
+  size_t first_failed = statements->size();
+  for (size_t i = 0; i < statements->size(); ++i) {
+    if ((*statements)[i].num_pending == 0) {
+      ready.push(i);
+    }
+  }
+  auto evaluate = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      ready_cv.wait(lock, [&]() {
+          return !ready.empty() || num_done == statements->size();
+        });
+      if (ready.empty()) {
+        return;
+      }
+      size_t i = ready.top();
+      ready.pop();
+      ParallelStatement &statement = (*statements)[i];
+      bool skip = i > first_failed;
+      for (const pair<string, size_t> &input : statement.inputs) {
+        skip = skip || !(*statements)[input.second].succeeded;
+      }
+      lock.unlock();
+      if (!skip) {
+        StreamTokenizer st(data, size, &tokens[statement.begin],
+                           statement.end - statement.begin);
+        try {
+          for (const pair<string, size_t> &input : statement.inputs) {
+            statement.scope->ShareVariable(
+                input.first, *(*statements)[input.second].scope);
+          }
+          EvalStatement(st, statement.scope.get());
+          statement.succeeded = true;
+#ifdef INFACT_THROW_EXCEPTIONS
+        } catch (std::runtime_error &e) {
+          statement.exception = std::current_exception();
+          statement.report = ExceptionReport(st, e.what());
+#endif
+        } catch (...) {
+          statement.exception = std::current_exception();
+        }
+      }
+      lock.lock();
+      if (statement.exception != nullptr && i < first_failed) {
+        first_failed = i;
       }
+      for (size_t dependent : statement.dependents) {
+        if (--(*statements)[dependent].num_pending == 0) {
+          ready.push(dependent);
+        }
+      }
+      ++num_done;
+      ready_cv.notify_all();
+    }
+  };
+  size_t num_threads =
+      std::min(static_cast<size_t>(num_threads_), statements->size());
+  vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.push_back(std::thread(evaluate));
+  }
+  evaluate();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  // Every statement before the first failed one succeeded.
+  for (size_t i = 0; i < first_failed; ++i) {
+    ParallelStatement &statement = (*statements)[i];
+    env_->ShareVariable(statement.varname, *statement.scope);
+  }
+  if (first_failed == statements->size()) {
+    return true;
+  }
+  ParallelStatement &failed = (*statements)[first_failed];
+  if (failed.report.empty()) {
+    std::rethrow_exception(failed.exception);
+  }
+  cerr << failed.report << endl;
+  return false;
+}
+
+namespace {
+
+// The first characters of every snapshot, which also identify the
+// version of its format.
+const char kSnapshotMagic[] = "INFACTS3";
+const size_t kSnapshotMagicSize = 8;
+
+// Written in host byte order, so that a snapshot written on a host of
+// different byte order is recognized.
+const uint32_t kSnapshotByteOrder = 0x01020304;
+
+// The size of the header of a snapshot, which is followed by the hash of
+// the rest of its contents (its body), so that a corrupted snapshot is
+// recognized before anything is decoded from it.
+const size_t kSnapshotHeaderSize = kSnapshotMagicSize + sizeof(uint32_t);
+const size_t kSnapshotBodyStart = kSnapshotHeaderSize + sizeof(uint64_t);
+
+// The alignment of each encoded value within a snapshot, so that the
+// arrays of a mapped snapshot can be used in place.
+const size_t kSnapshotAlignment = kArrayAlignment;
+
+// The kinds of statements in a snapshot.
+const uint8_t kEncodedStatement = 0;
+const uint8_t kTokensStatement = 1;
+
+template <typename T>
+void AppendScalar(T value, string *bytes) {
+  bytes->append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void AppendString(const string &value, string *bytes) {
+  AppendScalar<uint64_t>(value.size(), bytes);
+  bytes->append(value);
+}
+
+// Reads the contents of a snapshot, where every read fails once one has.
+class SnapshotReader {
+ public:
+  SnapshotReader(const char *data, size_t size) :
+      begin_(data), pos_(data), end_(data + size) { }
+
+  bool ok() const { return ok_; }
+  bool at_end() const { return pos_ == end_; }
+
+  template <typename T>
+  T ReadScalar() {
+    T value = T();
+    if (Check(sizeof(T))) {
+      memcpy(&value, pos_, sizeof(T));
+      pos_ += sizeof(T);
+    }
+    return value;
+  }
+
+  // Returns the next size characters, or nullptr if there are not as many.
+  const char *ReadBytes(uint64_t size) {
+    if (!Check(size)) {
+      return nullptr;
+    }
+    const char *bytes = pos_;
+    pos_ += size;
+    return bytes;
+  }
+
+  string ReadString() {
+    uint64_t size = ReadScalar<uint64_t>();
+    const char *bytes = ReadBytes(size);
+    return bytes == nullptr ? string() : string(bytes, size);
+  }
+
+  // Skips the padding up to the next multiple of the specified alignment.
+  void Align(size_t alignment) {
+    size_t misalignment = (pos_ - begin_) % alignment;
+    if (misalignment != 0) {
+      ReadBytes(alignment - misalignment);
     }
+  }
+
+ private:
+  bool Check(uint64_t size) {
+    ok_ = ok_ && static_cast<uint64_t>(end_ - pos_) >= size;
+    return ok_;
+  }
+
+  const char *begin_;
+  const char *pos_;
+  const char *end_;
+  bool ok_ = true;
+};
 
-    string varname = st.Next();
+// A statement read from a snapshot, whose encoded value, or the
+// characters of whose tokens, are held by the snapshot.
+struct SnapshotStatement {
+  bool encoded;
+  string varname;
+  string type;
+  string filename;
+  const char *data;
+  size_t size;
+  vector<StreamTokenizer::Token> tokens;
+};
 
-    // Next, read equals sign.
-    token_type = st.PeekTokenType();
-    if (st.Peek() != "=") {
-      WrongTokenError(st, st.PeekTokenStart(), "=", st.Peek(),
-                      st.PeekTokenType());
+// Returns the 64-bit FNV-1a hash of the specified characters, continuing
+// from the specified hash.
+uint64_t Hash(const char *data, size_t size,
+              uint64_t hash = 14695981039346656037ULL) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Returns a hash of the set of types registered with each factory.
+uint64_t HashFactories() {
+  vector<string> registrations;
+  for (FactoryContainer::iterator factory_it = FactoryContainer::begin();
+       factory_it != FactoryContainer::end(); ++factory_it) {
+    unordered_set<string> registered;
+    (*factory_it)->CollectRegistered(registered);
+    for (const string &type : registered) {
+      registrations.push_back((*factory_it)->BaseName() + "\t" + type + "\n");
     }
+  }
+  std::sort(registrations.begin(), registrations.end());
+  uint64_t hash = Hash(nullptr, 0);
+  for (const string &registration : registrations) {
+    hash = Hash(registration.data(), registration.size(), hash);
+  }
+  return hash;
+}
 
-    // Consume equals sign.
+// Reads the tokens of the value of an assignment statement from the
+// specified token stream, up to the semicolon ending the statement, and
+// then puts them back.
+void PeekValueTokens(StreamTokenizer &st,
+                     vector<StreamTokenizer::Token> *tokens) {
+  int depth = 0;
+  while (st.HasNext()) {
+    const StreamTokenizer::Token &token = st.PeekToken();
+    if (token.type == StreamTokenizer::RESERVED_CHAR) {
+      if (depth == 0 && token.tok == ";") {
+        break;
+      }
+      if (token.tok == "(" || token.tok == "{") {
+        ++depth;
+      } else if (token.tok == ")" || token.tok == "}") {
+        --depth;
+      }
+    }
+    tokens->push_back(token);
     st.Next();
+  }
+  st.Rewind(tokens->size());
+}
+
+// Appends the specified field to the specified string, prefixed by its
+// length so that no two sequences of fields have the same result.
+void AppendReloadField(const string &field, string *key) {
+  key->append(std::to_string(field.size()));
+  key->push_back(':');
+  key->append(field);
+}
+
+}  // namespace
+
+bool
+Interpreter::HashFile(const string &filename, uint64_t *hash) const {
+  FileStamp stamp;
+  if (!CanReadFile(filename, &stamp)) {
+    return false;
+  }
+  unique_ptr<FileBuffer> buffer = istream_builder_->BuildBuffer(filename);
+  if (buffer != nullptr) {
+    *hash = Hash(buffer->data(), buffer->size());
+    return true;
+  }
+  unique_ptr<istream> file =
+      istream_builder_->Build(filename,
+                              std::ios_base::in | std::ios_base::binary);
+  if (!file->good()) {
+    return false;
+  }
+  string contents((std::istreambuf_iterator<char>(*file)),
+                  std::istreambuf_iterator<char>());
+  *hash = Hash(contents.data(), contents.size());
+  return true;
+}
+
+Interpreter::SnapshotRecord *
+Interpreter::BeginRecord(const string &varname, const string &type,
+                         StreamTokenizer &st) {
+  recording_->records.push_back(SnapshotRecord());
+  SnapshotRecord *record = &recording_->records.back();
+  record->varname = varname;
+  record->type = type;
+  record->filename = curr_filename();
 
-    if (st.PeekTokenType() == StreamTokenizer::EOF_TYPE) {
+  PeekValueTokens(st, &record->tokens);
+  if (record->tokens.empty()) {
+    return record;
+  }
+
+  // The value is replayed from a copy of its own characters.
+  size_t offset = record->tokens.front().start;
+  record->text = st.Substr(offset, record->tokens.back().curr_pos - offset);
+  for (StreamTokenizer::Token &token : record->tokens) {
+    token.start -= offset;
+    token.curr_pos -= offset;
+    token.line_start_pos =
+        token.line_start_pos >= offset ? token.line_start_pos - offset : 0;
+  }
+  return record;
+}
+
+void
+Interpreter::EndRecord(SnapshotRecord *record, EnvironmentImpl *env) {
+  // An alias of another variable is kept as its token, so that the two
+  // still share their storage once restored.
+  if (record->tokens.size() == 1 &&
+      record->tokens[0].type == StreamTokenizer::IDENTIFIER &&
+      record->tokens[0].tok != record->varname &&
+      env->Defined(record->tokens[0].tok)) {
+    return;
+  }
+  VarMapBase *var_map = env->GetVarMap(record->varname);
+  if (var_map != nullptr && var_map->IsPrimitive() &&
+      var_map->EncodeValue(record->varname, &record->value)) {
+    record->encoded = true;
+    record->type = var_map->Name();
+    string().swap(record->text);
+    vector<StreamTokenizer::Token>().swap(record->tokens);
+  }
+}
+
+string
+Interpreter::SnapshotContents(const SnapshotRecording &recording) const {
+  string bytes(kSnapshotMagic, kSnapshotMagicSize);
+  AppendScalar<uint32_t>(kSnapshotByteOrder, &bytes);
+  // The hash of the body is filled in once it has been written.
+  AppendScalar<uint64_t>(0, &bytes);
+  AppendScalar<uint64_t>(HashFactories(), &bytes);
+
+  // Each file is hashed once, however many times it was evaluated.
+  vector<string> files;
+  unordered_set<string> seen;
+  for (const string &filename : recording.files) {
+    if (seen.insert(filename).second) {
+      files.push_back(filename);
+    }
+  }
+  AppendScalar<uint64_t>(files.size(), &bytes);
+  for (const string &filename : files) {
+    uint64_t hash = 0;
+    if (!HashFile(filename, &hash)) {
       ostringstream err_ss;
-      err_ss << "infact::Interpreter: " << filestack(st, st.tellg())
-             << "error: unexpected EOF";
+      err_ss << "infact::Interpreter: error: cannot read file \"" << filename
+             << "\" to hash it for a snapshot";
       Error(err_ss.str());
     }
+    AppendString(filename, &bytes);
+    AppendScalar<uint64_t>(hash, &bytes);
+  }
 
-    // Consume and set the value for this variable in the environment.
-    env_->ReadAndSet(varname, st, type);
+  AppendScalar<uint64_t>(recording.records.size(), &bytes);
+  for (const SnapshotRecord &record : recording.records) {
+    AppendScalar<uint8_t>(record.encoded ? kEncodedStatement : kTokensStatement,
+                          &bytes);
+    AppendString(record.varname, &bytes);
+    AppendString(record.type, &bytes);
+    if (record.encoded) {
+      AppendScalar<uint64_t>(record.value.size(), &bytes);
+      bytes.append((kSnapshotAlignment - bytes.size() % kSnapshotAlignment) %
+                   kSnapshotAlignment, '\0');
+      bytes.append(record.value);
+      continue;
+    }
+    AppendString(record.filename, &bytes);
+    AppendString(record.text, &bytes);
+    AppendScalar<uint64_t>(record.tokens.size(), &bytes);
+    for (const StreamTokenizer::Token &token : record.tokens) {
+      AppendString(token.tok, &bytes);
+      AppendScalar<uint8_t>(token.type, &bytes);
+      AppendScalar<uint64_t>(token.start, &bytes);
+      AppendScalar<uint64_t>(token.line_number, &bytes);
+      AppendScalar<uint64_t>(token.line_start_pos, &bytes);
+      AppendScalar<uint64_t>(token.curr_pos, &bytes);
+    }
+  }
+  uint64_t checksum = Hash(bytes.data() + kSnapshotBodyStart,
+                           bytes.size() - kSnapshotBodyStart);
+  memcpy(&bytes[kSnapshotHeaderSize], &checksum, sizeof(checksum));
+  return bytes;
+}
+
+bool
+Interpreter::EvalAndSaveSnapshot(const string &filename,
+                                 const string &snapshot_filename) {
+  recording_.reset(new SnapshotRecording());
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    Eval(filename);
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::runtime_error &e) {
+    recording_.reset();
+    throw;
+  }
+#endif
+  unique_ptr<SnapshotRecording> recording = std::move(recording_);
+  if (recording->failed) {
+    return false;
+  }
+  string contents = SnapshotContents(*recording);
+
+  // The snapshot is written to a temporary file first, so that no
+  // process ever reads an incomplete snapshot.
+  string temp_filename = snapshot_filename + ".tmp";
+  std::ofstream os(temp_filename.c_str(),
+                   std::ios_base::out | std::ios_base::binary |
+                   std::ios_base::trunc);
+  os.write(contents.data(), contents.size());
+  os.close();
+  if (!os || std::rename(temp_filename.c_str(),
+                         snapshot_filename.c_str()) != 0) {
+    ostringstream err_ss;
+    err_ss << "infact::Interpreter: error: cannot write snapshot file \""
+           << snapshot_filename << "\"";
+    Error(err_ss.str());
+  }
+  return true;
+}
 
-    token_type = st.PeekTokenType();
-    if (st.Peek() != ";") {
-      WrongTokenError(st, st.PeekTokenStart(), ";", st.Peek(),
-                      st.PeekTokenType());
+bool
+Interpreter::LoadSnapshot(const string &snapshot_filename) {
+  FileStamp stamp;
+  if (!CanReadFile(snapshot_filename, &stamp)) {
+    return false;
+  }
+  shared_ptr<const FileBuffer> buffer(
+      istream_builder_->BuildBuffer(snapshot_filename));
+  if (buffer == nullptr) {
+    unique_ptr<istream> file =
+        istream_builder_->Build(snapshot_filename,
+                                std::ios_base::in | std::ios_base::binary);
+    buffer = StringFileBuffer::Read(*file);
+  }
+
+  SnapshotReader reader(buffer->data(), buffer->size());
+  const char *magic = reader.ReadBytes(kSnapshotMagicSize);
+  if (magic == nullptr ||
+      memcmp(magic, kSnapshotMagic, kSnapshotMagicSize) != 0 ||
+      reader.ReadScalar<uint32_t>() != kSnapshotByteOrder) {
+    return false;
+  }
+  uint64_t checksum = reader.ReadScalar<uint64_t>();
+  if (!reader.ok() ||
+      checksum != Hash(buffer->data() + kSnapshotBodyStart,
+                       buffer->size() - kSnapshotBodyStart)) {
+    if (debug_ >= 1) {
+      cerr << "infact::Interpreter: snapshot \"" << snapshot_filename
+           << "\" is corrupt" << endl;
     }
-    // Consume semicolon.
-    st.Next();
+    return false;
+  }
+  if (reader.ReadScalar<uint64_t>() != HashFactories()) {
+    return false;
+  }
+  uint64_t num_files = reader.ReadScalar<uint64_t>();
+  for (uint64_t i = 0; i < num_files && reader.ok(); ++i) {
+    string filename = reader.ReadString();
+    uint64_t hash = reader.ReadScalar<uint64_t>();
+    uint64_t current_hash = 0;
+    if (!reader.ok() || !HashFile(filename, &current_hash) ||
+        current_hash != hash) {
+      if (debug_ >= 1) {
+        cerr << "infact::Interpreter: snapshot \"" << snapshot_filename
+             << "\" is stale: file \"" << filename << "\" has changed"
+             << endl;
+      }
+      return false;
+    }
+  }
+
+  // Every statement is read before any is restored, so that a malformed
+  // snapshot leaves the environment unchanged.
+  uint64_t num_statements = reader.ReadScalar<uint64_t>();
+  vector<SnapshotStatement> statements;
+  for (uint64_t i = 0; i < num_statements && reader.ok(); ++i) {
+    SnapshotStatement statement;
+    uint8_t kind = reader.ReadScalar<uint8_t>();
+    statement.encoded = kind == kEncodedStatement;
+    statement.varname = reader.ReadString();
+    statement.type = reader.ReadString();
+    if (statement.encoded) {
+      statement.size = reader.ReadScalar<uint64_t>();
+      reader.Align(kSnapshotAlignment);
+      statement.data = reader.ReadBytes(statement.size);
+    } else {
+      statement.filename = reader.ReadString();
+      statement.size = reader.ReadScalar<uint64_t>();
+      statement.data = reader.ReadBytes(statement.size);
+      uint64_t num_tokens = reader.ReadScalar<uint64_t>();
+      for (uint64_t j = 0; j < num_tokens && reader.ok(); ++j) {
+        StreamTokenizer::Token token;
+        token.tok = reader.ReadString();
+        uint8_t type = reader.ReadScalar<uint8_t>();
+        token.type = static_cast<StreamTokenizer::TokenType>(type);
+        token.start = reader.ReadScalar<uint64_t>();
+        token.line_number = reader.ReadScalar<uint64_t>();
+        token.line_start_pos = reader.ReadScalar<uint64_t>();
+        token.curr_pos = reader.ReadScalar<uint64_t>();
+        if (type > StreamTokenizer::IDENTIFIER ||
+            token.curr_pos > statement.size) {
+          return false;
+        }
+        statement.tokens.push_back(std::move(token));
+      }
+    }
+    if (kind > kTokensStatement) {
+      return false;
+    }
+    statements.push_back(std::move(statement));
+  }
+  if (!reader.ok() || !reader.at_end()) {
+    return false;
+  }
+
+  // Finally, the statements are restored in order: encoded values are
+  // decoded, and the tokens of all others are replayed.  They are
+  // restored into a new environment, which replaces the current one only
+  // if every statement is restored, so that even a snapshot that cannot
+  // be restored leaves the environment unchanged.
+  unique_ptr<EnvironmentImpl> env(new EnvironmentImpl(debug_));
+  env->SetFileLoader([this](const string &filename) {
+      return LoadFile(filename);
+    });
+  env->SetArena(env_->arena());
+  env_.swap(env);
+  for (const SnapshotStatement &statement : statements) {
+#ifdef INFACT_THROW_EXCEPTIONS
+    try {
+#endif
+    if (statement.encoded) {
+      env_->DecodeAndSet(statement.varname, statement.type, statement.data,
+                         statement.size, buffer);
+      continue;
+    }
+    filenames_.push_back(statement.filename);
+    StreamTokenizer st(statement.data, statement.size,
+                       statement.tokens.data(), statement.tokens.size());
+    if (lazy_ && !streaming_) {
+      env_->ReadAndSetLazily(statement.varname, st, statement.type,
+                             statement.filename);
+    } else {
+      env_->ReadAndSet(statement.varname, st, statement.type);
+    }
+    filenames_.pop_back();
 #ifdef INFACT_THROW_EXCEPTIONS
     }
     catch (std::runtime_error &e) {
-      cerr << "infact::Interpreter: caught exception\n"
-           << filestack(st, st.tellg())
-           << "==================\n"
-           << "Exception message:\n"
-           << "==================\n" << e.what() << "\n"
-           << endl;
-      // For now, we simply give up.
-      break;
+      cerr << "infact::Interpreter: error restoring variable "
+           << statement.varname << " from snapshot \"" << snapshot_filename
+           << "\": " << e.what() << endl;
+      if (!statement.encoded) {
+        filenames_.pop_back();
+      }
+      env_.swap(env);
+      return false;
     }
 #endif
   }
+  return true;
+}
+
+bool
+Interpreter::EvalReloadable(const string &filename) {
+  unique_ptr<ReloadRecording> recording(new ReloadRecording());
+  recording->filename = filename;
+  reload_.reset();
+  return EvalRecordingReload(std::move(recording));
+}
+
+bool
+Interpreter::Reload(vector<string> *rebuilt) {
+  if (reload_ == nullptr) {
+    Error("infact::Interpreter: error: Reload called before EvalReloadable");
+    return false;
+  }
+  unique_ptr<ReloadRecording> recording(new ReloadRecording());
+  recording->filename = reload_->filename;
+  recording->previous = reload_.get();
+  recording->rebuilt = rebuilt;
+
+  // The file is evaluated into a new environment, which replaces the
+  // current one only if every statement succeeds.
+  unique_ptr<EnvironmentImpl> env(new EnvironmentImpl(debug_));
+  env->SetFileLoader([this](const string &filename) {
+      return LoadFile(filename);
+    });
+  env->SetArena(env_->arena());
+  env_.swap(env);
+  bool success = false;
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    success = EvalRecordingReload(std::move(recording));
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::runtime_error &e) {
+    env_.swap(env);
+    throw;
+  }
+#endif
+  if (!success) {
+    env_.swap(env);
+  }
+  return success;
+}
+
+bool
+Interpreter::EvalRecordingReload(unique_ptr<ReloadRecording> recording) {
+  string filename = recording->filename;
+  reloading_ = std::move(recording);
+#ifdef INFACT_THROW_EXCEPTIONS
+  try {
+#endif
+    Eval(filename);
+#ifdef INFACT_THROW_EXCEPTIONS
+  } catch (std::runtime_error &e) {
+    reloading_.reset();
+    throw;
+  }
+#endif
+  recording = std::move(reloading_);
+  if (recording->failed) {
+    return false;
+  }
+  recording->previous = nullptr;
+  recording->num_bindings.clear();
+  recording->rebuilt = nullptr;
+  recording->current.reset();
+  reload_ = std::move(recording);
+  return true;
+}
+
+void
+Interpreter::EvalReloadableStatement(const string &varname,
+                                     const string &type, StreamTokenizer &st,
+                                     EnvironmentImpl *env) {
+  vector<StreamTokenizer::Token> tokens;
+  PeekValueTokens(st, &tokens);
+
+  // A statement is identified by its tokens, without their positions, and
+  // by the values of the variables to which they may refer, exactly as
+  // the spec of a memoized object is.
+  shared_ptr<ReloadStatement> statement = std::make_shared<ReloadStatement>();
+  AppendReloadField(type, &statement->key);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    const StreamTokenizer::Token &token = tokens[i];
+    statement->key.push_back(static_cast<char>('0' + token.type));
+    AppendReloadField(token.tok, &statement->key);
+
+    bool is_name = i + 1 < tokens.size() &&
+        tokens[i + 1].type == StreamTokenizer::RESERVED_CHAR &&
+        (tokens[i + 1].tok == "(" || tokens[i + 1].tok == "=");
+    bool is_reference =
+        (token.type == StreamTokenizer::IDENTIFIER && !is_name) ||
+        token.type == StreamTokenizer::STRING;
+    VarMapBase *var_map = is_reference ? env->GetVarMap(token.tok) : nullptr;
+    if (var_map == nullptr) {
+      continue;
+    }
+    string fingerprint;
+    shared_ptr<const void> storage;
+    if (!var_map->Fingerprint(token.tok, &fingerprint, &storage)) {
+      continue;
+    }
+    AppendReloadField(std::to_string(i), &statement->references);
+    AppendReloadField(var_map->Name(), &statement->references);
+    AppendReloadField(fingerprint, &statement->references);
+    if (storage != nullptr) {
+      statement->storage.push_back(std::move(storage));
+    }
+  }
+
+  size_t binding = reloading_->num_bindings[varname]++;
+  string id = varname + '#' + std::to_string(binding);
+  shared_ptr<const ReloadStatement> previous;
+  if (reloading_->previous != nullptr) {
+    unordered_map<string, shared_ptr<const ReloadStatement> >::const_iterator
+        it = reloading_->previous->statements.find(id);
+    if (it != reloading_->previous->statements.end()) {
+      previous = it->second;
+    }
+  }
+  if (previous != nullptr && previous->value != nullptr &&
+      previous->key == statement->key &&
+      previous->references == statement->references &&
+      LoadsUnchanged(*previous) &&
+      env->ShareVariable(varname, *previous->value)) {
+    if (debug_ >= 1) {
+      cerr << "infact::Interpreter: keeping unchanged value of variable \""
+           << varname << "\"" << endl;
+    }
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      st.Next();
+    }
+    reloading_->statements[id] = std::move(previous);
+    return;
+  }
+
+  reloading_->current = statement;
+  env->ReadAndSet(varname, st, type);
+  reloading_->current.reset();
+  VarMapBase *var_map = env->GetVarMap(varname);
+  if (var_map != nullptr) {
+    statement->value.reset(var_map->CreateEmpty(nullptr));
+    statement->value->ShareValue(varname, *var_map);
+  }
+  reloading_->statements[id] = std::move(statement);
+  if (reloading_->rebuilt != nullptr) {
+    reloading_->rebuilt->push_back(varname);
+  }
+}
+
+void
+Interpreter::RecordLoad(const string &filename,
+                        const FileBuffer &buffer) const {
+  if (reloading_ != nullptr && reloading_->current != nullptr) {
+    reloading_->current->loads.push_back(
+        std::make_pair(filename, Hash(buffer.data(), buffer.size())));
+  }
+}
+
+bool
+Interpreter::LoadsUnchanged(const ReloadStatement &statement) const {
+  for (const std::pair<string, uint64_t> &load : statement.loads) {
+    uint64_t hash = 0;
+    if (!HashFile(load.first, &hash) || hash != load.second) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Profiler::Stats
+Interpreter::Stats() const {
+  if (profiler_ == nullptr) {
+    return Profiler::Stats();
+  }
+  Profiler::Stats stats = profiler_->stats();
+  shared_ptr<Arena> arena = env_->arena();
+  if (arena != nullptr) {
+    stats.arena_bytes_reserved = arena->bytes_reserved();
+  }
+  return stats;
+}
+
+void
+Interpreter::WriteTrace(ostream &os) const {
+  if (profiler_ != nullptr) {
+    profiler_->WriteTrace(os);
+  } else {
+    Profiler().WriteTrace(os);
+  }
+}
+
+string
+Interpreter::ExceptionReport(StreamTokenizer &st, const string &what) const {
+  ostringstream report;
+  report << "infact::Interpreter: caught exception\n"
+         << filestack(st, st.tellg())
+         << "==================\n"
+         << "Exception message:\n"
+         << "==================\n" << what << "\n";
+  return report.str();
 }
 
 string
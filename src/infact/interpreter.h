@@ -37,12 +37,21 @@
 #ifndef INFACT_INTERPRETER_H_
 #define INFACT_INTERPRETER_H_
 
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <future>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "environment-impl.h"
 
@@ -52,18 +61,77 @@ using std::ifstream;
 using std::istream;
 using std::unique_ptr;
 
+/// A FileBuffer implementation that maps a regular file into memory.
+class MappedFileBuffer : public FileBuffer {
+ public:
+  ~MappedFileBuffer() override;
+
+  /// Maps the named file into memory, returning nullptr if the file
+  /// cannot be opened or is not a regular file.
+  static unique_ptr<FileBuffer> Open(const string &filename);
+
+  const char *data() const override {
+    return data_ != nullptr ? static_cast<const char *>(data_) : "";
+  }
+
+  size_t size() const override { return size_; }
+
+ private:
+  MappedFileBuffer(void *data, size_t size) : data_(data), size_(size) { }
+
+  void *data_;
+  size_t size_;
+};
+
+/// Identifies the contents of a file at a moment in time, so that
+/// results computed from a file may be reused for as long as it is
+/// unchanged.
+struct FileStamp {
+  /// Whether this stamp identifies the contents of a file; if not, the
+  /// file must be assumed to change every time it is read.
+  bool valid = false;
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+
+  bool operator==(const FileStamp &other) const {
+    return valid && other.valid && device == other.device &&
+        inode == other.inode && size == other.size &&
+        mtime_ns == other.mtime_ns;
+  }
+};
+
 /// An interface for classes that can build istreams for named files.
 class IStreamBuilder {
  public:
   virtual ~IStreamBuilder() = default;
 
+  /// Returns whether the named file exists and can be read and, if this
+  /// builder can tell, sets the specified stamp to identify its current
+  /// contents.  The default implementation opens the file via \link
+  /// Build\endlink, and leaves the stamp invalid.
+  virtual bool Stat(const string &filename, FileStamp *stamp) const {
+    stamp->valid = false;
+    return Build(filename)->good();
+  }
+
   virtual unique_ptr<istream> Build(
       const string &filename,
       std::ios_base::openmode mode = std::ios_base::in) const = 0;
+
+  /// Returns a buffer holding the entire contents of the named file, or
+  /// nullptr if this builder cannot provide one, in which case the file
+  /// will be read from the istream returned by Build.  Files read
+  /// from a buffer are tokenized much faster than files read from an
+  /// istream.  The default implementation returns nullptr.
+  virtual unique_ptr<FileBuffer> BuildBuffer(const string &filename) const {
+    return unique_ptr<FileBuffer>();
+  }
 };
 
 /// The default implementation for the IStreamBuilder interface, returning
-/// std::ifstream instances.
+/// std::ifstream instances or, when possible, memory-mapped files.
 class DefaultIStreamBuilder : public IStreamBuilder {
  public:
   ~DefaultIStreamBuilder() override = default;
@@ -71,6 +139,290 @@ class DefaultIStreamBuilder : public IStreamBuilder {
   unique_ptr<istream> Build(const string &filename,
                             std::ios_base::openmode mode = std::ios_base::in)
       const override;
+
+  unique_ptr<FileBuffer> BuildBuffer(const string &filename) const override;
+
+  /// Stats the named file, which can be read if it is readable and not a
+  /// directory.  Only a regular file gets a valid stamp: others, such as
+  /// FIFOs and <tt>/dev/stdin</tt>, may change every time they are read.
+  bool Stat(const string &filename, FileStamp *stamp) const override;
+};
+
+/// An IStreamBuilder that, whenever it builds a buffer for a file,
+/// scans that file for import statements and starts reading all the
+/// files it imports in parallel, and so on recursively, so that by the
+/// time each import is evaluated its contents are usually already in
+/// memory.  This turns the serial round trip per import of a
+/// configuration on a slow (e.g., network) filesystem into a few
+/// parallel ones.  Files are read by a bounded number of background
+/// threads, however many files are imported; a file needed before its
+/// prefetch has started is simply read when it is needed.  Files are
+/// read, and checked for changes before a prefetched copy is used, via
+/// a wrapped IStreamBuilder.
+///
+/// Example:
+/// \code
+/// Interpreter interpreter(unique_ptr<IStreamBuilder>(
+///     new PrefetchingIStreamBuilder(unique_ptr<IStreamBuilder>(
+///         new DefaultIStreamBuilder()))));
+/// \endcode
+class PrefetchingIStreamBuilder : public IStreamBuilder {
+ public:
+  /// The default maximum number of files read concurrently.
+  static const size_t kDefaultNumThreads = 4;
+
+  /// Constructs a builder reading files via the specified builder, with
+  /// at most the specified number of background threads.
+  explicit PrefetchingIStreamBuilder(
+      unique_ptr<IStreamBuilder> builder,
+      size_t num_threads = kDefaultNumThreads) :
+      builder_(std::move(builder)), num_threads_(num_threads) {
+    workers_.reserve(num_threads_);
+  }
+
+  /// Destroys this builder, first waiting for any prefetches in flight;
+  /// those not yet started are abandoned.
+  ~PrefetchingIStreamBuilder() override;
+
+  bool Stat(const string &filename, FileStamp *stamp) const override {
+    return builder_->Stat(filename, stamp);
+  }
+
+  unique_ptr<istream> Build(const string &filename,
+                            std::ios_base::openmode mode = std::ios_base::in)
+      const override {
+    return builder_->Build(filename, mode);
+  }
+
+  /// Returns the prefetched contents of the named file if they are
+  /// still current, or else reads the file, and then starts prefetching
+  /// the files it imports.
+  unique_ptr<FileBuffer> BuildBuffer(const string &filename) const override;
+
+  /// Starts reading the named file in the background, unless it is
+  /// already being read.
+  void Prefetch(const string &filename) const;
+
+ private:
+  /// The result of reading a file.
+  struct Fetched {
+    /// The paths at which the file was sought.
+    vector<string> candidates;
+    /// The name of the file that was read, which for an import is the
+    /// first of its candidate paths that exists.
+    string filename;
+    FileStamp stamp;
+    shared_ptr<const FileBuffer> buffer;
+  };
+
+  /// A prefetch, which is started by whichever comes first of a
+  /// background thread or BuildBuffer, when it needs the file.
+  struct Task {
+    vector<string> candidates;
+    std::promise<Fetched> promise;
+    std::shared_future<Fetched> future;
+    /// Whether the prefetch has been started, or is not to be.
+    bool started = false;
+  };
+
+  /// Reads the first of the specified files that exists via the wrapped
+  /// builder, returning an empty result if none does.
+  Fetched Fetch(const vector<string> &candidates) const;
+
+  /// Schedules reading the first of the specified files that exists,
+  /// unless it is already scheduled.
+  void Prefetch(const vector<string> &candidates) const;
+
+  /// Schedules prefetching the files imported by the specified buffer of
+  /// the named file.
+  void PrefetchImports(const string &filename, const FileBuffer &buffer) const;
+
+  /// Runs scheduled prefetches on a background thread until this builder
+  /// is destroyed.
+  void Work() const;
+
+  unique_ptr<IStreamBuilder> builder_;
+  /// The maximum number of background threads.
+  size_t num_threads_;
+  /// Guards all the members below.
+  mutable std::mutex mu_;
+  /// Signaled whenever a prefetch is scheduled, or this builder is being
+  /// destroyed.
+  mutable std::condition_variable work_;
+  /// The prefetches scheduled, in order, which include some that have
+  /// since been started by BuildBuffer.
+  mutable std::deque<shared_ptr<Task> > queue_;
+  /// The prefetches not yet taken by BuildBuffer, keyed by each of
+  /// their candidate paths.
+  mutable std::unordered_map<string, shared_ptr<Task> > pending_;
+  /// The background threads, which are started as prefetches are
+  /// scheduled.
+  mutable vector<std::thread> workers_;
+  /// The number of background threads waiting for a prefetch.
+  mutable size_t num_idle_ = 0;
+  /// Whether this builder is being destroyed.
+  mutable bool stopping_ = false;
+};
+
+/// An IStreamBuilder that decompresses files whose names have a known
+/// suffix, by streaming them through an external decompressor such as
+/// <tt>zstd</tt> or <tt>gzip</tt>, and holds their decompressed
+/// contents in a buffer, so that they are tokenized just as fast as
+/// uncompressed files.  Other files are built by a wrapped
+/// IStreamBuilder, which is also used to stat all files.
+class DecompressingIStreamBuilder : public IStreamBuilder {
+ public:
+  /// Constructs a builder that decompresses files ending in
+  /// <tt>.gz</tt>, <tt>.xz</tt> and <tt>.zst</tt>, and builds all other
+  /// files with the specified builder.
+  explicit DecompressingIStreamBuilder(unique_ptr<IStreamBuilder> builder);
+
+  ~DecompressingIStreamBuilder() override = default;
+
+  /// Sets the command with which files ending in the specified suffix
+  /// are decompressed, replacing any command already set for it.  The
+  /// name of the file is appended to the specified command line, which
+  /// must write the decompressed contents to its standard output.
+  void SetDecompressor(const string &suffix, vector<string> command) {
+    decompressors_[suffix] = std::move(command);
+  }
+
+  bool Stat(const string &filename, FileStamp *stamp) const override {
+    return builder_->Stat(filename, stamp);
+  }
+
+  unique_ptr<istream> Build(const string &filename,
+                            std::ios_base::openmode mode = std::ios_base::in)
+      const override;
+
+  unique_ptr<FileBuffer> BuildBuffer(const string &filename) const override;
+
+ private:
+  /// Returns the command with which the named file is decompressed, or
+  /// nullptr if it is not compressed.
+  const vector<string> *Decompressor(const string &filename) const;
+
+  /// Returns the contents of the named file, decompressed by the
+  /// specified command.
+  string Decompress(const string &filename,
+                    const vector<string> &command) const;
+
+  unique_ptr<IStreamBuilder> builder_;
+  std::unordered_map<string, vector<string> > decompressors_;
+};
+
+/// A thread-safe cache of the tokens of imported files, keyed by the
+/// name under which each file was found, so that a file imported many
+/// times&mdash;by many files, or by many \link Interpreter\endlink
+/// instances&mdash;is read and tokenized only once for as long as its
+/// \link FileStamp\endlink is unchanged.  A cache holds at most its
+/// capacity in bytes of file contents and tokens, evicting the least
+/// recently used files first.  Interpreters cache nothing unless given
+/// a cache with \link Interpreter::SetImportCache\endlink, such as the
+/// process-wide instance returned by \link Global\endlink.
+class ImportCache {
+ public:
+  /// The default capacity of a cache, in bytes.
+  static const size_t kDefaultCapacity = 64 * 1024 * 1024;
+
+  /// The contents of a file and the tokens read from them.
+  struct Entry {
+    FileStamp stamp;
+    string contents;
+    vector<StreamTokenizer::Token> tokens;
+
+    /// Returns the number of bytes this entry counts against the
+    /// capacity of a cache.
+    size_t bytes() const {
+      return contents.size() + tokens.size() * sizeof(StreamTokenizer::Token);
+    }
+  };
+
+  /// Constructs a cache holding at most the specified number of bytes.
+  explicit ImportCache(size_t capacity = kDefaultCapacity) :
+      capacity_(capacity) { }
+
+  /// Returns the process-wide cache.
+  static const shared_ptr<ImportCache> &Global();
+
+  /// Returns the entry for the named file if it was cached with the
+  /// specified stamp, or else nullptr.
+  shared_ptr<const Entry> Find(const string &filename,
+                               const FileStamp &stamp) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    unordered_map<string, Slot>::iterator it = entries_.find(filename);
+    if (it == entries_.end() || !(it->second.entry->stamp == stamp)) {
+      return shared_ptr<const Entry>();
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+    return it->second.entry;
+  }
+
+  /// Tokenizes the specified contents of the named file and caches the
+  /// result, replacing any previous entry for the file and evicting the
+  /// least recently used files as needed to stay within capacity.  A
+  /// file larger than the capacity is tokenized but not cached.
+  ///
+  /// \return the new entry
+  shared_ptr<const Entry> Insert(const string &filename,
+                                 const FileStamp &stamp, string contents);
+
+  /// Removes all entries from this cache.
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    lru_.clear();
+    bytes_ = 0;
+  }
+
+  /// Sets the capacity of this cache in bytes, evicting the least
+  /// recently used files as needed.
+  void SetCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    Evict(capacity_);
+  }
+
+  /// Returns the capacity of this cache in bytes.
+  size_t capacity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_;
+  }
+
+  /// Returns the number of bytes of file contents and tokens in this
+  /// cache.
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+  /// Returns the number of files in this cache.
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+ private:
+  /// The entry for a file, and its position in the recency list.
+  struct Slot {
+    shared_ptr<const Entry> entry;
+    std::list<string>::iterator lru_it;
+  };
+
+  /// Removes the named file from this cache, if present.  The mutex
+  /// must be held.
+  void Remove(const string &filename);
+
+  /// Evicts the least recently used files until this cache holds at most
+  /// the specified number of bytes.  The mutex must be held.
+  void Evict(size_t max_bytes);
+
+  mutable std::mutex mutex_;
+  size_t capacity_;
+  size_t bytes_ = 0;
+  unordered_map<string, Slot> entries_;
+  // The names of the cached files, most recently used first.
+  std::list<string> lru_;
 };
 
 class EnvironmentImpl;
@@ -136,6 +488,27 @@ class EnvironmentImpl;
 /// i.Get("m1", &model);
 /// i.Get("m_vec", &model_vector);
 /// \endcode
+/// Large values may also be accessed without being copied:
+/// \code
+/// const vector<shared_ptr<Model> > &models =
+///     i.GetRef<vector<shared_ptr<Model> > >("m_vec");
+/// \endcode
+///
+/// Very large <tt>int[]</tt>, <tt>int64[]</tt>, <tt>float[]</tt> and
+/// <tt>double[]</tt> values may be loaded from raw, little-endian binary
+/// files of 32- or 64-bit integers or IEEE 754 numbers, which are mapped
+/// into memory rather than parsed, and whose
+/// names are resolved just as the names of imported files are (see
+/// below).  Their type must be explicit:
+/// \code
+/// double[] weights = load("weights.f64");
+/// \endcode
+/// Such a value may be accessed in place via an \link infact::ArrayView
+/// ArrayView\endlink, or copied into a vector, as any other may be:
+/// \code
+/// ArrayView<double> weights;
+/// i.Get("weights", &weights);
+/// \endcode
 ///
 /// More formally, a statement in this language must conform to the
 /// following grammar, defined on top of the BNF syntax in the
@@ -169,7 +542,8 @@ class EnvironmentImpl;
 ///   <td valign=top><tt>::=</tt></td>
 ///   <td valign=top>
 ///     <table border="0">
-///       <tr><td><tt>"bool" | "int" | "string" | "double" | "bool[]" | "int[]"
+///       <tr><td><tt>"bool" | "int" | "int64" | "float" | "string" |
+///                   "double" | "bool[]" | "int[]" | "int64[]" | "float[]" |
 ///                   "string[]" | "double[]" | T | T[]</tt></td></tr>
 ///       <tr><td>where <tt>T</tt> is any \link infact::Factory
 ///               Factory\endlink-constructible type.</td></tr>
@@ -185,7 +559,8 @@ class EnvironmentImpl;
 ///   <td valign=top><tt>\<value\></tt></td>
 ///   <td valign=top><tt>::=</tt></td>
 ///   <td valign=top><tt>\<literal\> | '{' \<literal_list\> '}' |<br>
-///                      \<spec_or_null\> | '{' \<spec_list\> '}'</tt>
+///                      \<spec_or_null\> | '{' \<spec_list\> '}' |<br>
+///                      'load' '(' \<string_literal\> ')'</tt>
 ///   </td>
 /// </tr>
 /// </table>
@@ -224,22 +599,187 @@ class Interpreter {
   Interpreter(unique_ptr<IStreamBuilder> istream_builder, int debug = 0) :
       env_(new EnvironmentImpl(debug)),
       istream_builder_(std::move(istream_builder)),
-      debug_(debug) { }
+      debug_(debug) {
+    env_->SetFileLoader([this](const string &filename) {
+        return LoadFile(filename);
+      });
+  }
 
   /// Destroys this interpreter.
   virtual ~Interpreter() = default;
 
-  /// Sets the IStreamBuilder object, to be owned by this object.
+  /// Returns a new interpreter whose environment overlays that of this
+  /// interpreter, for evaluating a few statements against a large,
+  /// already-evaluated configuration.  The fork shares the variables of
+  /// this interpreter without copying them, and holds only the
+  /// variables it sets itself, which hide those of this interpreter;
+  /// forking therefore costs time and memory proportional only to what
+  /// is evaluated by the fork.  The fork also shares the IStreamBuilder
+  /// and import cache of this interpreter.
+  ///
+  /// Any number of forks may be created, and used concurrently from
+  /// different threads, provided this interpreter is not modified while
+  /// they exist.  Each fork must be destroyed before this interpreter.
+  ///
+  /// Example:
+  /// \code
+  /// Interpreter base;
+  /// base.Eval("base.infact");
+  /// // Then, for each request:
+  /// unique_ptr<Interpreter> overlay = base.Fork();
+  /// overlay->EvalString("threshold = 0.7;");
+  /// shared_ptr<Model> model;
+  /// overlay->Get("model", &model);
+  /// \endcode
+  unique_ptr<Interpreter> Fork() {
+    return unique_ptr<Interpreter>(new Interpreter(this));
+  }
+
+  /// Sets the IStreamBuilder object, to be owned by this object (and
+  /// shared with its subsequent forks).
   void SetIStreamBuilder(unique_ptr<IStreamBuilder> istream_builder) {
     istream_builder_ = std::move(istream_builder);
   }
 
+  /// Sets the cache of tokenized imported files used by this interpreter
+  /// (and shared with its subsequent forks), or disables caching if the
+  /// specified cache is nullptr, as it is by default.  Files are cached
+  /// only if their \link FileStamp\endlink is known to the IStreamBuilder
+  /// (as it is to the default one, for regular files).
+  void SetImportCache(shared_ptr<ImportCache> import_cache) {
+    import_cache_ = std::move(import_cache);
+  }
+
+  /// Sets whether this interpreter tokenizes its input in streaming
+  /// mode, where memory use stays bounded regardless of the size of
+  /// the input, since only the few most recent tokens, and the
+  /// characters of objects under construction, are retained.
+  ///
+  /// \see StreamTokenizer::EnableStreaming
+  void SetStreaming(bool streaming) { streaming_ = streaming; }
+
+  /// Sets the number of threads with which this interpreter evaluates
+  /// statements, which is 1 (evaluating them in order) by default.  With
+  /// more than one thread, the statements of each file or string are all
+  /// read first, and each statement is evaluated as soon as the
+  /// statements defining the variables it refers to have been, so that
+  /// independent objects are constructed (and their
+  /// <tt>PostInit</tt> methods run) concurrently.  Unless a
+  /// <tt>PostInit</tt> method looks up a variable its statement does not
+  /// name (see below), the resulting environment is the same as that of
+  /// evaluating the statements in order; in particular, if a statement
+  /// fails, the variables set by the statements before it are kept, and
+  /// the error reported is that of the first failing statement.
+  ///
+  /// While a statement is evaluated, its environment holds only the
+  /// variables named in that statement, as set by the statements before
+  /// it, and the variables already set when evaluation of the file or
+  /// string began or, if an import precedes the statement, when the last
+  /// such import had been evaluated.  So a <tt>PostInit</tt> method may
+  /// look up a variable set earlier in the same file only if its
+  /// object&rsquo;s statement names that variable; otherwise it sees the
+  /// variable&rsquo;s earlier value, if any.
+  ///
+  /// Import statements are evaluated in place, once all the statements
+  /// before them have been.  Input tokenized in streaming mode, or from
+  /// an <tt>istream</tt> rather than a file or string, is always
+  /// evaluated in order.
+  ///
+  /// \param num_threads the maximum number of statements to evaluate
+  ///                    concurrently
+  void SetNumThreads(int num_threads) { num_threads_ = num_threads; }
+
+  /// Sets whether this interpreter constructs Factory-constructible
+  /// objects lazily, on first use, rather than as each statement is
+  /// evaluated.  In lazy mode, the value of each statement assigning
+  /// such an object (or vector of them) is kept and constructed (and its
+  /// <tt>PostInit</tt> method run) only when the variable is first
+  /// looked up, either via \link Get\endlink and related methods or by
+  /// another object being constructed, so that a process using only a
+  /// few of the objects of a large configuration constructs only those.
+  /// Values of primitive types are still set as they are evaluated.
+  ///
+  /// Objects are constructed exactly once, even when first looked up
+  /// concurrently, from the values that the variables named in their
+  /// statements had when those statements were evaluated: a statement
+  /// setting such a variable again first constructs the objects that
+  /// name it.  A <tt>PostInit</tt> method looking up a variable its
+  /// statement does not name, however, sees the value the variable has
+  /// when the object is constructed, which may differ from the one it
+  /// would have seen in eager mode.
+  ///
+  /// An error constructing an object is not raised when the statement
+  /// binding it, or a later statement setting a variable it names, is
+  /// evaluated; it is kept, and raised (naming the file and line of the
+  /// binding statement) whenever the variable is looked up.  \link
+  /// PrintEnv\endlink prints a comment in place of such a variable.
+  /// Lazy mode takes precedence over \link SetNumThreads \endlink, and
+  /// has no effect in streaming mode.
+  ///
+  /// \see infact::EnvironmentImpl::ReadAndSetLazily
+  void SetLazy(bool lazy) { lazy_ = lazy; }
+
+  /// Sets the arena from which subsequent evaluations allocate the
+  /// objects they construct and the values of the variables they set, or,
+  /// if the specified arena is <tt>nullptr</tt>, has them allocate
+  /// normally.  An arena is never freed piecemeal: each object or value
+  /// allocated from it, even once unused, holds its memory until every
+  /// one of them (and this interpreter) has been destroyed, when it is
+  /// all freed at once.  To give each evaluation an arena of its own,
+  /// set a new one before each; forks of this interpreter share its
+  /// arena unless given one of their own.  For example:
+  /// \code
+  /// Interpreter interpreter;
+  /// interpreter.SetArena(std::make_shared<infact::Arena>());
+  /// interpreter.Eval("big-config.infact");
+  /// \endcode
+  ///
+  /// \param arena the arena from which to allocate
+  void SetArena(shared_ptr<Arena> arena) { env_->SetArena(std::move(arena)); }
+
+  /// Returns the arena set by \link SetArena\endlink, if any.
+  shared_ptr<Arena> arena() const { return env_->arena(); }
+
+  /// Sets whether this interpreter profiles subsequent evaluations,
+  /// collecting the time spent evaluating each file and statement, and
+  /// the number of objects of each concrete type constructed along with
+  /// the time spent in their constructors, member initialization and
+  /// <tt>PostInit</tt> methods.  Enabling profiling discards whatever was
+  /// collected before.  Objects constructed lazily (see \link SetLazy
+  /// \endlink) are profiled when looked up via this interpreter.  Forks
+  /// created while profiling is enabled share the profiler of this
+  /// interpreter.  When profiling is disabled, as it is by default, it
+  /// costs a single branch per statement and per object.
+  ///
+  /// Example:
+  /// \code
+  /// Interpreter interpreter;
+  /// interpreter.SetProfiling(true);
+  /// interpreter.Eval("config.infact");
+  /// std::ofstream trace("config.trace.json");
+  /// interpreter.WriteTrace(trace);
+  /// \endcode
+  void SetProfiling(bool profiling) {
+    profiler_ = profiling ? std::make_shared<Profiler>() : nullptr;
+  }
+
+  /// Returns the statistics collected since profiling was enabled by
+  /// \link SetProfiling\endlink, which are empty if it is not.
+  Profiler::Stats Stats() const;
+
+  /// Writes the events of the evaluations profiled since profiling was
+  /// enabled by \link SetProfiling\endlink in the Chrome trace-event
+  /// JSON format.
+  ///
+  /// \see infact::Profiler::WriteTrace
+  void WriteTrace(ostream &os) const;
+
   /// Evaluates the statements in the specified text file.
   void Eval(const string &filename);
 
   /// Evaluates the statements in the specified string.
   void EvalString(const string& input) {
-    StreamTokenizer st(input);
+    StreamTokenizer st(input.data(), input.size());
     Eval(st);
   }
 
@@ -249,6 +789,100 @@ class Interpreter {
     Eval(st);
   }
 
+  /// Evaluates the statements in the specified file, as \link Eval
+  /// \endlink does, and then writes a snapshot of the evaluation to
+  /// another file, from which \link LoadSnapshot\endlink can later
+  /// restore the resulting environment without tokenizing or parsing any
+  /// file.  In a snapshot, the value of each statement setting a
+  /// primitive (or vector of primitives) is stored in binary, with the
+  /// elements of each <tt>int[]</tt>, <tt>int64[]</tt>, <tt>float[]</tt>
+  /// or <tt>double[]</tt> aligned to \link kArrayAlignment\endlink so
+  /// that they can be used in place from the memory-mapped snapshot; every
+  /// other statement is stored as its tokens, so that restoring it only
+  /// runs the constructors and <tt>PostInit</tt> methods of its objects.
+  /// A snapshot also holds a hash of each file evaluated (or loaded by a
+  /// <tt>load(...)</tt> literal) and of the set of types registered with
+  /// each factory, so that a stale snapshot is never used.
+  ///
+  /// The snapshot holds only the statements evaluated by this method, so
+  /// this should be the first evaluation by this interpreter.  Statements
+  /// are evaluated in order and eagerly while a snapshot is being
+  /// recorded, regardless of \link SetLazy\endlink, \link SetNumThreads
+  /// \endlink or \link SetStreaming\endlink.
+  ///
+  /// Example:
+  /// \code
+  /// Interpreter interpreter;
+  /// if (!interpreter.LoadSnapshot("config.snapshot")) {
+  ///   interpreter.EvalAndSaveSnapshot("config.infact", "config.snapshot");
+  /// }
+  /// \endcode
+  ///
+  /// \param filename          the file to evaluate
+  /// \param snapshot_filename the file to which to write the snapshot
+  /// \return whether all statements were evaluated without error, in
+  ///         which case (and only then) the snapshot was written
+  bool EvalAndSaveSnapshot(const string &filename,
+                           const string &snapshot_filename);
+
+  /// Restores the environment resulting from the evaluation recorded in
+  /// the specified snapshot, written by \link EvalAndSaveSnapshot
+  /// \endlink, as though the evaluation had happened again.  The
+  /// snapshot is not used if it cannot be read, if it was written on a
+  /// host of different byte order, if its contents do not match the
+  /// checksum written with them (as when the snapshot is corrupted), or
+  /// if any of the files it was written from, or the set of registered
+  /// types, has changed since.  The restored environment replaces that
+  /// of this interpreter only once every statement in the snapshot has
+  /// been restored; otherwise, the environment is left as it was.  No
+  /// fork of this interpreter may exist while a snapshot is loaded.
+  ///
+  /// \return whether the environment was restored from the snapshot
+  bool LoadSnapshot(const string &snapshot_filename);
+
+  /// Evaluates the statements in the specified file, as \link Eval
+  /// \endlink does, recording for each variable the tokens of the
+  /// statement that set it, the values of the variables the statement
+  /// referred to and the contents of any files it loaded, so that \link
+  /// Reload\endlink can later re-evaluate the file incrementally.  As
+  /// when recording a snapshot, statements are evaluated in order and
+  /// eagerly, and the recording holds only the statements evaluated by
+  /// this method, so this should be the first evaluation by this
+  /// interpreter.
+  ///
+  /// \return whether all statements were evaluated without error
+  bool EvalReloadable(const string &filename);
+
+  /// Re-evaluates the file last evaluated by \link EvalReloadable
+  /// \endlink into a new environment, which replaces the environment of
+  /// this interpreter.  A statement is re-evaluated only if its tokens
+  /// or the contents of a file it loads have changed, or if a value it
+  /// refers to was itself re-evaluated; every other variable is bound to
+  /// its previous value, sharing its storage, so that an unchanged object
+  /// is neither constructed again nor has its <tt>PostInit</tt> method
+  /// run again, and callers can tell by the identity of a
+  /// <tt>shared_ptr</tt> whether it was rebuilt.  Files whose contents
+  /// are unchanged are not tokenized again when imports are cached (see
+  /// \link SetImportCache\endlink).
+  ///
+  /// If any statement fails, the environment of this interpreter is left
+  /// as it was.  No fork of this interpreter may exist during a reload.
+  ///
+  /// Example:
+  /// \code
+  /// Interpreter interpreter;
+  /// interpreter.EvalReloadable("service.infact");
+  /// // Then, on SIGHUP:
+  /// vector<string> rebuilt;
+  /// interpreter.Reload(&rebuilt);
+  /// \endcode
+  ///
+  /// \param[out] rebuilt if not <tt>nullptr</tt>, the vector to which to
+  ///                     append the names of the variables whose
+  ///                     statements were re-evaluated, in order
+  /// \return whether all statements were evaluated without error
+  bool Reload(vector<string> *rebuilt = nullptr);
+
   void PrintEnv(ostream &os) const {
     env_->Print(os);
   }
@@ -315,9 +949,64 @@ class Interpreter {
   ///                method
   template<typename T>
   bool Get(const string &varname, T *value) const {
+    // Objects constructed on first use are profiled.
+    Profiler::Scope profile_scope(profiler_.get());
     return env_->Get(varname, value);
   }
 
+  /// Returns a pointer to the value of the specified variable, without
+  /// copying it, or nullptr if there is no such variable of type
+  /// <tt>T</tt>.  This is much cheaper than \link Get \endlink for large
+  /// values, such as a <tt>double[]</tt> of model weights.
+  ///
+  /// \see infact::EnvironmentImpl::Find
+  template<typename T>
+  const T *Find(const string &varname) const {
+    // Objects constructed on first use are profiled.
+    Profiler::Scope profile_scope(profiler_.get());
+    return env_->Find<T>(varname);
+  }
+
+  /// Returns a reference to the value of the specified variable, without
+  /// copying it.  It is an error if there is no such variable of type
+  /// <tt>T</tt>.
+  ///
+  /// \see infact::EnvironmentImpl::GetRef
+  template<typename T>
+  const T &GetRef(const string &varname) const {
+    // Objects constructed on first use are profiled.
+    Profiler::Scope profile_scope(profiler_.get());
+    return env_->GetRef<T>(varname);
+  }
+
+  /// Moves the value of the specified variable out of this
+  /// interpreter&rsquo;s environment, removing the variable.
+  ///
+  /// \see infact::EnvironmentImpl::Take
+  template<typename T>
+  bool Take(const string &varname, T *value) {
+    // Objects constructed on first use are profiled.
+    Profiler::Scope profile_scope(profiler_.get());
+    return env_->Take(varname, value);
+  }
+
+  /// Returns an immutable snapshot of the variables of this interpreter,
+  /// for use by many threads once evaluation is done.  Taking a snapshot
+  /// copies no values, and a snapshot is cheap to copy.
+  ///
+  /// Example:
+  /// \code
+  /// Interpreter i;
+  /// i.Eval("config.infact");
+  /// FrozenEnvironment snapshot = i.Freeze();
+  /// // Resolve variables once, and then use them from any thread.
+  /// Handle<double> learning_rate = snapshot.Resolve<double>("lr");
+  /// double lr = *learning_rate;
+  /// \endcode
+  ///
+  /// \see infact::EnvironmentImpl::Freeze
+  FrozenEnvironment Freeze() const { return env_->Freeze(); }
+
   /// Returns a pointer to the environment of this interpreter.
   /// Crucially, this method returns a pointer to the Environment
   /// implementation class, \link infact::EnvironmentImpl
@@ -327,11 +1016,20 @@ class Interpreter {
   EnvironmentImpl *env() { return env_.get(); }
 
  private:
+  /// A statement to be evaluated concurrently with others.
+  struct ParallelStatement;
+
+  /// Constructs a fork of the specified interpreter.
+  ///
+  /// \see Fork
+  explicit Interpreter(Interpreter *parent);
+
   /// Returns whether \c filename is an absolute path.
   bool IsAbsolute(const string &filename) const;
 
-  /// Returns wheterh \c filename is a file that exists and can be read.
-  bool CanReadFile(const string &filename) const;
+  /// Returns wheterh \c filename is a file that exists and can be read,
+  /// setting \c stamp to identify its contents if possible.
+  bool CanReadFile(const string &filename, FileStamp *stamp) const;
 
   /// Returns whether either f1 or f2 can be read, trying them in that
   /// order.  If one of them can be read (according to the result of
@@ -341,10 +1039,35 @@ class Interpreter {
   /// \param[in]  f1 the first filename to check for readability
   /// \param[in]  f2 the second filename to check for readability
   /// \param[out] filename the name of the readable file, either \c f1 or \c f2
+  /// \param[out] stamp    the stamp of the readable file
   ///
   /// \return whether either \c f1 or \c f2 are readable and the
   ///         output parameter \c filename has been set
-  bool CanReadFile(const string &f1, const string &f2, string *filename) const;
+  bool CanReadFile(const string &f1, const string &f2, string *filename,
+                   FileStamp *stamp) const;
+
+  /// Finds the file with the specified name, as named by an import or
+  /// <tt>load(...)</tt> literal in the current file, trying the name
+  /// relative to the directory of the current file first.
+  ///
+  /// \param[in]  filename          the name of the file to find
+  /// \param[out] found             the name of the readable file, if any
+  /// \param[out] relative_filename the name relative to the directory of
+  ///                               the current file, or empty if it was
+  ///                               not tried
+  /// \param[out] stamp             the stamp of the file found
+  /// \return whether the file was found and can be read
+  bool FindFile(const string &filename, string *found,
+                string *relative_filename, FileStamp *stamp) const;
+
+  /// Returns the contents of the file named by a <tt>load(...)</tt>
+  /// literal in the current file.
+  shared_ptr<const FileBuffer> LoadFile(const string &filename) const;
+
+  /// Computes a hash of the contents of the specified file.
+  ///
+  /// \return whether the file could be read
+  bool HashFile(const string &filename, uint64_t *hash) const;
 
   /// Returns whether \c filename introduces a cycle in the specified
   /// stack of \c filenames.  Used for determining file import cycles.
@@ -353,9 +1076,146 @@ class Interpreter {
   /// Evaluates the expressions contained the named file.
   void EvalFile(const string &filename);
 
+  /// Evaluates the expressions contained in the named file, which has
+  /// the specified stamp, using the tokens cached for it if possible.
+  void EvalImportedFile(const string &filename, const FileStamp &stamp);
+
   /// Evalutes the expressions contained in the specified token stream.
   void Eval(StreamTokenizer &st);
 
+  /// Evaluates the next assignment statement from the specified token
+  /// stream in the specified environment.
+  void EvalStatement(StreamTokenizer &st, EnvironmentImpl *env);
+
+  /// A statement recorded for a snapshot.
+  struct SnapshotRecord {
+    string varname;
+    /// The explicit type of the variable, if any, or, if the value was
+    /// encoded, the type of its VarMap.
+    string type;
+    /// Whether the value of the statement was encoded by \link
+    /// VarMapBase::EncodeValue\endlink, rather than kept as tokens.
+    bool encoded = false;
+    /// The encoded value.
+    string value;
+    /// The name of the file in which the statement was evaluated.
+    string filename;
+    /// The characters of the value.
+    string text;
+    /// The tokens of the value, with stream positions within \c text.
+    vector<StreamTokenizer::Token> tokens;
+  };
+
+  /// The evaluation being recorded by \link EvalAndSaveSnapshot\endlink.
+  struct SnapshotRecording {
+    /// The files evaluated or loaded, in order and possibly repeated.
+    vector<string> files;
+    vector<SnapshotRecord> records;
+    /// Whether a statement has failed.
+    bool failed = false;
+  };
+
+  /// Records the value of the statement whose tokens follow in the
+  /// specified token stream, up to the semicolon ending it, without
+  /// consuming them.
+  SnapshotRecord *BeginRecord(const string &varname, const string &type,
+                              StreamTokenizer &st);
+
+  /// Encodes the value of the recorded statement, now evaluated in the
+  /// specified environment, if it can be encoded.
+  void EndRecord(SnapshotRecord *record, EnvironmentImpl *env);
+
+  /// Returns the contents of the specified snapshot, which are written to
+  /// the snapshot file.
+  string SnapshotContents(const SnapshotRecording &recording) const;
+
+  /// A statement recorded for \link Reload\endlink.
+  struct ReloadStatement {
+    /// The explicit type of the variable, if any, and the types and
+    /// characters of the tokens of the value.
+    string key;
+    /// The type and \link VarMapBase::Fingerprint fingerprint\endlink of
+    /// the value of each variable to which the value referred when it was
+    /// evaluated.
+    string references;
+    /// The storage of the values whose fingerprints are in \c references,
+    /// kept so that those fingerprints remain unique.
+    vector<shared_ptr<const void> > storage;
+    /// The files loaded by <tt>load(...)</tt> literals of the value, with
+    /// hashes of their contents.
+    vector<std::pair<string, uint64_t> > loads;
+    /// A VarMap holding the resulting value of the variable, and nothing
+    /// else.
+    shared_ptr<VarMapBase> value;
+  };
+
+  /// An evaluation recorded for \link Reload\endlink.
+  struct ReloadRecording {
+    /// The file evaluated.
+    string filename;
+    /// The statements evaluated, keyed by the name of the variable each
+    /// set and the number of statements before it setting that variable.
+    unordered_map<string, shared_ptr<const ReloadStatement> > statements;
+    /// The recording of the previous evaluation, if any, while this one
+    /// is under way.
+    const ReloadRecording *previous = nullptr;
+    /// The number of statements evaluated so far setting each variable.
+    unordered_map<string, size_t> num_bindings;
+    /// The names of the variables whose statements were re-evaluated.
+    vector<string> *rebuilt = nullptr;
+    /// The statement being evaluated, if any.
+    shared_ptr<ReloadStatement> current;
+    /// Whether a statement has failed.
+    bool failed = false;
+  };
+
+  /// Evaluates the file named by the specified recording, which is
+  /// filled in as statements are evaluated, and, if all of them are
+  /// evaluated without error, keeps it for the next \link Reload
+  /// \endlink.
+  ///
+  /// \return whether all statements were evaluated without error
+  bool EvalRecordingReload(unique_ptr<ReloadRecording> recording);
+
+  /// Evaluates the value of an assignment statement to the specified
+  /// variable while an evaluation is recorded for \link Reload\endlink,
+  /// re-using the previous value of the variable if none of the inputs
+  /// of the statement has changed.
+  void EvalReloadableStatement(const string &varname, const string &type,
+                               StreamTokenizer &st, EnvironmentImpl *env);
+
+  /// Records the specified contents of a file, named by a
+  /// <tt>load(...)</tt> literal, as loaded by the statement being
+  /// evaluated, if an evaluation is being recorded for \link Reload
+  /// \endlink.
+  void RecordLoad(const string &filename, const FileBuffer &buffer) const;
+
+  /// Returns whether the contents of the files loaded by the specified
+  /// statement are unchanged.
+  bool LoadsUnchanged(const ReloadStatement &statement) const;
+
+  /// Evaluates the statements of the specified token stream, which must
+  /// be tokenizing a buffer, using up to \link SetNumThreads\endlink
+  /// threads.
+  void EvalParallel(StreamTokenizer &st);
+
+  /// Concurrently evaluates the specified assignment statements, each
+  /// after those on which it depends, and then sets their variables in
+  /// the environment of this interpreter in order.
+  ///
+  /// \param data       the characters from which the tokens were read
+  /// \param size       the number of characters in \c data
+  /// \param tokens     the tokens of the statements
+  /// \param statements the statements to evaluate
+  /// \return whether all statements were evaluated without error
+  bool EvalStatements(const char *data, size_t size,
+                      const vector<StreamTokenizer::Token> &tokens,
+                      vector<ParallelStatement> *statements);
+
+  /// Returns the message reported for an exception caught while
+  /// evaluating the specified token stream.
+  string ExceptionReport(StreamTokenizer &st, const string &what) const;
+
   /// Reads and evaluates an import statement.
   void Import(StreamTokenizer &st);
 
@@ -401,8 +1261,35 @@ class Interpreter {
   /// being interpreted.
   vector<string> filenames_;
 
-  // The object for building new istream objects from named files.
-  unique_ptr<IStreamBuilder> istream_builder_;
+  // The object for building new istream objects from named files, shared
+  // by an interpreter and its forks.
+  shared_ptr<IStreamBuilder> istream_builder_;
+
+  // The cache of tokenized imported files, or nullptr if imports are not
+  // cached.
+  shared_ptr<ImportCache> import_cache_;
+
+  // Whether to tokenize input in streaming mode.
+  bool streaming_ = false;
+
+  // The maximum number of statements to evaluate concurrently.
+  int num_threads_ = 1;
+
+  // Whether to construct objects on first use.
+  bool lazy_ = false;
+
+  // The profiler of evaluations, shared with forks, if profiling is
+  // enabled.
+  shared_ptr<Profiler> profiler_;
+
+  // The evaluation being recorded for a snapshot, if any.
+  unique_ptr<SnapshotRecording> recording_;
+
+  // The last evaluation recorded for Reload, if any.
+  unique_ptr<ReloadRecording> reload_;
+
+  // The evaluation being recorded for Reload, if any.
+  unique_ptr<ReloadRecording> reloading_;
 
   // The debug level of this interpreter.
   int debug_;
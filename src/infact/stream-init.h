@@ -36,6 +36,8 @@
 #ifndef INFACT_STREAM_INIT_H_
 #define INFACT_STREAM_INIT_H_
 
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
@@ -57,13 +59,209 @@ using std::vector;
 
 class Environment;
 
+/// Parses exactly the specified characters as an <tt>int</tt> of the
+/// form <tt>-?[0-9]{1,9}</tt>, producing the same value as
+/// <tt>atoi</tt>, or returns <tt>false</tt> if the characters are not of
+/// that form.
+inline bool FastParseInt(const char *s, size_t n, int *value) {
+  size_t i = n > 0 && s[0] == '-' ? 1 : 0;
+  if (i == n || n - i > 9) {
+    return false;
+  }
+  int result = 0;
+  for (; i < n; ++i) {
+    unsigned digit = static_cast<unsigned char>(s[i]) - '0';
+    if (digit > 9) {
+      return false;
+    }
+    result = result * 10 + static_cast<int>(digit);
+  }
+  *value = s[0] == '-' ? -result : result;
+  return true;
+}
+
+/// Parses exactly the specified characters as an <tt>int64_t</tt> of
+/// the form <tt>-?[0-9]{1,18}</tt>, or returns <tt>false</tt> if the
+/// characters are not of that form.
+inline bool FastParseInt64(const char *s, size_t n, int64_t *value) {
+  size_t i = n > 0 && s[0] == '-' ? 1 : 0;
+  if (i == n || n - i > 18) {
+    return false;
+  }
+  int64_t result = 0;
+  for (; i < n; ++i) {
+    unsigned digit = static_cast<unsigned char>(s[i]) - '0';
+    if (digit > 9) {
+      return false;
+    }
+    result = result * 10 + static_cast<int64_t>(digit);
+  }
+  *value = s[0] == '-' ? -result : result;
+  return true;
+}
+
+/// Splits exactly the specified characters, a decimal number of the form
+/// <tt>-?[0-9]*(.[0-9]*)?([eE][-+]?[0-9]+)?</tt>, into its sign, its
+/// digits as an integer and the power of ten by which that integer is
+/// scaled, or returns <tt>false</tt> if the characters are not of that
+/// form or there are more than 19 digits.
+inline bool FastParseDecimal(const char *s, size_t n, bool *negative,
+                             uint64_t *mantissa, int *exponent) {
+  size_t i = 0;
+  *negative = n > 0 && s[0] == '-';
+  if (*negative) {
+    ++i;
+  }
+  *mantissa = 0;
+  *exponent = 0;
+  int num_digits = 0;
+  bool saw_point = false;
+  for (; i < n; ++i) {
+    unsigned digit = static_cast<unsigned char>(s[i]) - '0';
+    if (digit <= 9) {
+      if (++num_digits > 19) {
+        return false;
+      }
+      *mantissa = *mantissa * 10 + digit;
+      if (saw_point) {
+        --*exponent;
+      }
+    } else if (s[i] == '.' && !saw_point) {
+      saw_point = true;
+    } else {
+      break;
+    }
+  }
+  if (num_digits == 0) {
+    return false;
+  }
+  if (i < n) {
+    if (s[i] != 'e' && s[i] != 'E') {
+      return false;
+    }
+    ++i;
+    bool negative_exponent = i < n && s[i] == '-';
+    if (i < n && (s[i] == '-' || s[i] == '+')) {
+      ++i;
+    }
+    if (i == n || n - i > 4) {
+      return false;
+    }
+    int explicit_exponent = 0;
+    for (; i < n; ++i) {
+      unsigned digit = static_cast<unsigned char>(s[i]) - '0';
+      if (digit > 9) {
+        return false;
+      }
+      explicit_exponent = explicit_exponent * 10 + static_cast<int>(digit);
+    }
+    *exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+  }
+  return true;
+}
+
+/// Parses exactly the specified characters as a decimal floating-point
+/// number of the form <tt>-?[0-9]*(.[0-9]*)?([eE][-+]?[0-9]+)?</tt>,
+/// independently of the current locale, or returns <tt>false</tt> if the
+/// characters are not of that form or the number cannot be computed
+/// this way.  This is the &ldquo;fast path&rdquo; of Clinger&rsquo;s
+/// algorithm: when the digits form an integer exactly representable as a
+/// <tt>double</tt> scaled by a power of ten that is as well, a single
+/// multiplication or division yields the correctly rounded result, which
+/// is identical to that of <tt>strtod</tt>.
+inline bool FastParseDouble(const char *s, size_t n, double *value) {
+  static const double kPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  bool negative;
+  uint64_t mantissa;
+  int exponent;
+  if (!FastParseDecimal(s, n, &negative, &mantissa, &exponent) ||
+      mantissa > (static_cast<uint64_t>(1) << 53) ||
+      exponent < -22 || exponent > 22) {
+    return false;
+  }
+  double result = static_cast<double>(mantissa);
+  result = exponent < 0 ?
+      result / kPowersOfTen[-exponent] : result * kPowersOfTen[exponent];
+  *value = negative ? -result : result;
+  return true;
+}
+
+/// Parses exactly the specified characters as a <tt>float</tt>, just as
+/// \link FastParseDouble\endlink parses a <tt>double</tt>: the fast path
+/// applies when the digits form an integer of at most 24 bits scaled by
+/// a power of ten of at most 10, yielding the same result as
+/// <tt>strtof</tt>.
+inline bool FastParseFloat(const char *s, size_t n, float *value) {
+  static const float kPowersOfTen[] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+  };
+  bool negative;
+  uint64_t mantissa;
+  int exponent;
+  if (!FastParseDecimal(s, n, &negative, &mantissa, &exponent) ||
+      mantissa > (static_cast<uint64_t>(1) << 24) ||
+      exponent < -10 || exponent > 10) {
+    return false;
+  }
+  float result = static_cast<float>(mantissa);
+  result = exponent < 0 ?
+      result / kPowersOfTen[-exponent] : result * kPowersOfTen[exponent];
+  *value = negative ? -result : result;
+  return true;
+}
+
+/// Returns the value of the specified <tt>NUMBER</tt> token as an
+/// <tt>int</tt>, exactly as <tt>atoi</tt> would.
+inline int ParseInt(const string &tok) {
+  int value;
+  return FastParseInt(tok.data(), tok.size(), &value) ?
+      value : atoi(tok.c_str());
+}
+
+/// Returns the value of the specified <tt>NUMBER</tt> token as a
+/// <tt>double</tt>, exactly as <tt>atof</tt> would in the C locale.
+inline double ParseDouble(const string &tok) {
+  double value;
+  return FastParseDouble(tok.data(), tok.size(), &value) ?
+      value : atof(tok.c_str());
+}
+
+/// Returns the value of the specified <tt>NUMBER</tt> token as a
+/// <tt>float</tt>, exactly as <tt>strtof</tt> would in the C locale.
+inline float ParseFloat(const string &tok) {
+  float value;
+  return FastParseFloat(tok.data(), tok.size(), &value) ?
+      value : strtof(tok.c_str(), nullptr);
+}
+
+/// Parses the specified <tt>NUMBER</tt> token as an <tt>int64_t</tt>,
+/// returning <tt>false</tt> if it is not an integer or is out of range,
+/// rather than silently truncating it as <tt>atoi</tt> would.
+inline bool ParseInt64(const string &tok, int64_t *value) {
+  if (FastParseInt64(tok.data(), tok.size(), value)) {
+    return true;
+  }
+  errno = 0;
+  char *end = nullptr;
+  long long result = strtoll(tok.c_str(), &end, 10);
+  if (errno != 0 || end == tok.c_str() || *end != '\0') {
+    return false;
+  }
+  *value = static_cast<int64_t>(result);
+  return true;
+}
+
 /// \class StreamInitializer
 ///
 /// An interface that allows for a primitive, \link infact::Factory
 /// Factory\endlink-constructible object or vector thereof to be
 /// initialized based on the next token or tokens from a token stream.
-/// The data member may be an <tt>int</tt>, a <tt>double</tt>, a
-/// <tt>string</tt> or a <tt>shared_ptr</tt> to another
+/// The data member may be an <tt>int</tt>, an <tt>int64_t</tt>, a
+/// <tt>float</tt>, a <tt>double</tt>, a <tt>bool</tt>, a <tt>string</tt>
+/// or a <tt>shared_ptr</tt> to another
 /// Factory-constructible type.
 class StreamInitializer {
  public:
@@ -123,7 +321,7 @@ class Initializer<int> : public StreamInitializer {
              << st.Peek() << "\"";
       Error(err_ss.str());
     }
-    (*member_) = atoi(st.Next().c_str());
+    (*member_) = ParseInt(st.Next());
   }
  private:
   int *member_;
@@ -145,12 +343,64 @@ class Initializer<double> : public StreamInitializer {
              << st.Peek() << "\"";
       Error(err_ss.str());
     }
-    (*member_) = atof(st.Next().c_str());
+    (*member_) = ParseDouble(st.Next());
   }
  private:
   double *member_;
 };
 
+/// A specialization to initialize <tt>int64_t</tt> data members.
+template<>
+class Initializer<int64_t> : public StreamInitializer {
+ public:
+  Initializer(int64_t *member) : member_(member) { }
+  virtual ~Initializer() { }
+  virtual void Init(StreamTokenizer &st, Environment *env = nullptr) {
+    StreamTokenizer::TokenType token_type = st.PeekTokenType();
+    if (token_type != StreamTokenizer::NUMBER) {
+      ostringstream err_ss;
+      err_ss << "Int64Initializer: expected NUMBER token at stream "
+             << "position " << st.PeekTokenStart() << " but found "
+             << StreamTokenizer::TypeName(token_type) << " token: \""
+             << st.Peek() << "\"";
+      Error(err_ss.str());
+    }
+    size_t next_tok_start = st.PeekTokenStart();
+    string next_tok = st.Next();
+    if (!ParseInt64(next_tok, member_)) {
+      ostringstream err_ss;
+      err_ss << "Int64Initializer: expected a 64-bit integer at stream "
+             << "position " << next_tok_start << " but found \""
+             << next_tok << "\"";
+      Error(err_ss.str());
+    }
+  }
+ private:
+  int64_t *member_;
+};
+
+/// A specialization to initialize <tt>float</tt> data members.
+template<>
+class Initializer<float> : public StreamInitializer {
+ public:
+  Initializer(float *member) : member_(member) { }
+  virtual ~Initializer() { }
+  virtual void Init(StreamTokenizer &st, Environment *env = nullptr) {
+    StreamTokenizer::TokenType token_type = st.PeekTokenType();
+    if (token_type != StreamTokenizer::NUMBER) {
+      ostringstream err_ss;
+      err_ss << "FloatInitializer: expected NUMBER token at stream "
+             << "position " << st.PeekTokenStart() << " but found "
+             << StreamTokenizer::TypeName(token_type) << " token: \""
+             << st.Peek() << "\"";
+      Error(err_ss.str());
+    }
+    (*member_) = ParseFloat(st.Next());
+  }
+ private:
+  float *member_;
+};
+
 /// A specialization to initialize <tt>bool</tt> data members.
 template<>
 class Initializer<bool> : public StreamInitializer {
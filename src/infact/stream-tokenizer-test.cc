@@ -35,6 +35,7 @@
 /// \author dbikel@google.com (Dan Bikel)
 
 #include <iostream>
+#include <sstream>
 #include <string>
 
 #include "stream-tokenizer.h"
@@ -102,6 +103,22 @@ main(int argc, char **argv) {
     cout << "chars so far: '" << st1.str() << "'" << endl;
   }
 
+  cerr << "\nTesting streaming mode with a capture:" << endl;
+  std::istringstream test_stream(test_string);
+  StreamTokenizer st3(test_stream);
+  st3.EnableStreaming();
+  st3.Next();
+  st3.Next();
+  StreamTokenizer::Capture capture(st3);
+  while (st3.HasNext()) {
+    StreamTokenizer::TokenType type = st3.PeekTokenType();
+    cout << "token: \"" << st3.Next() << "\""
+         << "; type=" << StreamTokenizer::TypeName(type)
+         << "; captured so far: '" << capture.str() << "'" << endl;
+  }
+  st3.Putback();
+  cout << "after Putback, next token: \"" << st3.Peek() << "\"" << endl;
+
   cerr << "\nReading from stdin until EOF:" << endl;
 
   StreamTokenizer st2(cin);
@@ -44,7 +44,9 @@ namespace infact {
 
 void
 StreamTokenizer::ConsumeChar(char c) {
-  oss_ << c;
+  if (buf_ == nullptr) {
+    history_ += c;
+  }
   ++num_read_;
   if (c == '\n') {
     ++line_number_;
@@ -52,8 +54,93 @@ StreamTokenizer::ConsumeChar(char c) {
   }
 }
 
+void
+StreamTokenizer::DropHistory() {
+  if (replay_ != nullptr) {
+    // Replayed tokens belong to the caller, and so are never discarded.
+    return;
+  }
+  while (next_token_idx_ > max_rewind_) {
+    token_.pop_front();
+    --next_token_idx_;
+    ++num_dropped_;
+  }
+  if (buf_ != nullptr) {
+    // Nothing to discard: the characters belong to the caller's buffer.
+    return;
+  }
+  // The line of the oldest retained token is kept for the context of
+  // errors, unless it can be re-read.
+  size_t keep_from = token_.empty() ? num_read_ :
+      reread_ ? token_.front().start : token_.front().line_start_pos;
+  if (!captures_.empty() && captures_.front() < keep_from) {
+    keep_from = captures_.front();
+  }
+  // Only discard characters in large chunks, to keep the cost of erasing
+  // from the front of history_ amortized constant per character.
+  size_t num_discardable = keep_from - history_start_;
+  if (num_discardable > 4096 && num_discardable > history_.size() / 2) {
+    history_.erase(0, num_discardable);
+    history_start_ = keep_from;
+  }
+}
+
+void
+StreamTokenizer::Reset(const char *data, size_t size) {
+  if (buf_ == nullptr || replay_ != nullptr || !captures_.empty()) {
+    Error("StreamTokenizer: error: can only reset an instance "
+          "tokenizing a buffer, with no live captures");
+  }
+  buf_ = data;
+  buf_size_ = size;
+  num_read_ = 0;
+  line_number_ = 0;
+  line_start_pos_ = 0;
+  eof_reached_ = false;
+  history_start_ = 0;
+  num_dropped_ = 0;
+  token_.clear();
+  next_token_idx_ = 0;
+  ReadToken();
+}
+
+void
+StreamTokenizer::RewindError(size_t num_tokens) const {
+  ostringstream err_ss;
+  err_ss << "StreamTokenizer: error: cannot rewind " << num_tokens
+         << " tokens in streaming mode, which retains only the last "
+         << max_rewind_ << " tokens";
+  Error(err_ss.str());
+}
+
+string
+StreamTokenizer::Substr(size_t start, size_t length) const {
+  if (buf_ != nullptr) {
+    return string(buf_ + start, length);
+  }
+  if (start < history_start_ && reread_) {
+    return reread_(start, length);
+  }
+  if (start < history_start_) {
+    ostringstream err_ss;
+    err_ss << "StreamTokenizer: error: characters starting at stream "
+           << "position " << start << " are no longer retained";
+    Error(err_ss.str());
+  }
+  return history_.substr(start - history_start_, length);
+}
+
 bool
 StreamTokenizer::ReadChar(char *c) {
+  if (buf_ != nullptr) {
+    if (num_read_ >= buf_size_) {
+      eof_reached_ = true;
+      return false;
+    }
+    (*c) = buf_[num_read_];
+    ConsumeChar(*c);
+    return true;
+  }
   (*c) = is_.get();
   if (!is_.good()) {
     eof_reached_ = true;
@@ -64,9 +151,85 @@ StreamTokenizer::ReadChar(char *c) {
   }
 }
 
+void
+StreamTokenizer::BuildReservedWordTable() {
+  vector<const string *> words;
+  reserved_word_sizes_ = 0;
+  numeric_reserved_words_ = false;
+  for (const string &word : reserved_words_) {
+    // No token is ever empty.
+    if (word.empty()) {
+      continue;
+    }
+    words.push_back(&word);
+    size_t size_bit = word.size() < 63 ? word.size() : 63;
+    reserved_word_sizes_ |= uint64_t(1) << size_bit;
+    if (word != "-" &&
+        (word[0] == '-' || (word[0] >= '0' && word[0] <= '9'))) {
+      numeric_reserved_words_ = true;
+    }
+  }
+
+  // Start with a table at most half full, and search for a seed that
+  // leaves no collisions, doubling the table a few times if need be.
+  int bits = 1;
+  while ((size_t(1) << bits) < 2 * words.size()) {
+    ++bits;
+  }
+  const int kMaxExtraBits = 3;
+  const uint32_t kNumSeeds = 256;
+  vector<const string *> table;
+  for (int extra_bits = 0; extra_bits <= kMaxExtraBits; ++extra_bits) {
+    int shift = 32 - (bits + extra_bits);
+    for (uint32_t i = 0; i < kNumSeeds; ++i) {
+      // Odd multipliers spread across the 32-bit range.
+      uint32_t seed = (i * 0x9E3779B9u) | 1u;
+      table.assign(size_t(1) << (bits + extra_bits), nullptr);
+      bool perfect = true;
+      for (const string *word : words) {
+        size_t slot = (WordHash(word->data(), word->size()) * seed) >> shift;
+        if (table[slot] != nullptr) {
+          perfect = false;
+          break;
+        }
+        table[slot] = word;
+      }
+      if (perfect) {
+        reserved_word_table_.swap(table);
+        reserved_word_seed_ = seed;
+        reserved_word_shift_ = shift;
+        reserved_word_max_probe_ = 0;
+        return;
+      }
+    }
+  }
+
+  // Some reserved words could not be told apart by WordHash (they have
+  // the same size and the same first, middle and last characters), so
+  // fall back on linear probing in the largest table.
+  int shift = 32 - (bits + kMaxExtraBits);
+  size_t mask = (size_t(1) << (bits + kMaxExtraBits)) - 1;
+  table.assign(mask + 1, nullptr);
+  reserved_word_max_probe_ = 0;
+  for (const string *word : words) {
+    size_t slot = WordHash(word->data(), word->size()) >> shift;
+    size_t probe = 0;
+    while (table[(slot + probe) & mask] != nullptr) {
+      ++probe;
+    }
+    table[(slot + probe) & mask] = word;
+    if (probe > reserved_word_max_probe_) {
+      reserved_word_max_probe_ = probe;
+    }
+  }
+  reserved_word_table_.swap(table);
+  reserved_word_seed_ = 1;
+  reserved_word_shift_ = shift;
+}
+
 bool
 StreamTokenizer::GetNext(Token *next) {
-  if (!is_.good()) {
+  if (!Good()) {
     eof_reached_ = true;
     return false;
   }
@@ -77,10 +240,10 @@ StreamTokenizer::GetNext(Token *next) {
     if (!ReadChar(&c)) {
       return false;
     }
-    is_whitespace = isspace(c);
+    is_whitespace = Whitespace(c);
 
     // If we find a comment character, then read to the end of the line.
-    if (!is_whitespace && c == '/' && is_.peek() == '/') {
+    if (!is_whitespace && c == '/' && PeekChar() == '/') {
       while (c != '\n') {
         if (!ReadChar(&c)) {
           return false;
@@ -107,7 +270,7 @@ StreamTokenizer::GetNext(Token *next) {
     // until hitting a non-escaped double quote.
     streampos string_literal_start_pos = num_read_ - 1;
     bool found_closing_quote = false;
-    while (is_.good()) {
+    while (Good()) {
       bool success = ReadChar(&c);
       if (success) {
         if (c == '"') {
@@ -139,7 +302,26 @@ StreamTokenizer::GetNext(Token *next) {
     next->tok += c;
     next->type = (c == '-' || (c >= '0' && c <= '9')) ? NUMBER : IDENTIFIER;
   }
-  if (!next_tok_complete) {
+  if (!next_tok_complete && buf_ != nullptr) {
+    // The current token is a number, a reserved word or C++
+    // identifier, so we scan the buffer until hitting a "reserved
+    // character", a whitespace character or the end of the buffer;
+    // no character of the token can be a newline, so there is no
+    // need to consume the token's characters one at a time.
+    size_t end = num_read_;
+    while (end < buf_size_ && !EndsToken(buf_[end])) {
+      ++end;
+    }
+    next->tok.assign(buf_ + next->start, end - next->start);
+    num_read_ = end;
+    if (end < buf_size_) {
+      if (IsReservedWord(next->tok.data(), next->tok.size())) {
+        next->type = RESERVED_WORD;
+      }
+    } else {
+      eof_reached_ = true;
+    }
+  } else if (!next_tok_complete) {
     // The current token is a number, a reserved word or C++
     // identifier, so we keep reading characters until hitting a
     // "reserved character", a whitespace character or EOF.
@@ -152,11 +334,11 @@ StreamTokenizer::GetNext(Token *next) {
       int peek = is_.peek();
       if (peek != EOF) {
         char next_char = static_cast<char>(peek);
-        if (ReservedChar(next_char) || next_char == '"' || isspace(next_char)) {
+        if (EndsToken(next_char)) {
           // Now that we've finished reading something that is not a
           // string literal, change its type to be RESERVED_WORD if it
           // exactly matches something in the set of reserved words.
-          if (reserved_words_.count(next->tok) != 0) {
+          if (IsReservedWord(next->tok.data(), next->tok.size())) {
             next->type = RESERVED_WORD;
           }
           done = true;
@@ -178,13 +360,14 @@ StreamTokenizer::GetNext(Token *next) {
 
 namespace {
 
-/// Returns the line beginning at \c pos.
-string getline(const string &str, size_t pos) {
-  string curr_line;
-  for (; pos < str.length() && str[pos] != '\n'; ++pos) {
-    curr_line += str[pos];
+/// Returns the line beginning at \c pos of the first \c size characters
+/// of \c str.
+string getline(const char *str, size_t size, size_t pos) {
+  size_t end = pos;
+  while (end < size && str[end] != '\n') {
+    ++end;
   }
-  return curr_line;
+  return pos < end ? string(str + pos, end - pos) : string();
 }
 
 }
@@ -192,7 +375,25 @@ string getline(const string &str, size_t pos) {
 string
 StreamTokenizer::line() {
   if (HasPrev()) {
-    return getline(str(), token_[next_token_idx_ - 1].line_start_pos);
+    size_t line_start_pos = token(next_token_idx_ - 1).line_start_pos;
+    if (buf_ != nullptr) {
+      // The whole line is available, whether or not it has been read.
+      return getline(buf_, buf_size_, line_start_pos);
+    }
+    if (line_start_pos < history_start_ && reread_) {
+      // Only the characters of the line up to the start of the retained
+      // characters need be re-read.
+      string line = reread_(line_start_pos, history_start_ - line_start_pos);
+      if (line.find('\n') == string::npos) {
+        line += getline(history_.data(), history_.size(), 0);
+      }
+      return getline(line.data(), line.size(), 0);
+    }
+    if (line_start_pos < history_start_) {
+      line_start_pos = history_start_;
+    }
+    return getline(history_.data(), history_.size(),
+                   line_start_pos - history_start_);
   } else {
     return "";
   }
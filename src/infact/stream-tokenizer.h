@@ -36,10 +36,14 @@
 #ifndef INFACT_STREAM_TOKENIZER_H_
 #define INFACT_STREAM_TOKENIZER_H_
 
+#include <ctype.h>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <set>
 #include <sstream>
 #include <stdexcept>
+#include <stdint.h>
 #include <string>
 #include <string.h>
 #include <vector>
@@ -48,6 +52,7 @@
 
 namespace infact {
 
+using std::deque;
 using std::istream;
 using std::istringstream;
 using std::ostringstream;
@@ -71,10 +76,14 @@ static const char *default_reserved_words[] = {
   "true",
   "bool",
   "int",
+  "int64",
+  "float",
   "double",
   "string",
   "bool[]",
   "int[]",
+  "int64[]",
+  "float[]",
   "double[]",
   "string[]",
 };
@@ -82,6 +91,11 @@ static const char *default_reserved_words[] = {
 /// Default set of reserved characters for the StreamTokenizer class.
 #define DEFAULT_RESERVED_CHARS "(){},=;/"
 
+/// The default number of previously returned tokens retained by a
+/// StreamTokenizer in streaming mode, which is the maximum number of
+/// tokens the Interpreter ever puts back.
+#define DEFAULT_STREAMING_MAX_REWIND 1
+
 /// \class StreamTokenizer
 ///
 /// A simple class for tokenizing a stream of tokens for the formally
@@ -142,7 +156,8 @@ class StreamTokenizer {
     Init(reserved_chars);
   }
 
-  /// Constructs a new instance around the specified string.
+  /// Constructs a new instance around the specified string.  The
+  /// string is copied once, and then tokenized directly from memory.
   ///
   /// \param s              the string providing the stream of characters
   ///                       for this stream tokenizer to use
@@ -150,42 +165,179 @@ class StreamTokenizer {
   ///                       &ldquo;reserved characters&rdquo;
   StreamTokenizer(const string &s,
                   const char *reserved_chars = DEFAULT_RESERVED_CHARS) :
-      sstream_(s), is_(sstream_) {
+      is_(sstream_), owned_buf_(s) {
+    buf_ = owned_buf_.data();
+    buf_size_ = owned_buf_.size();
     Init(reserved_chars);
   }
 
+  /// Constructs a new instance around the specified contiguous buffer
+  /// of characters, such as a memory-mapped file.  The buffer is
+  /// neither copied nor modified, and it must outlive this instance.
+  /// Tokenizing from a buffer is much faster than tokenizing from an
+  /// <tt>istream</tt>, since characters are not read one at a time, and
+  /// the characters read so far need not be recorded separately.
+  ///
+  /// \param data           the characters for this stream tokenizer to use
+  /// \param size           the number of characters in \c data
+  /// \param reserved_chars the set of single characters serving as
+  ///                       &ldquo;reserved characters&rdquo;
+  StreamTokenizer(const char *data, size_t size,
+                  const char *reserved_chars = DEFAULT_RESERVED_CHARS) :
+      is_(sstream_), buf_(data), buf_size_(size) {
+    Init(reserved_chars);
+  }
+
+  /// Constructs a new instance that replays the specified tokens, which
+  /// were previously read by another stream tokenizer from the specified
+  /// buffer of characters.  No characters are scanned, and neither the
+  /// tokens nor the buffer are copied, so both must outlive this
+  /// instance.  The stream positions of the replayed tokens (and
+  /// therefore those reported by this instance) are those of the buffer.
+  ///
+  /// \param data       the characters from which the tokens were read
+  /// \param size       the number of characters in \c data
+  /// \param tokens     the first of the tokens to replay
+  /// \param num_tokens the number of tokens to replay
+  StreamTokenizer(const char *data, size_t size,
+                  const Token *tokens, size_t num_tokens) :
+      is_(sstream_), buf_(data), buf_size_(size),
+      eof_reached_(true), replay_(tokens), replay_size_(num_tokens) {
+    if (num_tokens > 0) {
+      const Token &last = tokens[num_tokens - 1];
+      num_read_ = last.curr_pos;
+      line_number_ = last.line_number;
+    }
+  }
+
+  /// Makes this instance tokenize the specified contiguous buffer of
+  /// characters from its beginning, as if it had just been constructed
+  /// around it, while keeping its reserved characters and words, so that
+  /// many short strings may be tokenized without building those tables
+  /// again for each.  As with the constructor, the buffer is neither
+  /// copied nor modified, and it must outlive its use by this instance.
+  /// It is an error to reset an instance that is tokenizing an
+  /// <tt>istream</tt> or replaying tokens, or while a \link Capture
+  /// \endlink of it exists.
+  ///
+  /// \param data the characters for this stream tokenizer to use
+  /// \param size the number of characters in \c data
+  void Reset(const char *data, size_t size);
+
   /// Sets the set of &ldquo;reserved words&rdquo; used by this stream
   /// tokenizer.  Should be invoked just after construction time.
   void set_reserved_words(set<string> &reserved_words) {
     reserved_words_ = reserved_words;
+    BuildReservedWordTable();
   }
 
   /// Destroys this instance.
-  virtual ~StreamTokenizer() {
-    delete[] reserved_chars_;
+  virtual ~StreamTokenizer() { }
+
+  /// Puts this stream tokenizer into streaming mode, in which it retains
+  /// only the specified number of previously returned tokens, and only
+  /// the characters of the underlying byte stream that are still needed,
+  /// namely, those from the start of the line of the oldest retained
+  /// token and those held by a live \link Capture \endlink.  As such,
+  /// memory use stays bounded regardless of the size of the input.  In
+  /// streaming mode, it is an error to rewind past the retained tokens,
+  /// and \link str \endlink returns only the retained characters.
+  ///
+  /// \param max_rewind the maximum number of tokens that may be put back
+  void EnableStreaming(size_t max_rewind = DEFAULT_STREAMING_MAX_REWIND) {
+    streaming_ = true;
+    max_rewind_ = max_rewind;
+    DropHistory();
   }
 
+  /// Returns whether this stream tokenizer is in streaming mode.
+  bool streaming() const { return streaming_; }
+
+  /// A function returning the specified number of characters of the
+  /// underlying byte stream starting at the specified stream position
+  /// (or fewer, if the stream ends first), as by re-reading them from
+  /// its source.
+  typedef std::function<string(size_t start, size_t length)> RereadFunction;
+
+  /// Sets the function with which this stream tokenizer re-reads the
+  /// characters of its underlying byte stream that it no longer retains,
+  /// such as a file it is reading that can be opened again.  The
+  /// context of an error (see \link line\endlink) is then never lost in
+  /// streaming mode, and so the characters of the line of the oldest
+  /// retained token need not be retained for it: only those from the
+  /// start of that token are, which bounds memory use even for inputs
+  /// consisting of a single, very long line.  This function is only
+  /// invoked when an error is reported or characters no longer retained
+  /// are otherwise requested, so it may be slow.
+  void set_reread(RereadFunction reread) { reread_ = std::move(reread); }
+
+  /// Keeps the characters of the underlying byte stream from the start
+  /// of the next token available for as long as it exists, even in
+  /// streaming mode.  This is how the characters making up a single
+  /// object&rsquo;s specification are captured.  Captures may be
+  /// nested, and must be destroyed in the reverse order of their
+  /// construction (as is the case for local variables).
+  class Capture {
+   public:
+    /// Begins capturing characters of the specified stream tokenizer,
+    /// starting with its next token.
+    explicit Capture(StreamTokenizer &st) :
+        st_(st), start_(st.PeekTokenStart()) {
+      st_.captures_.push_back(start_);
+    }
+
+    /// Ends this capture.
+    ~Capture() {
+      st_.captures_.pop_back();
+    }
+
+    /// Returns the stream position of the first captured character.
+    size_t start() const { return start_; }
+
+    /// Returns the characters from the start of this capture through
+    /// the end of the most recently returned token.
+    string str() const {
+      size_t end = st_.tellg();
+      return st_.Substr(start_, end > start_ ? end - start_ : 0);
+    }
+
+   private:
+    StreamTokenizer &st_;
+    size_t start_;
+  };
+
   /// Returns the entire sequence of characters read so far by this
-  /// stream tokenizer as a newly constructed string object.
-  string str() { return oss_.str(); }
+  /// stream tokenizer as a newly constructed string object, or, in
+  /// streaming mode, those characters read so far that are still retained.
+  string str() {
+    return buf_ != nullptr ? string(buf_, num_read_) : history_;
+  }
+
+  /// Returns the specified number of characters of the underlying byte
+  /// stream read so far, starting at the specified stream position,
+  /// without copying the rest of the stream.  It is an error to request
+  /// characters no longer retained in streaming mode, unless they can be
+  /// re-read with the function set by \link set_reread\endlink.
+  string Substr(size_t start, size_t length) const;
 
   /// Returns the number of bytes read from the underlying byte
   /// stream just after scanning the most recent token, or 0 if this stream
   /// is just about to return the first token.
   size_t tellg() const {
-    return HasPrev() ? token_[next_token_idx_ - 1].curr_pos : 0;
+    return HasPrev() ? token(next_token_idx_ - 1).curr_pos : 0;
   }
 
   /// Returns the number of lines read from the underlying byte stream,
   /// where a line is any number of bytes followed by a newline character
   /// (i.e., this is ASCII-centric).
   size_t line_number() const {
-    return HasNext() ? token_[next_token_idx_].line_number : line_number_;
+    return HasNext() ? token(next_token_idx_).line_number : line_number_;
   }
 
   /// Returns a string consisting of the characters read so far of the current
-  /// line containing the most recently returned token, or the empty string
-  /// if no tokens have been read yet.
+  /// line containing the most recently returned token (or all of them, when
+  /// tokenizing a buffer), or the empty string if no tokens have been read
+  /// yet.
   string line();
 
   /// Returns the stream position of the current line in the underlying
@@ -193,48 +345,51 @@ class StreamTokenizer {
   /// if the most recently consumed character is a newline and there are
   /// no more tokens in the stream.
   size_t line_start() {
-    return HasNext() ? token_[next_token_idx_].line_start_pos : 0;
+    return HasNext() ? token(next_token_idx_).line_start_pos : 0;
   }
 
   /// Returns whether there is another token in the token stream.
-  bool HasNext() const { return next_token_idx_ < token_.size(); }
+  bool HasNext() const { return next_token_idx_ < num_tokens(); }
 
   /// Returns whether there is a previous token in the stream.
   bool HasPrev() const { return next_token_idx_ > 0; }
 
   /// Returns the previous token, or the empty string if there is no
   /// previous token.
-  string PeekPrev() const {
-    return HasPrev() ? token_[next_token_idx_ - 1].tok : "";
+  const string &PeekPrev() const {
+    return HasPrev() ? token(next_token_idx_ - 1).tok : empty_;
   }
 
   /// Returns the line number of the previous token, or 0 if there is no
   /// previous token.
   size_t PeekPrevTokenLineNumber() const {
-    return HasPrev() ? token_[next_token_idx_ - 1].line_number : 0;
+    return HasPrev() ? token(next_token_idx_ - 1).line_number : 0;
   }
 
   /// Returns the stream position of the most recent line start of the
   /// previous token, or 0 if this stream is just about to return the
   /// first token.
   size_t PeekPrevTokenLineStart() const {
-    return HasPrev() ? token_[next_token_idx_ - 1].line_start_pos : 0;
+    return HasPrev() ? token(next_token_idx_ - 1).line_start_pos : 0;
   }
 
   /// Returns the stream position of the first byte of the previous
   /// token, or 0 if there is no previous token.
   size_t PeekPrevTokenStart() const {
-    return HasPrev() ? token_[next_token_idx_ - 1].start : 0;
+    return HasPrev() ? token(next_token_idx_ - 1).start : 0;
   }
 
   /// Returns the type of the previous token, or EOF_TYPE if there
   /// is no previous token.
   TokenType PeekPrevTokenType() const {
-    return HasPrev() ? token_[next_token_idx_ - 1].type : EOF_TYPE;
+    return HasPrev() ? token(next_token_idx_ - 1).type : EOF_TYPE;
   }
 
-  /// Returns the next token in the token stream.
-  string Next() {
+  /// Returns the next token in the token stream.  The returned reference
+  /// remains valid until this stream tokenizer is \link Reset \endlink
+  /// or destroyed, except that in streaming mode, where returned tokens
+  /// are discarded, it is valid only until the next call to this method.
+  const string &Next() {
     if (!HasNext()) {
       Error("invoking StreamTokenizer::Next when HasNext returns false");
     }
@@ -244,22 +399,29 @@ class StreamTokenizer {
     // Try to get the next token of the stream if we're about to run out of
     // tokens.
     if (!eof_reached_ && next_token_idx_ + 1 == token_.size()) {
-      Token next;
-      if (GetNext(&next)) {
-        token_.push_back(next);
-      }
+      ReadToken();
     }
-    // Ensure that we only advance if we haven't already reached token_.size().
-    if (next_token_idx_ < token_.size()) {
+    // Ensure that we only advance if we haven't already reached the end.
+    if (next_token_idx_ < num_tokens()) {
       ++next_token_idx_;
     }
 
-    return token_[curr_token_idx].tok;
+    const string &tok = token(curr_token_idx).tok;
+    if (streaming_ && next_token_idx_ > max_rewind_) {
+      // The deque keeps the returned reference valid, as long as we never
+      // discard the just-returned token (i.e., even if max_rewind_ is 0).
+      DropHistory();
+    }
+    return tok;
   }
 
   /// Rewinds this token stream to the beginning.  If the underlying stream
-  /// has no tokens, this is a no-op.
+  /// has no tokens, this is a no-op.  In streaming mode, it is an error
+  /// to invoke this method once any tokens have been discarded.
   void Rewind() {
+    if (num_dropped_ > 0) {
+      RewindError(next_token_idx_ + num_dropped_);
+    }
     next_token_idx_ = 0;
   }
 
@@ -268,6 +430,9 @@ class StreamTokenizer {
   /// so far, invoking this method will be functionally equivalent to invoking
   /// the no-argument Rewind() method.
   void Rewind(size_t num_tokens) {
+    if (num_tokens > next_token_idx_ && num_dropped_ > 0) {
+      RewindError(num_tokens);
+    }
     // Cannot rewind more than the number of tokens read so far.
     if (num_tokens > next_token_idx_) {
       num_tokens = next_token_idx_;
@@ -283,46 +448,153 @@ class StreamTokenizer {
   /// Returns the next token&rsquo;s start position, or the byte position
   /// of the underlying byte stream if there is no next token.
   size_t PeekTokenStart() const {
-    return HasNext() ? token_[next_token_idx_].start : num_read_;
+    return HasNext() ? token(next_token_idx_).start : num_read_;
   }
 
   /// Returns the type of the next token, or EOF_TYPE if there is no next
   /// token.
   TokenType PeekTokenType() const {
-    return HasNext() ? token_[next_token_idx_].type : EOF_TYPE;
+    return HasNext() ? token(next_token_idx_).type : EOF_TYPE;
   }
 
   /// Returns the line number of the first byte of the next token, or
   /// the current line number of the underlying stream if there is no
   /// next token.
   size_t PeekTokenLineNumber() const {
-    return HasNext() ? token_[next_token_idx_].line_number : line_number_;
+    return HasNext() ? token(next_token_idx_).line_number : line_number_;
   }
 
   /// Returns the next token that would be returned by the \link Next
   /// \endlink method.  The return value of this method is only valid
   /// when \link HasNext \endlink returns <tt>true</tt>.
-  string Peek() const { return HasNext() ? token_[next_token_idx_].tok : ""; }
+  const string &Peek() const {
+    return HasNext() ? token(next_token_idx_).tok : empty_;
+  }
+
+  /// Consumes, without constructing a token for each, a run of tokens
+  /// starting with the next token that consists of <tt>NUMBER</tt>
+  /// tokens separated by commas, such as the elements of a large
+  /// <tt>double[]</tt>, scanning the characters of the underlying buffer
+  /// directly.  The characters of each number are passed to the specified
+  /// callback, which returns whether it accepted them; the run ends just
+  /// before the first comma not followed by a number accepted by the
+  /// callback, after which this stream tokenizer is in the same state as
+  /// if each token of the run had been consumed via \link Next\endlink.
+  ///
+  /// This method only has an effect when tokenizing from a buffer and
+  /// when the next token has not been put back; otherwise, or if the
+  /// callback does not accept the next token, it returns 0 without
+  /// consuming anything.
+  ///
+  /// \param accept a callable object taking a <tt>const char *</tt> to the
+  ///               characters of a number and their count, returning
+  ///               whether it accepted the number
+  /// \return the number of numbers consumed
+  template <typename Callback>
+  size_t ScanNumberList(Callback &accept);
+
+  /// Returns the buffer of characters tokenized by this instance, or
+  /// nullptr if it tokenizes an <tt>istream</tt>.
+  const char *buffer() const { return buf_; }
+
+  /// Returns the number of characters in the buffer returned by \link
+  /// buffer\endlink.
+  size_t buffer_size() const { return buf_size_; }
+
+  /// Returns the number of occurrences of the specified character before
+  /// the first occurrence of the specified stop character in the
+  /// characters not yet scanned, or 0 when not tokenizing from a buffer.
+  /// This provides a cheap estimate of the size of a list.
+  size_t CountBefore(char c, char stop) const {
+    if (buf_ == nullptr || replay_ != nullptr) {
+      return 0;
+    }
+    size_t count = 0;
+    for (size_t i = num_read_; i < buf_size_ && buf_[i] != stop; ++i) {
+      count += buf_[i] == c;
+    }
+    return count;
+  }
+
+  /// Returns all the information about the next token, which is
+  /// suitable for later replay.  It is an error to invoke this method
+  /// when \link HasNext \endlink returns <tt>false</tt>.
+  const Token &PeekToken() const {
+    if (!HasNext()) {
+      Error("invoking StreamTokenizer::PeekToken when HasNext returns false");
+    }
+    return token(next_token_idx_);
+  }
 
  private:
   void Init(const char *reserved_chars) {
-    num_reserved_chars_ = strlen(reserved_chars);
-    reserved_chars_ = new char[num_reserved_chars_ + 1];
-    strcpy(reserved_chars_, reserved_chars);
+    for (int c = 0; c < 256; ++c) {
+      char_class_[c] = isspace(c) ? (kWhitespace | kTokenEnd) : 0;
+    }
+    char_class_[static_cast<unsigned char>('"')] |= kTokenEnd;
+    for (const char *c = reserved_chars; *c != '\0'; ++c) {
+      char_class_[static_cast<unsigned char>(*c)] |= kReservedChar | kTokenEnd;
+    }
     int num_reserved_words = sizeof(default_reserved_words)/sizeof(const char*);
     for (int i = 0; i < num_reserved_words; ++i) {
       reserved_words_.insert(string(default_reserved_words[i]));
     }
-    Token next;
-    if (GetNext(&next)) {
-      token_.push_back(next);
+    BuildReservedWordTable();
+    ReadToken();
+  }
+
+  /// Builds the hash table used by \link IsReservedWord \endlink from
+  /// the current set of reserved words.
+  void BuildReservedWordTable();
+
+  /// Reads the next token from the underlying stream, if there is one,
+  /// directly into the back of token_.
+  void ReadToken() {
+    token_.push_back(Token());
+    if (!GetNext(&token_.back())) {
+      token_.pop_back();
     }
   }
 
+  /// Returns the token at the specified index, either among those read
+  /// or among those being replayed.
+  const Token &token(size_t idx) const {
+    return replay_ != nullptr ? replay_[idx] : token_[idx];
+  }
+
+  /// Returns the number of tokens read and retained, or being replayed.
+  size_t num_tokens() const {
+    return replay_ != nullptr ? replay_size_ : token_.size();
+  }
+
   void ConsumeChar(char c);
 
+  /// In streaming mode, discards the tokens and characters of the
+  /// underlying byte stream that may no longer be needed.
+  void DropHistory();
+
+  /// Reports the error of rewinding past the tokens retained in streaming
+  /// mode.
+  void RewindError(size_t num_tokens) const;
+
   bool ReadChar(char *c);
 
+  /// Returns whether there may be more characters to read from the
+  /// underlying buffer or byte stream.
+  bool Good() const {
+    return buf_ != nullptr ? num_read_ < buf_size_ : is_.good();
+  }
+
+  /// Returns the next character of the underlying buffer or byte stream
+  /// without consuming it, or EOF if there are no more characters.
+  int PeekChar() {
+    if (buf_ != nullptr) {
+      return num_read_ < buf_size_ ?
+          static_cast<unsigned char>(buf_[num_read_]) : EOF;
+    }
+    return is_.peek();
+  }
+
   /// Retrieves the next token from the <tt>istream</tt> wrapped by this
   /// stream tokenizer.
   ///
@@ -335,8 +607,49 @@ class StreamTokenizer {
   /// Returns whether the specified character represents a
   /// &ldquo;reserved character&rdquo;.
   bool ReservedChar(char c) const {
-    for (size_t i = 0; i < num_reserved_chars_; ++i) {
-      if (c == reserved_chars_[i]) {
+    return (char_class_[static_cast<unsigned char>(c)] & kReservedChar) != 0;
+  }
+
+  /// Returns whether the specified character is a whitespace character.
+  bool Whitespace(char c) const {
+    return (char_class_[static_cast<unsigned char>(c)] & kWhitespace) != 0;
+  }
+
+  /// Returns whether the specified character ends a number, reserved
+  /// word or identifier token, i.e., whether it is a reserved
+  /// character, a double quote or a whitespace character.
+  bool EndsToken(char c) const {
+    return (char_class_[static_cast<unsigned char>(c)] & kTokenEnd) != 0;
+  }
+
+  /// Returns the hash of the specified non-empty word used to index
+  /// reserved_word_table_, computed from its length and its first,
+  /// middle and last characters.
+  static uint32_t WordHash(const char *word, size_t size) {
+    uint32_t h = static_cast<uint32_t>(size) * 0x9E3779B1u;
+    h ^= static_cast<unsigned char>(word[0]) * 0x85EBCA6Bu;
+    h ^= static_cast<unsigned char>(word[size / 2]) * 0xC2B2AE35u;
+    h ^= static_cast<unsigned char>(word[size - 1]) * 0x27D4EB2Fu;
+    return h;
+  }
+
+  /// Returns whether the specified characters exactly match one of the
+  /// reserved words of this stream tokenizer.
+  bool IsReservedWord(const char *word, size_t size) const {
+    if (size == 0 ||
+        (reserved_word_sizes_ & (uint64_t(1) << (size < 63 ? size : 63))) ==
+        0) {
+      return false;
+    }
+    size_t mask = reserved_word_table_.size() - 1;
+    size_t slot = (WordHash(word, size) * reserved_word_seed_) >>
+                  reserved_word_shift_;
+    for (size_t probe = 0; probe <= reserved_word_max_probe_; ++probe) {
+      const string *entry = reserved_word_table_[(slot + probe) & mask];
+      if (entry == nullptr) {
+        return false;
+      }
+      if (entry->size() == size && memcmp(entry->data(), word, size) == 0) {
         return true;
       }
     }
@@ -349,23 +662,79 @@ class StreamTokenizer {
   /// This data member is for use when we need to construct the is_ data member
   /// from a string at construction time.
   istringstream sstream_;
-  /// The underlying byte stream of this token stream.
+  /// The underlying byte stream of this token stream, unused when
+  /// tokenizing from a buffer.
   istream &is_;
+  /// This data member holds a copy of the string this instance was
+  /// constructed with, if any, and is the buffer pointed to by buf_.
+  string owned_buf_;
+  /// The buffer of characters being tokenized, or nullptr if this instance
+  /// is tokenizing the byte stream is_.
+  const char *buf_ = nullptr;
+  /// The number of characters in buf_.
+  size_t buf_size_ = 0;
 
   // Information about special tokens.
-  char *reserved_chars_;
-  size_t num_reserved_chars_;
+
+  /// The classes of characters, as bits of char_class_ entries.
+  enum CharClass {
+    kReservedChar = 1,
+    kWhitespace = 2,
+    kTokenEnd = 4,
+  };
+  /// The CharClass bits of every character, indexed by its unsigned value.
+  unsigned char char_class_[256] = {};
   set<string> reserved_words_;
+  /// An open-addressing hash table of pointers to the elements of
+  /// reserved_words_, whose size is a power of two.  Whenever possible,
+  /// reserved_word_seed_ is chosen so that no two reserved words share a
+  /// slot, in which case reserved_word_max_probe_ is zero and every
+  /// lookup examines a single slot.
+  vector<const string *> reserved_word_table_;
+  uint32_t reserved_word_seed_ = 1;
+  int reserved_word_shift_ = 31;
+  size_t reserved_word_max_probe_ = 0;
+  /// A bit for every size of a reserved word, with bit 63 standing for
+  /// all sizes of 63 or more, so that most non-reserved words are
+  /// rejected without hashing.
+  uint64_t reserved_word_sizes_ = 0;
+  /// Whether any reserved word other than "-" looks like a number.
+  bool numeric_reserved_words_ = false;
 
   // Information about the current state of the underlying byte stream.
   size_t num_read_ = 0;
   size_t line_number_ = 0;
   size_t line_start_pos_ = 0;
   bool eof_reached_ = false;
-  ostringstream oss_;
-
-  // The sequence of tokens read so far.
-  vector<Token> token_;
+  // The characters read so far, starting at stream position
+  // history_start_, which is only ever nonzero in streaming mode.  This
+  // is unused when tokenizing from a buffer.
+  string history_;
+  size_t history_start_ = 0;
+
+  // The function with which characters no longer retained are re-read,
+  // if any.
+  RereadFunction reread_;
+
+  // Streaming mode state.
+  bool streaming_ = false;
+  size_t max_rewind_ = 0;
+  // The number of tokens discarded from the front of token_.
+  size_t num_dropped_ = 0;
+  // The start positions of all live Capture instances, oldest first.
+  vector<size_t> captures_;
+
+  // The sequence of tokens read so far (or, in streaming mode, only those
+  // retained).  This is a deque so that references to tokens remain
+  // valid as more tokens are read.
+  deque<Token> token_;
+  // The tokens being replayed, or nullptr if tokens are read from the
+  // underlying buffer or byte stream (in which case they are in token_).
+  const Token *replay_ = nullptr;
+  size_t replay_size_ = 0;
+
+  // The token returned by Peek and PeekPrev when there is no such token.
+  const string empty_;
 
   // The index of the next token in this stream in token_, or token_.size()
   // if there are no more tokens left in this stream.  Note that invocations
@@ -373,6 +742,86 @@ class StreamTokenizer {
   size_t next_token_idx_ = 0;
 };
 
+template <typename Callback>
+size_t
+StreamTokenizer::ScanNumberList(Callback &accept) {
+  if (buf_ == nullptr || replay_ != nullptr || !HasNext() ||
+      next_token_idx_ + 1 != token_.size() || PeekTokenType() != NUMBER) {
+    return 0;
+  }
+  Token &last = token_[next_token_idx_];
+  if (!accept(last.tok.data(), last.tok.size())) {
+    return 0;
+  }
+  size_t count = 1;
+
+  // The state of the underlying buffer just after the last accepted number.
+  size_t pos = num_read_;
+  size_t line_number = line_number_;
+  size_t line_start_pos = line_start_pos_;
+  size_t last_start = last.start;
+  size_t last_line_start_pos = last.line_start_pos;
+  size_t last_line_number = last.line_number;
+  while (true) {
+    size_t p = pos;
+    size_t l = line_number;
+    size_t ls = line_start_pos;
+    // Read a comma, then a number, each preceded by optional whitespace.
+    bool saw_comma = false;
+    for (;;) {
+      while (p < buf_size_ && Whitespace(buf_[p])) {
+        if (buf_[p++] == '\n') {
+          ++l;
+          ls = p;
+        }
+      }
+      if (saw_comma || p == buf_size_ || buf_[p] != ',') {
+        break;
+      }
+      saw_comma = true;
+      ++p;
+    }
+    if (!saw_comma || p == buf_size_ ||
+        !(buf_[p] == '-' || (buf_[p] >= '0' && buf_[p] <= '9'))) {
+      break;
+    }
+    size_t start = p;
+    while (p < buf_size_ && !EndsToken(buf_[p])) {
+      ++p;
+    }
+    // A number at the very end of the buffer, or a reserved word, is
+    // left to GetNext.  (Numbers that are reserved words other than "-",
+    // if any, must still be recognized as such.)
+    if (p == buf_size_ || (p - start == 1 && buf_[start] == '-') ||
+        (numeric_reserved_words_ && IsReservedWord(buf_ + start, p - start)) ||
+        !accept(buf_ + start, p - start)) {
+      break;
+    }
+    ++count;
+    pos = p;
+    line_number = l;
+    line_start_pos = ls;
+    last_start = start;
+    last_line_number = l;
+    last_line_start_pos = ls;
+  }
+
+  if (count > 1) {
+    // The next token becomes the last number of the run.
+    last.tok.assign(buf_ + last_start, pos - last_start);
+    last.start = last_start;
+    last.line_number = last_line_number;
+    last.line_start_pos = last_line_start_pos;
+    last.curr_pos = pos;
+    num_read_ = pos;
+    line_number_ = line_number;
+    line_start_pos_ = line_start_pos;
+  }
+  // Finally, consume it, just as Next would.
+  Next();
+  return count;
+}
+
 }  // namespace infact
 
 #endif